@@ -12,12 +12,34 @@
  *  challenge. Will you be the one to defeat the evil asteroid empire once and for all?!?!
  *
  */
+// The monotonic clock and nanosleep are POSIX, which strict C99 leaves out elsewhere.
+#if !defined(__APPLE__) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <GLUT/glut.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef HAVE_ALSA
+#include <alsa/asoundlib.h>
+#endif
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
@@ -34,64 +56,606 @@
 #define MAX_PHOTONS	8
 #define MAX_LARGE_ASTEROIDS 8
 #define MAX_ASTEROIDS 32
+#define MAX_WORLD_ASTEROIDS 128
 #define MAX_VERTICES 16
-#define MAX_STARS 50
+#define STAR_LAYERS 3
 #define MAX_DUST 32
 #define DUST_PARTICLES 15
+#define DUST_TICKS 7
 
 #define TIME_WAIT 50
 
+#define FONT_FIRST 32
+#define FONT_GLYPHS 64
+#define FONT_WIDTH 5
+#define FONT_HEIGHT 7
+#define ATLAS_CELL 8
+#define ATLAS_COLUMNS 16
+#define ATLAS_WIDTH (ATLAS_CELL*ATLAS_COLUMNS)
+#define ATLAS_HEIGHT (ATLAS_CELL*FONT_GLYPHS/ATLAS_COLUMNS)
+#define TEXT_PIXEL 0.3
+#define TEXT_MAX 32
+#define TEXT_CACHE_SIZE 16
+
 #define SHIP_VELOCITY_MAX 2.0
+#define SHIP_RADIUS 3.5
 #define ACCELERATION_STEP_FORWARD 0.1
 #define ACCELERATION_STEP_BACK -0.1
 
+#define SECTOR_SIZE 100.0
+#define SECTOR_TABLE_SIZE 512
+#define SECTOR_MAX_ROCKS 16
+#define SECTOR_SAFE_RADIUS 25.0
+
+#define SPATIAL_NODES (2*MAX_WORLD_ASTEROIDS - 1)
+/* Below these many slots the queries scan every asteroid, which is faster than the tree there.
+ * Raycasts walk the tree in the open world; the nearest and radius queries only would for a
+ * field larger than that.
+ */
+#define SPATIAL_RAY_SLOTS 64
+#define SPATIAL_NEAR_SLOTS 256
+
+#define AUTOPILOT_BUDGET_US 500
+#define AUTOPILOT_RESERVE_US 50
+#define AUTOPILOT_MOVES 6
+#define AUTOPILOT_MAX_HORIZON 64
+#define AUTOPILOT_HOLD 3
+#define AUTOPILOT_TARGETS 6
+#define AUTOPILOT_LOOKOUT 60.0
+#define AUTOPILOT_MARGIN 1.5
+#define AUTOPILOT_AIM 4.0
+#define AUTOPILOT_COOLDOWN 2
+#define AUTOPLAY_MAX_TICKS 200000
+
+#define INPUT_QUEUE_SIZE 256
+#define FRAME_FRESH 4
+#define STATS_FRAMES 300
+#define LATENCY_BUCKETS 100
+#define TICK_MS 33
+#define PACE_STEP 0.5
+#define PACE_MAX_TICKS 4
+#define RENDER_POLL_MAX_MS 32
+#define HIDDEN_WAIT_TICKS 30
+
+#define ECS_CHUNK_BYTES 16384
+#define ECS_CHUNKS 64
+#define ECS_ALIGN 64
+#define ECS_ALIGN_UP(n) (((n) + ECS_ALIGN - 1) & ~(ECS_ALIGN - 1))
+#define ECS_ARCHETYPES 8
+#define ECS_ENTITIES 16384
+#define ECS_COMMANDS 256
+
+#define MAX_ENEMIES 8192
+#define ENEMY_RADIUS 1.5
+#define ENEMY_TURN 10.0
+#define ENEMY_THRUST ACCELERATION_STEP_FORWARD
+#define ENEMY_THRUST_COS 0.7
+#define ENEMY_VELOCITY_MAX 1.2
+#define ENEMY_LEAD 10.0
+#define ENEMY_CRASH 0.8
+#define SWARM_PER_LEVEL 500
+#define SWARM_GRID 64
+#define SWARM_RADIUS 4.0
+#define SWARM_AVOID 6.0
+#define SWARM_ROCK_ENTRIES 16384
+#define SWARM_SAFE_DISTANCE 40.0
+#define SWARM_PURSUE 1.0
+#define SWARM_SEPARATE 0.8
+#define SWARM_ALIGN 0.4
+#define SWARM_COHERE 0.2
+#define SWARM_AVOIDANCE 3.0
+
+#define MAX_BOSSES 2
+#define MAX_BOSS_VERTICES 4096
+#define MIN_BOSS_VERTICES 8
+#define BOSS_LEAF_EDGES 4
+#define BOSS_NODES (2*MAX_BOSS_VERTICES/BOSS_LEAF_EDGES)
+#define BOSS_STACK 32
+#define BOSS_RADIUS 18.0
+#define BOSS_SPEED 0.15
+#define BOSS_SPIN 0.2
+#define BOSS_CRATER 4.0
+#define BOSS_CORE 0.3
+#define BOSS_SHATTER 0.4
+#define BOSS_PIECES 6
+
+#define SCORE_LARGE 20
+#define SCORE_MEDIUM 50
+#define SCORE_SMALL 100
+#define SCORE_ENEMY 10
+#define SCORE_CRATER 5
+#define SCORE_BOSS 1000
+#define SCORE_TOP 10
+#define SCORE_SHOWN 5
+#define SCORE_MAGIC 0x41535453u
+#define SCORE_VERSION 1
+#define SCORE_HEADER_BYTES 4096
+#define SCORE_SLOT_BYTES 2048
+#define SCORE_GROW 16384
+#define SCORE_GROUP 1024
+#define SCORE_GROUP_SECONDS 1.0
+
+#define TELEMETRY_COLUMNS 80
+#define TELEMETRY_ROWS 48
+#define TELEMETRY_LEVELS 16
+#define TELEMETRY_SECONDS 120
+#define TELEMETRY_BENCH_EVENTS 4000000
+
+#define MAX_LEVELS 64
+#define LEVEL_MAX_BODIES 64
+#define LEVEL_MAX_MASS 64
+#define LEVEL_RING_RADIUS 40.0
+#define LEVEL_FILE_BYTES 65536
+#define LEVEL_SEED 20121015u
+
+#define AUDIO_RATE 44100
+#define AUDIO_BLOCK 256
+#define AUDIO_VOICES 16
+#define AUDIO_QUEUE_SIZE 64
+#define AUDIO_POOL (2*AUDIO_RATE)
+#define AUDIO_DEVICE_US 20000
+
+#define COUNTER_BLOCKS 2
+#define COUNTER_WINDOW 1.0
+#define COUNTER_LINES 5
+
+#define TERM_MAX_COLUMNS 320
+#define TERM_MAX_ROWS 120
+#define TERM_OUT_BYTES (64*TERM_MAX_COLUMNS*TERM_MAX_ROWS)
+#define TERM_UNKNOWN 0xffffffffu
+#define TERM_ESCAPE_BYTES 16
+#define TERM_ESCAPE_WAIT 0.05
+
+// The cursor keys as bits of the held key state.
+#define KEY_LEFT 1
+#define KEY_UP 2
+#define KEY_RIGHT 4
+#define KEY_DOWN 8
+
+#define GRAVITY_MAX_BODIES 65536
+#define GRAVITY_MAX_NODES (2*GRAVITY_MAX_BODIES)
+#define GRAVITY_LEAF_SIZE 16
+#define GRAVITY_LIST_SIZE 1024
+#define GRAVITY_WELLS 2
+#define GRAVITY_WELL_MASS 3000.0
+#define GRAVITY_CONSTANT 0.002
+#define GRAVITY_SOFTENING 3.0
+#define GRAVITY_MAX_SPEED 3.0
+
 #define LARGE_SIZE 3.0
 #define MEDIUM_SIZE 2.0
 #define SMALL_SIZE 1.0
 
+#define SIZE_CLASSES 3
+#define SHAPES_PER_SIZE 256
+#define MAX_SHAPES (SIZE_CLASSES*SHAPES_PER_SIZE)
+
+// Every asteroid slot owns one extra shape for the pieces produced by a fracture.
+#define FRACTURE_SHAPE(slot) (MAX_SHAPES + (slot))
+#define FRACTURE_ARENA_SIZE (MAX_PHOTONS*8*MAX_VERTICES)
+#define FRACTURE_MIN_AREA 2.0
+#define FRACTURE_SPEED 0.4
+#define PHOTON_MASS 5.0
+
 /* -- type definitions ------------------------------------------------------ */
 
+/* The positions, velocities and outlines the game keeps are doubles. Building with
+ * -DCOMPACT_WORLD stores them as floats instead and packs the flags of the ship's explosion,
+ * which about halves what one world takes up. The playfield is small enough that floats
+ * play the same game; the sums along the way are still done in double.
+ */
+#ifdef COMPACT_WORLD
+typedef float Scalar;
+#else
+typedef double Scalar;
+#endif
+
 typedef struct Coords {
-	double		x, y;
+	Scalar		x, y;
 } Coords;
 
 typedef struct {
     int engine;
-	double	x, y, phi, dx, dy;
+	Scalar	x, y, phi, dx, dy;
     Coords coords[SHIP_VERTICES];
 } Ship;
 
+/* Photons, dust and the enemy ships of the swarm mode are entities. An entity is just an index into the entity table together
+ * with the generation of that slot, so a handle kept after its entity is gone is found out.
+ * What an entity is made of is its archetype, the set of components it has; every archetype
+ * keeps its entities in chunks, one array per component, and the systems walk those arrays
+ * for every archetype that has the components they need. Tags take no room, they only pick
+ * out archetypes.
+ */
+enum {
+    COMP_POSITION, COMP_VELOCITY, COMP_LIFETIME, COMP_FLICKER, COMP_CLOUD, COMP_HEADING,
+    COMP_DESIRE, COMP_BOUNDED, COMP_WRAPPED, COMP_BREAKS, COMPONENTS
+};
+#define HAS(c) (1u << (c))
+#define ARCH_PHOTON (HAS(COMP_POSITION) | HAS(COMP_VELOCITY) | HAS(COMP_BOUNDED) | HAS(COMP_BREAKS))
+#define ARCH_DUST (HAS(COMP_CLOUD) | HAS(COMP_LIFETIME) | HAS(COMP_FLICKER))
+#define ARCH_ENEMY (HAS(COMP_POSITION) | HAS(COMP_VELOCITY) | HAS(COMP_HEADING) | HAS(COMP_DESIRE) | HAS(COMP_WRAPPED))
+
+typedef unsigned int Entity;
+#define ENTITY_INDEX(e) ((e) & 0xffff)
+#define ENTITY_GENERATION(e) ((e) >> 16)
+#define ENTITY_GENERATION_MASK 0xffff
+#define ENTITY_HANDLE(index, generation) (((unsigned int)(generation) << 16) | (unsigned int)(index))
+#define NO_ENTITY 0xffffffffu
+
+typedef struct {
+	Scalar	x, y;
+} Position;
+
+typedef struct {
+	Scalar	dx, dy;
+} Velocity;
+
+typedef struct {
+    Coords coords[DUST_PARTICLES];
+} Cloud;
+
+// The way an enemy ship faces, kept as a unit vector so turning it needs no trigonometry.
+typedef struct {
+	Scalar	hx, hy;
+} Heading;
+
+// Where the components of an entity are: its archetype, which chunk of it and which row.
+typedef struct {
+    int archetype, chunk, row;
+    unsigned int generation;
+} EntityRecord;
+
+/* The entities with one set of components, packed into the front of its chunks. Each column
+ * of a chunk starts on a cache line at the offset kept here, -1 for components it lacks.
+ */
+typedef struct {
+    unsigned int mask;
+    int rows, count, limit, nChunks;
+    int offset[COMPONENTS];
+    int chunks[ECS_CHUNKS];
+} Archetype;
+
+typedef struct {
+    unsigned char data[ECS_CHUNK_BYTES] __attribute__((aligned(ECS_ALIGN)));
+} Chunk;
+
+// One chunk as a system sees it.
+typedef struct {
+    Archetype *archetype;
+    unsigned char *data;
+    int count;
+} ChunkView;
+
+#define chunkColumn(view, type, c) ((type *)((view)->data + (view)->archetype->offset[c]))
+
+// Changes to the entities and asteroids held back until the systems are done.
+enum { COMMAND_SPAWN, COMMAND_DESTROY, COMMAND_FRACTURE };
+
 typedef struct {
-	int	active;
-	double	x, y, dx, dy;
-} Photon;
+    int type, slot;
+    Entity entity;
+    unsigned int mask;
+    double x, y, dx, dy;
+} Command;
+
+/* An asteroid outline shared by any number of asteroids. The vertices are stored around
+ * the center in counter-clockwise order. The sector table holds the angle of each vertex
+ * and the outward half plane of the edge that closes that sector, so a point only has to be
+ * tested against the one edge of the sector it falls in. Pieces of a fracture are not always
+ * star shaped around their center, those fall back to a crossing count. The segment test
+ * is the copy of it made for this number of vertices, picked when the shape is built.
+ */
+typedef struct AsteroidShape AsteroidShape;
+typedef double (*SegmentKernel)(AsteroidShape *shape, double x0, double y0, double x1, double y1);
+struct AsteroidShape {
+    int nVertices, starShaped;
+    double size, radius, area;
+    Coords coords[MAX_VERTICES];
+    Scalar sectorAngle[MAX_VERTICES];
+    Scalar edgeNormalX[MAX_VERTICES], edgeNormalY[MAX_VERTICES], edgeOffset[MAX_VERTICES];
+    SegmentKernel segment;
+    int version;
+};
 
 typedef struct {
-	int	active, nVertices;
-	double	x, y, phi, dx, dy, dphi, size;
-	Coords	coords[MAX_VERTICES];
+	int	active, shape;
+	Scalar	x, y, phi, dx, dy, dphi;
 } Asteroid;
 
+#define asteroidShape(a) (&shapeLibrary[(a)->shape])
+
+/* A level as it was loaded or made up, along with its spawn table: where each of its
+ * asteroids comes in, as a fraction of the playfield plus an offset, and how it moves. A
+ * large asteroid counts as four small ones towards LEVEL_MAX_MASS, a medium one as two.
+ */
+enum { PATTERN_EDGES, PATTERN_RING, PATTERN_CORNERS, PATTERN_SCATTER, PATTERNS };
+
+typedef struct {
+    Scalar u, v, ox, oy, dx, dy, phi, dphi;
+    int shape;
+} LevelSpawn;
+
+typedef struct {
+    int number, large, medium, small, pattern, timeLimit;
+    double minSpeed, maxSpeed, spin;
+    int nBosses, bossVertices[MAX_BOSSES];
+    int nSpawns;
+    LevelSpawn spawns[LEVEL_MAX_BODIES];
+} Level;
+
+/* A copy of an asteroid at one of the places it shows up on the wrapping playfield. Bodies
+ * that cross an edge get an extra copy on the far side, and the collision tests and drawing
+ * only ever look at these copies.
+ */
+typedef struct {
+    int index;
+    Asteroid body;
+} AsteroidInstance;
+
 typedef struct {
     Coords coords[4];
 } StartBox;
 
+/* A box of the bounding volume tree over the asteroid slots. Leaves hold one slot and are
+ * empty boxes while that slot is inactive.
+ */
+typedef struct {
+    double minX, minY, maxX, maxY;
+    int left, right, slot;
+} SpatialNode;
+
+// An answer to a spatial query: which asteroid, how far away and where.
 typedef struct {
+    int index;
+    double distance, x, y;
+} SpatialHit;
+
+// The ways a game can be played, picked on the menu.
+enum { MODE_CLASSIC, MODE_WORLD, MODE_GRAVITY, MODE_SWARM, MODE_COUNT };
+
+// The menu always wraps, only a game in the open world scrolls.
+#define WORLD_ACTIVE (gameMode == MODE_WORLD && gameState > 0)
+
+// The asteroid slots in use: the other modes keep to the first MAX_ASTEROIDS, the open world
+// needs room for the nine live sectors.
+#define ASTEROID_SLOTS (WORLD_ACTIVE ? MAX_WORLD_ASTEROIDS : MAX_ASTEROIDS)
+
+// A point mass pulling on everything else in the gravity wells mode.
+typedef struct {
+    double x, y, mass;
+} GravityBody;
+
+/* A square of the Barnes-Hut quadtree, with the total mass and center of mass of everything
+ * in it. Every node covers a run of the bodies sorted in Morton order, from start up to end;
+ * leaves are small buckets of them rather than single bodies.
+ */
+typedef struct {
+    double x, y, size;
+    double cx, cy, mass;
+    int child[4];
+    int start, end, isLeaf;
+} GravityNode;
+
+// The masses a leaf of the tree gets pulled by, waiting to be added up.
+typedef struct {
+    double x[GRAVITY_LIST_SIZE], y[GRAVITY_LIST_SIZE], mass[GRAVITY_LIST_SIZE];
+    int count;
+} GravityList;
+
+/* An asteroid of a sleeping sector, packed down to what is needed to bring it back. The
+ * position is relative to the corner of its sector.
+ */
+typedef struct {
+    float x, y, dx, dy, phi, dphi;
+    unsigned short shape;
+} SleepingAsteroid;
+
+/* A sector of the open world that is not near the ship. Sectors are kept in a fixed size
+ * table; when two sectors land in the same slot the older one is dropped and will simply be
+ * generated again from the world seed if the ship ever comes back. A record with no rocks is
+ * a sector that was cleared, which stays empty.
+ */
+typedef struct {
+    int used, sx, sy, count;
+    SleepingAsteroid rocks[SECTOR_MAX_ROCKS];
+} Sector;
+
+/* One depth layer of the background starfield. The stars of a layer are compiled into a
+ * display list once and only rebuilt when the window is reshaped; scrolling the layer is
+ * just a translation of that list.
+ */
+typedef struct {
+    int nStars;
+    double depth, pointSize, brightness;
+    double offsetX, offsetY;
+    GLuint list;
+} StarLayer;
+
+/* A string laid out in glyphs of the font atlas and compiled into a display list of textured
+ * quads. It is kept for as long as the same text keeps being drawn in the same place.
+ */
+typedef struct {
+    char text[TEXT_MAX];
     double x, y;
-} Stars;
+    GLuint list;
+    unsigned int lastUsed;
+} TextBatch;
+
+/* The runtime counters, by name in counterNames. Counts only ever go up, gauges hold the
+ * latest value and are only set by one thread.
+ */
+enum {
+    COUNT_TICKS, COUNT_FRAMES, COUNT_PAIRS_TESTED, COUNT_PAIRS_HIT, COUNT_ALLOCATIONS,
+    COUNT_RANDOM, COUNT_DRAWN, COUNT_COMMANDS_DROPPED, COUNT_GRAVITY_OVERFLOW, GAUGE_ASTEROIDS, GAUGE_PHOTONS, GAUGE_DUST, GAUGE_ENEMIES,
+    GAUGE_FRAME_US, COUNTERS
+};
+#define FIRST_GAUGE GAUGE_ASTEROIDS
+
+/* Each thread bumps the counters in its own block with plain stores, and the blocks are
+ * only added up once a frame.
+ */
+typedef struct {
+    long value[COUNTERS];
+} CounterBlock;
+
+/* What a run leaves behind for balancing the levels: where on the screen the ship died, the
+ * photons hit asteroids and the ones that missed left the screen, and how long into the level
+ * that was, kept apart for every level. Like the counters each thread has its own block, but
+ * these are only added up once the run is over.
+ */
+enum { TELEMETRY_DEATH, TELEMETRY_HIT, TELEMETRY_MISS, TELEMETRY_KINDS };
+
+typedef struct {
+    unsigned int heat[TELEMETRY_KINDS][TELEMETRY_LEVELS][TELEMETRY_ROWS][TELEMETRY_COLUMNS];
+    unsigned int times[TELEMETRY_KINDS][TELEMETRY_LEVELS][TELEMETRY_SECONDS + 1];
+    long total[TELEMETRY_KINDS];
+} TelemetryBlock;
+
+#define countEvent(id, n) __atomic_store_n(&counters->value[id], counters->value[id] + (n), __ATOMIC_RELAXED)
+#define setGauge(id, v) __atomic_store_n(&counters->value[id], (long)(v), __ATOMIC_RELAXED)
 
 typedef struct {
     Coords coords[DUST_PARTICLES];
+#ifdef COMPACT_WORLD
+    unsigned short active : 1, drawThisFrame : 1, dustTimer : 14;
+#else
     int active;
     int dustTimer;
     int drawThisFrame;
+#endif
 } Dust;
 
+// An enemy ship as it is drawn, only where it is and which way it faces.
+typedef struct {
+    float x, y, hx, hy;
+} EnemyFrame;
+
+/* The outline of a boss asteroid, which can have thousands of vertices and be concave. Its
+ * edges are kept in a tree of boxes over runs of BOSS_LEAF_EDGES edges that follow each
+ * other around the outline, laid out as a complete binary tree with the root at 1 and the
+ * leaves from nLeaves on. The tree is in shape coordinates, so it is built when the outline
+ * changes and the asteroid can turn any way without touching it.
+ */
+typedef struct {
+    int nVertices, nLeaves, version;
+    double radius, area;
+    Coords coords[MAX_BOSS_VERTICES];
+    Scalar minX[BOSS_NODES], minY[BOSS_NODES], maxX[BOSS_NODES], maxY[BOSS_NODES];
+} BossShape;
+
+typedef struct {
+    int active;
+    Scalar x, y, phi, dx, dy, dphi;
+    double startArea;
+    BossShape shape;
+} Boss;
+
+/* A finished game as it is kept in the score log. Records are a fixed 64 bytes and end in a
+ * checksum of the rest, so one that was only partly written is found out when it is read.
+ * Games the autopilot flew any of are kept, but marked, and left off the leaderboard.
+ */
+typedef struct {
+    unsigned int magic, number;
+    int score, level, won, ticks, mode;
+    unsigned int seed, levelSeed, autopilot;
+    long long time;
+    unsigned int reserved[3];
+    unsigned int checksum;
+} RunRecord;
+
+typedef struct {
+    int score, level, ticks;
+    unsigned int seed, number;
+} ScoreEntry;
+
+/* The head of the score log, written into one of two slots in turn. It says how many records
+ * are known to be on disk and keeps the leaderboard, so a start up reads the leaderboard from
+ * here without going through the records at all.
+ */
+typedef struct {
+    unsigned int magic, version, recordSize, nTop;
+    unsigned long long sequence, committed;
+    ScoreEntry top[SCORE_TOP];
+    unsigned int checksum;
+} ScoreHeader;
+
+/* Everything the screens draw, copied out of the game once a tick is done. The drawing code
+ * only ever reads one of these, so with the simulation on its own thread it never sees half
+ * of a tick. Fracture pieces are rewritten when their slot is reused, so their outlines are
+ * copied along, but only when they changed.
+ */
+typedef struct {
+    int version, nVertices;
+    Coords coords[MAX_VERTICES];
+} FrameOutline;
+
+typedef struct {
+    void (*display)(void);
+    double xMax, yMax, cameraX, cameraY;
+    unsigned int inputsApplied;
+    int showCounters;
+    double starOffsetX[STAR_LAYERS], starOffsetY[STAR_LAYERS];
+    int gameState, gameMode, lives, timeLeft;
+    Ship ship, shipInstances[4];
+    int nShipInstances, nAsteroidInstances;
+    int nPhotons, nDust;
+    Dust shipExplosion;
+    Cloud dust[MAX_DUST];
+    Position photons[MAX_PHOTONS];
+    int nEnemies;
+    EnemyFrame enemies[MAX_ENEMIES];
+    Boss bosses[MAX_BOSSES];
+    int score, nBest;
+    ScoreEntry best[SCORE_SHOWN];
+    AsteroidInstance asteroidInstances[4*MAX_WORLD_ASTEROIDS];
+    FrameOutline outlines[MAX_WORLD_ASTEROIDS];
+} FrameState;
+
+/* The sounds of the game, made when the mixer starts and padded to whole blocks. Turning the
+ * engine off is only an event, it has no sound of its own.
+ */
+enum { SOUND_FIRE, SOUND_BREAK, SOUND_EXPLOSION, SOUND_ENGINE, SOUNDS, SOUND_ENGINE_OFF = SOUNDS };
+enum { SINK_NULL, SINK_WAV, SINK_ALSA };
+
+typedef struct {
+    float *pcm, gain;
+    int length, loop;
+} Sound;
+
+// A sound being played, with its gain ramping to the target over the next block.
+typedef struct {
+    int sound, position;
+    float gain, target;
+} Voice;
+
+typedef struct {
+    int sound;
+    double time;
+} SoundEvent;
+
+/* One character cell of the terminal. The glyph is a character, or one of the two that are
+ * sent as UTF-8; no glyph in a cell of text means the pixels underneath show through.
+ */
+enum { TERM_GLYPH_UNKNOWN = 0, TERM_GLYPH_HALF = 256, TERM_GLYPH_SHIP };
+
+typedef struct {
+    unsigned int glyph, fg, bg;
+} TermCell;
+
+// Keyboard, mouse and window events on their way from GLUT to the simulation thread.
+enum { INPUT_KEY, INPUT_SPECIAL_DOWN, INPUT_SPECIAL_UP, INPUT_MOUSE, INPUT_RESHAPE, INPUT_VISIBILITY };
+
+typedef struct {
+    int type, key, state, x, y;
+    double time;
+} InputEvent;
+
 /* -- function prototypes --------------------------------------------------- */
 
 // Collision Detectors
-static int PhotonCollision(Photon *p, Asteroid *a);
-static int ShipCollision(Coords *c, Asteroid *a);
+static int PhotonCollision(Position *p, Velocity *v, Asteroid *a, Coords *hit);
+static int ShipCollision(Ship *s, Asteroid *a);
 
 // Display Callbacks for the Three Screens
 static void	myGameDisplay(void);
@@ -114,34 +678,301 @@ static void	keyRelease(int key, int x, int y);
 static void mouseClick(int button, int state, int x, int y);
 
 static void	myReshape(int w, int h);
+static void windowStatus(int state);
 
 // Initialize functions for the menu and game sections
 static void	gameInit(void);
 static void	menuInit(void);
+static void menuAsteroids(void);
+static void initShip(void);
+static void startGame(void);
+
+// Advancing the playfield, shared by the game and the menu.
+static void stepGame(void);
+static int firePhoton(void);
+
+// The screens are chained through these so they can also run without a window.
+static void scheduleTimer(void (*timer)(int), int value);
+static void scheduleIdle(void (*timer)(int), int value, int ticks);
+static void showScreen(void (*display)(void));
+static void redisplay(void);
+static void pacedRedisplay(void);
+static double sceneMotion(void);
+static void wakeIdle(void);
+static void accountScreen(void (*display)(void));
+static const char *screenName(void (*display)(void));
+static double cpuSeconds(void);
+static void resizePlayfield(int w, int h);
+
+// Handing frames and input between the simulation and the drawing.
+static void publishFrame(void);
+static void acquireFrame(void);
+static void renderFrame(void);
+static void renderPoll(int value);
+static void *simulationThread(void *arg);
+static void stopSimulation(void);
+static void runTick(int value);
+
+// Timestamped input, applied in order at the start of each tick.
+static void queueInput(int type, int key, int state, int x, int y);
+static int popInput(InputEvent *event);
+static void handleInputs(void);
+static int keyBit(int key);
+static void applyKey(unsigned char key);
+static void applyClick(int button, int state, int x, int y);
+static void pressStart(void);
+static void recordLatency(long *buckets, long *count, double latency);
+
+// Counters shown over the HUD and dumped as JSON lines.
+static void sampleCounters(double now);
+static void dumpCounters(double time);
+static void drawCounters(void);
+static void formatCounters(char lines[COUNTER_LINES][TEXT_MAX]);
+static double latencyPercentile(long *buckets, long count, double fraction);
+static double monotonicSeconds(void);
+static double threadSeconds(void);
 
 // Initializes random asteroids of varying shapes and sizes.
 static void	initAsteroid(Asteroid *a, double x, double y, double size);
 
+// Library of precomputed asteroid outlines shared by all asteroids.
+static void buildShapeLibrary(void);
+static void buildShape(AsteroidShape *shape, double size, int nVertices, Coords *coords);
+static int shapeSector(AsteroidShape *shape, double x, double y);
+static int pointInShape(AsteroidShape *shape, double x, double y);
+
+// Splitting asteroids along the line of a photon impact.
+static void fractureAsteroid(Asteroid *a, double x, double y, double dx, double dy);
+static int clipPolygon(Coords *in, int n, double nx, double ny, double d, Coords *out);
+static int simplifyPolygon(Coords *coords, int n, int maxVertices);
+static double polygonCentroid(Coords *coords, int n, Coords *centroid);
+static Coords *fractureAlloc(int n);
+
+// Swept tests between the start and end positions of a tick.
+static double segmentAsteroid(Asteroid *a, double x0, double y0, double x1, double y1);
+static double segmentPolygon(Coords *poly, int n, double x0, double y0, double x1, double y1);
+static double segmentShape(AsteroidShape *shape, double x0, double y0, double x1, double y1);
+static SegmentKernel segmentKernel(int n);
+static int pointInPolygon(Coords *poly, int n, double x, double y);
+static void shipVertices(Ship *s, Coords *out);
+
+// Exact overlap of the ship triangle and an asteroid outline.
+static int shipAsteroidOverlap(Coords *corners, Asteroid *a);
+static int trianglesOverlap(Coords *a, Coords *b);
+static int polygonsOverlap(Coords *a, int na, Coords *b, int nb);
+
+// Copies of the bodies that cross the edges of the wrapping playfield.
+static void wrapPosition(Scalar *x, Scalar *y);
+static int wrapOffsets(double x, double y, double r, Coords *offsets);
+static void buildInstances(void);
+
+// Streaming sectors of the open world around the ship.
+static void resetWorld(void);
+static void updateCamera(void);
+static void streamSectors(void);
+static Sector *sectorRecord(int sx, int sy, int generate);
+static void generateSector(Sector *sector);
+static void sleepAsteroid(Asteroid *a, int generate);
+static void wakeSector(int sx, int sy);
+static void loadWorldMatrix(void);
+static unsigned int worldRandom(unsigned int *state);
+static double worldRange(unsigned int *state, double min, double max);
+
+// Spatial queries over the live asteroids, for anything that needs to look around the field.
+static void buildSpatialTree(void);
+static int spatialNode(int *slots, int n);
+static void refitSpatialTree(void);
+static double spatialArea(void);
+static int raycastAsteroids(double x, double y, double dirX, double dirY, double maxDist, SpatialHit *hit);
+static void spatialRaycast(double x, double y, double ex, double ey, double *best, int *bestSlot);
+static void spatialScanRay(double x, double y, double ex, double ey, int wrap, double *best, int *bestSlot);
+static int spatialOverlap(double lo, double hi, double shift, double min, double max);
+static double spatialRayBox(SpatialNode *s, double x, double y, double ex, double ey);
+static int nearestAsteroids(double x, double y, int k, SpatialHit *hits);
+static int spatialKeepNearest(int slot, double x, double y, int k, SpatialHit *hits, int count);
+static int asteroidsInRadius(double x, double y, double radius, SpatialHit *hits, int max);
+static int spatialKeepInRadius(int slot, double x, double y, double radius, SpatialHit *hits, int count);
+static double spatialBoxDistance(SpatialNode *s, double x, double y);
+static double spatialIntervalDistance(double lo, double hi, double p, double size);
+static double spatialWrapDelta(double d, double size);
+
+// The built in player, used behind the menu and for headless runs.
+static void autopilotTick(void);
+static int autopilotTarget(double *aimPhi);
+static double autopilotScore(int move, int horizon, SpatialHit *threats, int nThreats, double aimPhi, double deadline);
+static double angleDifference(double to, double from);
+static void runAutoplay(int games);
+
+// Barnes-Hut gravity for the gravity wells mode.
+static void applyGravity(void);
+static int buildGravityTree(GravityBody *bodies, int n);
+static void gravityNode(int node, double x, double y, double size, int start, int end, int depth);
+static void gravityAt(int root, double x, double y, double *ax, double *ay);
+static void gravityAll(int root, double *ax, double *ay);
+static void gravityFlush(GravityList *list, int first, int bodies, double *sumX, double *sumY);
+static void drawWells(void);
+
+// Entities kept in archetype chunks, and the systems that run over them.
+static int findArchetype(unsigned int mask);
+static Entity spawnEntity(unsigned int mask);
+static void destroyEntity(Entity e);
+static void clearEntities(unsigned int need);
+static int countEntities(unsigned int need);
+static int entityAlive(Entity e);
+static void *entityComponent(Entity e, int component);
+static int queryChunks(unsigned int need, ChunkView *views);
+static void queueCommand(int type, Entity e, unsigned int mask, int slot, double x, double y, double dx, double dy);
+static int fracturePending(int slot);
+static void flushCommands(void);
+static void initEntity(Entity e, double x, double y, double dx, double dy);
+static void movementSystem(void);
+static void boundsSystem(void);
+static void lifetimeSystem(void);
+static void collisionSystem(void);
+static void renderSystem(FrameState *f);
+
+// The enemy ships of the swarm mode, steering as a flock and flying like the player's ship.
+static void spawnSwarm(int n);
+static void addEnemies(int n);
+static void swarmSystem(void);
+static void buildSwarmGrid(ChunkView *views, int n);
+static int swarmCell(double x, double y);
+static void steerEnemy(Position *p, Velocity *v, Velocity *desire);
+static void steerShips(Velocity *velocity, Heading *heading, const Velocity *desire, int n, double thrust,
+                       double maxSpeed, double turnCos, double turnSin);
+static void swarmCollisions(void);
+static int nearestEnemy(double x0, double y0, double x1, double y1, double within);
+static void drawEnemies(void);
+
+// Boss asteroids with outlines too big to test edge by edge, and the tree that saves doing so.
+static void spawnBosses(Level *level);
+static void makeBossShape(BossShape *shape, int n, double radius, unsigned int *state);
+static void buildBossTree(BossShape *shape);
+static int pointInBoss(BossShape *shape, double x, double y);
+static double segmentBoss(BossShape *shape, double x0, double y0, double x1, double y1);
+static double segmentBossAsteroid(Boss *b, double x0, double y0, double x1, double y1);
+static void bossSystem(void);
+static void carveBoss(Boss *b, double x, double y);
+static void shatterBoss(Boss *b);
+static int bossesLeft(void);
+static void drawBosses(void);
+
+// High scores and a summary of every run, kept in a memory mapped log.
+static int openScores(const char *path);
+static void closeScores(void);
+static void dropScores(void);
+static int growScores(long capacity);
+static RunRecord *scoreRecord(long number);
+static int recordRun(RunRecord *run);
+static void commitScores(void);
+static void insertTop(ScoreHeader *header, RunRecord *run);
+static int validHeader(ScoreHeader *header);
+static unsigned int scoreChecksum(const void *data, size_t size);
+static void endRun(void);
+
+// Heatmaps and histograms of deaths, hits and misses, written out when the run is over.
+static void recordEvent(int kind, double x, double y);
+static void mergeTelemetry(TelemetryBlock *blocks, int n, TelemetryBlock *into);
+static void exportTelemetry(void);
+static void writeHeatmap(const char *path, unsigned int heat[TELEMETRY_ROWS][TELEMETRY_COLUMNS]);
+
+// Levels read from a file or made up, each compiled into a spawn table before the game starts.
+static void loadLevels(const char *path);
+static int parseLevels(char *text, const char *name);
+static void compileLevel(Level *level);
+static void seedLevels(unsigned int seed);
+static void generateLevel(int number);
+static Level *levelFor(int number);
+static void spawnLevel(int number);
+static int gameWon(int level);
+static int levelTimeLeft(void);
+
+// Sound effects mixed on a thread of their own.
+static void startAudio(const char *sink);
+static void stopAudio(void);
+static int playSound(int sound);
+static void engineSound(int on);
+static void *audioThread(void *arg);
+static void mixNext(double played);
+static void catchUpAudio(double now);
+static int popSound(SoundEvent *event);
+static void startVoice(int sound);
+static void mixBlock(short *out);
+static void buildSounds(void);
+static void writeWavHeader(FILE *file, long frames);
+static void writeLittle(unsigned char *at, long value, int bytes);
+
+// Playing in the terminal, drawn with half block characters.
+static void runTerminal(void);
+static void restoreTerminal(void);
+static void terminalSignal(int signal);
+static void readTerminal(int timedOut);
+static int terminalSize(void);
+static void drawTerminal(void);
+static void rasterTerminal(void);
+static void terminalStars(void);
+static void terminalPlayfield(void);
+static void terminalDust(Coords *coords, double x, double y, double phi, unsigned int *noise);
+static int terminalPolygon(Coords *coords, int n, double x, double y, double phi, unsigned int color);
+static void terminalBoss(Boss *b, unsigned int color);
+static void terminalLine(double x0, double y0, double x1, double y1, unsigned int color);
+static void terminalWorldPixel(double x, double y, unsigned int color);
+static int terminalPixel(int x, int y, unsigned int color);
+static void terminalWorldText(const char *text, double x, double y, unsigned int color);
+static void terminalText(const char *text, int row, int column, unsigned int color);
+static int diffTerminal(char *out);
+static unsigned int terminalColor(unsigned int rgb);
+static int terminalSgr(char *out, int layer, unsigned int color);
+static void termWrite(const char *bytes, int length);
+
+// Micro benchmarks run with the -bench argument instead of the game.
+static void runBenchmarks(void);
+static int benchThreads(int n);
+static void benchShipCollision(void);
+static void benchWrapInstances(void);
+static void benchGravity(void);
+static void benchSpatialQueries(void);
+static void benchSpatialField(void);
+static void benchSegmentKernels(void);
+static void benchWorldSize(void);
+static void benchEntities(void);
+static void benchTerminal(void);
+static void benchSwarm(void);
+static void benchBossCollision(void);
+static void benchScores(void);
+static void benchTelemetry(void);
+
 // Functions to draw the specific objects related to the game.
 static void	drawShip(Ship *s);
-static void drawLives(int lives);
-static void drawText(char *, void * font, double x, double y);
-static void drawDust(Dust *dust);
-static void	drawPhoton(Photon *p);
+static void drawText(char *text, double x, double y);
+static void drawDust(Coords *coords);
+static void	drawPhoton(Position *p);
 static void	drawAsteroid(Asteroid *a);
-static void drawMenu(void * font);
-static void drawRotatingShip();
-static void drawStars(Stars *stars);
+static void drawMenu(void);
+static void drawPlayfield(void);
+static void drawHud(void);
+
+// Text drawn from a font atlas, with the laid out strings cached.
+static void buildFontAtlas(void);
+static int glyphIndex(char c);
+static TextBatch *textBatch(const char *text, double x, double y);
+static void emitText(const char *text, double x, double y);
+static void drawString(const char *text, double x, double y);
+static void beginText(void);
+static void endText(void);
+
+// Background starfield with parallax depth layers.
+static void buildStarfield(double width, double height);
+static void scrollStarfield(double dx, double dy);
+static void drawStarfield(void);
 
 // Helper classes to be used with the program.
 static double myRandom(double min, double max);
 static int withinBox(double x, double y, StartBox *box);
 static int findInactiveAsteroid();
-static int findInactivePhoton();
 static void updateVelocity(int state);
 static int levelBeat();
 static char * getLevelNumber();
-static void activateDust(double x, double y);
 static void activateExplosion(double x, double y);
 
 /* -- global variables ------------------------------------------------------ */
@@ -151,43 +982,415 @@ static double	xMax, yMax;
 
 // Objects to be drawn in side the coordinate system.
 static Ship	ship;
-static Photon	photons[MAX_PHOTONS];
-static Asteroid	asteroids[MAX_ASTEROIDS];
+static Asteroid	asteroids[MAX_WORLD_ASTEROIDS];
+static AsteroidShape shapeLibrary[MAX_SHAPES + MAX_WORLD_ASTEROIDS];
+static GLuint shapeLists[MAX_SHAPES + MAX_WORLD_ASTEROIDS];
+static int shapeListVersion[MAX_SHAPES + MAX_WORLD_ASTEROIDS];
+static Coords fractureArena[FRACTURE_ARENA_SIZE];
+static AsteroidInstance asteroidInstances[4*MAX_WORLD_ASTEROIDS];
+static int nAsteroidInstances = 0;
+static Ship shipInstances[4];
+static int nShipInstances = 0;
+
+// The open world, the camera only moves in that mode.
+static Sector sectorTable[SECTOR_TABLE_SIZE];
+static unsigned int worldSeed = 0;
+static int activeSectorX = 0, activeSectorY = 0;
+static double cameraX = 0.0, cameraY = 0.0;
+
+/* The spatial tree keeps its shape between ticks and only has its boxes moved, it is built
+ * again when those have grown too loose. spatialBuilt is the number of slots it covers.
+ */
+static SpatialNode spatialNodes[SPATIAL_NODES];
+static int spatialNodesUsed = 0, spatialBuilt = 0;
+static double spatialBuiltArea = 0.0;
+
+/* The gravity tree is rebuilt every tick in this node pool, which is simply emptied rather
+ * than freed node by node. The bodies are copied into it sorted, split into separate arrays
+ * of positions and masses for the force loops.
+ */
+static GravityBody gravityBodies[GRAVITY_MAX_BODIES];
+static GravityNode gravityNodes[GRAVITY_MAX_NODES];
+static int gravityNodesUsed = 0;
+static int gravityLeaves[GRAVITY_MAX_NODES];
+static int gravityLeafCount = 0;
+static unsigned int gravityKeys[GRAVITY_MAX_BODIES], gravityKeysSorted[GRAVITY_MAX_BODIES];
+static int gravityOrder[GRAVITY_MAX_BODIES], gravityOrderSorted[GRAVITY_MAX_BODIES];
+static double gravityX[GRAVITY_MAX_BODIES], gravityY[GRAVITY_MAX_BODIES], gravityMass[GRAVITY_MAX_BODIES];
+static double gravityTheta = 0.5;
+static int fractureArenaUsed = 0;
 static StartBox startbox;
-static Stars stars[MAX_STARS];
-static Dust dust[MAX_DUST];
+static StarLayer starLayers[STAR_LAYERS] = {
+    /* nStars, depth, pointSize, brightness */
+    {20000, 0.05, 1.0, 0.35},
+    { 6000, 0.15, 1.5, 0.6},
+    {  800, 0.40, 2.0, 1.0},
+};
 static Dust shipExplosion;
 
+/* The entities live in a fixed pool of chunks that archetypes take and give back whole. The
+ * entity table and the pool both reuse freed slots before touching new ones.
+ */
+static Chunk chunkPool[ECS_CHUNKS];
+static int freeChunks[ECS_CHUNKS], nFreeChunks = 0, chunksUsed = 0;
+static Archetype archetypes[ECS_ARCHETYPES];
+static int nArchetypes = 0;
+static EntityRecord entityTable[ECS_ENTITIES];
+static int freeEntities[ECS_ENTITIES], nFreeEntities = 0, entitiesUsed = 0;
+static Command commands[ECS_COMMANDS];
+static int nCommands = 0;
+static const int componentSize[COMPONENTS] = {
+    sizeof(Position), sizeof(Velocity), sizeof(int), sizeof(int), sizeof(Cloud), sizeof(Heading),
+    sizeof(Velocity), 0, 0, 0
+};
+// How many of the game's own kinds of entity can be around at once.
+static const unsigned int archetypeLimits[][2] = {
+    {ARCH_PHOTON, MAX_PHOTONS}, {ARCH_DUST, MAX_DUST}, {ARCH_ENEMY, MAX_ENEMIES}
+};
+
+/* The enemy ships sorted into a grid over the playfield each tick, with their positions and
+ * velocities copied out cell by cell, and the asteroid copies each cell is close to.
+ */
+static Scalar swarmX[MAX_ENEMIES], swarmY[MAX_ENEMIES], swarmDX[MAX_ENEMIES], swarmDY[MAX_ENEMIES];
+static Entity swarmEntity[MAX_ENEMIES];
+static unsigned char swarmLost[MAX_ENEMIES];
+static int swarmCellStart[SWARM_GRID*SWARM_GRID + 1], swarmRockStart[SWARM_GRID*SWARM_GRID + 1];
+static int swarmRocks[SWARM_ROCK_ENTRIES];
+static int swarmColumns = 3, swarmRows = 3;
+static double swarmCellW = 1.0, swarmCellH = 1.0;
+
+// The boss asteroids of the level being played, kept apart from the asteroids and their shapes.
+static Boss bosses[MAX_BOSSES];
+
+/* The score log mapped into memory: the header page, then the records. The newest header is
+ * kept here as well, and records past the committed ones aren't known to be on disk yet.
+ */
+static int scoreFd = -1;
+static unsigned char *scoreMap = NULL;
+static long scoreCapacity = 0, scoreCount = 0, scoreCommits = 0;
+static ScoreHeader scoreBoard;
+static double scoreCommitTime = 0.0, scoreGroupSeconds = SCORE_GROUP_SECONDS;
+static const char *scorePath = NULL;
+
+// The score of the game being played, how long it has gone on, whether the autopilot flew any
+// of it and the seed it started from.
+static int score = 0, runTicks = 0, runAutopilot = 0;
+static unsigned int runSeed = 0, seedOverride = 0;
+
 // Help control the state of the game and certain animations
 static int lives = 3;
-static int otherFrame = 0;
 static int gameState = 0;
 static int betweenLevelTimer = 0;
 
+/* The autopilot plays when switched on in a game and always behind the menu. Without a
+ * window the next timer is kept here instead of being handed to GLUT. A batch run is
+ * -autoplay, which plays as fast as it can instead of in real time.
+ */
+static int autopilot = 0, headless = 0, batchRun = 0;
+static void (*pendingTimer)(int) = NULL;
+static int pendingValue = 0;
+
+/* The next timer is due after pendingTicks ticks. A screen with nothing to animate waits
+ * more than one and counts as idle until then, drawing nothing and only waking up early
+ * for input. Moving screens draw a frame only as often as their motion needs.
+ */
+static int pendingTicks = 1, redrawWanted = 0, screenFrames = 0, windowHidden = 0;
+static long autopilotDecisions = 0, autopilotOverBudget = 0, autopilotDepth = 0;
+static double autopilotTime = 0.0, autopilotWorst = 0.0;
+
+/* Finished frames go through three buffers: the simulation fills the back one and swaps it
+ * with the middle one, and the drawing swaps the middle one for its front one whenever the
+ * middle one is marked fresh. Neither side ever waits for the other. The drawing code reads
+ * the game only through view.
+ */
+static FrameState frames[3];
+static int frameBack = 0, frameMiddle = 1, frameFront = 2;
+static FrameState *view = &frames[2];
+static void (*currentScreen)(void) = NULL;
+
+/* The GLUT callbacks only queue up input, and the game takes it off at the start of each
+ * tick, on its own thread with -threaded. The queue has one producer and one consumer so it
+ * needs no lock. Each frame records how much of the queue had been applied when it was made,
+ * which is what times the latency from an event to the first frame showing it.
+ */
+static int threaded = 0, showStats = 0, simRunning = 0;
+static pthread_t simThread;
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t simWake = PTHREAD_COND_INITIALIZER;
+static InputEvent inputQueue[INPUT_QUEUE_SIZE];
+static unsigned int inputHead = 0, inputTail = 0;
+static int keysDown = 0;
+static long latencyBuckets[LATENCY_BUCKETS + 1];
+static long latencyCount = 0;
+
+/* Sound events go from the game to the mixer through a queue with one producer and one
+ * consumer, like the input. The voices are only ever touched by the mixer thread.
+ */
+static SoundEvent audioQueue[AUDIO_QUEUE_SIZE];
+static unsigned int audioHead = 0, audioTail = 0;
+static Sound sounds[SOUNDS];
+static Voice voices[AUDIO_VOICES];
+static int audioRunning = 0, audioSink = SINK_NULL;
+static pthread_t audioThreadId;
+static FILE *audioFile = NULL;
+static long audioFrames = 0, audioOverruns = 0, audioDropped = 0;
+static long audioLatency[LATENCY_BUCKETS + 1], audioLatencyCount = 0;
+static double audioMixTime = 0.0;
+// The time of the game in a batch run, which the mixer follows there instead of the clock.
+static double audioGameTime = 0.0;
+#ifdef HAVE_ALSA
+static snd_pcm_t *alsaPcm = NULL;
+#endif
+
+/* The terminal is drawn as pixels two to a cell with text on top, and compared with the
+ * cells it already shows so that only those that changed are sent.
+ */
+static unsigned int termPixels[2*TERM_MAX_ROWS][TERM_MAX_COLUMNS];
+static TermCell termOverlay[TERM_MAX_ROWS][TERM_MAX_COLUMNS], termShown[TERM_MAX_ROWS][TERM_MAX_COLUMNS];
+static char termOut[TERM_OUT_BYTES], termStatus[TERM_MAX_COLUMNS + 1];
+static int termColumns = 0, termRows = 0, termWidth = 0, termHeight = 0;
+static int termTrueColor = 0, termCleared = 0, termRaw = 0;
+static volatile sig_atomic_t termQuit = 0;
+// The start of an escape sequence that hadn't all come in by the end of the last read.
+static unsigned char termHeld[TERM_ESCAPE_BYTES];
+static int termHeldCount = 0;
+static double termHeldSince = 0.0;
+static struct termios termSaved;
+static unsigned int termNoise = 1;
+static long termFrames = 0, termBytes = 0, termMaxBytes = 0;
+static double termTime = 0.0;
+static int gameMode = MODE_CLASSIC;
+static char *modeNames[MODE_COUNT] = {"CLASSIC", "OPEN SPACE", "GRAVITY WELLS", "SWARM"};
+
+/* The loaded levels, then two spawn tables that take turns holding the made up level being
+ * played and the one after it. Without a level file these are the levels played.
+ */
+static Level levels[MAX_LEVELS + 2];
+static int levelCount = 0, levelsEndless = 0, levelTicks = 0;
+static unsigned int levelSeed = LEVEL_SEED;
+// Set when the level file picks the seed, otherwise every game gets its own from its seed.
+static int levelSeedFixed = 0;
+static char *patternNames[PATTERNS] = {"edges", "ring", "corners", "scatter"};
+static const char *builtinLevels =
+    "# The eight levels of the classic game, one more large asteroid each time.\n"
+    "level large 1\n"
+    "level large 2\n"
+    "level large 3\n"
+    "level large 4\n"
+    "level large 5\n"
+    "level large 6\n"
+    "level large 7\n"
+    "level large 8\n"
+    "# After those they are made up, harder every level.\n"
+    "endless\n";
+
+/* A 5x7 font covering space to underscore, one byte per row with the leftmost pixel in the
+ * high bit. It is drawn into the atlas once, which is uploaded as a texture the first time
+ * text is drawn and kept in memory as well.
+ */
+static const unsigned char font5x7[FONT_GLYPHS][FONT_HEIGHT] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /*   */
+    {0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04}, /* ! */
+    {0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00}, /* " */
+    {0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a}, /* # */
+    {0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04}, /* $ */
+    {0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03}, /* % */
+    {0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d}, /* & */
+    {0x04, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00}, /* ' */
+    {0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02}, /* ( */
+    {0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08}, /* ) */
+    {0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00}, /* * */
+    {0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00}, /* + */
+    {0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08}, /* , */
+    {0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00}, /* - */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c}, /* . */
+    {0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00}, /* / */
+    {0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e}, /* 0 */
+    {0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e}, /* 1 */
+    {0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f}, /* 2 */
+    {0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e}, /* 3 */
+    {0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02}, /* 4 */
+    {0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e}, /* 5 */
+    {0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e}, /* 6 */
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08}, /* 7 */
+    {0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e}, /* 8 */
+    {0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c}, /* 9 */
+    {0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00}, /* : */
+    {0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08}, /* ; */
+    {0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02}, /* < */
+    {0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00}, /* = */
+    {0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08}, /* > */
+    {0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04}, /* ? */
+    {0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e}, /* @ */
+    {0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11}, /* A */
+    {0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e}, /* B */
+    {0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e}, /* C */
+    {0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c}, /* D */
+    {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f}, /* E */
+    {0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10}, /* F */
+    {0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f}, /* G */
+    {0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11}, /* H */
+    {0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e}, /* I */
+    {0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c}, /* J */
+    {0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11}, /* K */
+    {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f}, /* L */
+    {0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11}, /* M */
+    {0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11}, /* N */
+    {0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}, /* O */
+    {0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10}, /* P */
+    {0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d}, /* Q */
+    {0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11}, /* R */
+    {0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e}, /* S */
+    {0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04}, /* T */
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e}, /* U */
+    {0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04}, /* V */
+    {0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a}, /* W */
+    {0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11}, /* X */
+    {0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04}, /* Y */
+    {0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f}, /* Z */
+    {0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e}, /* [ */
+    {0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00}, /* backslash */
+    {0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e}, /* ] */
+    {0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00}, /* ^ */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f}, /* _ */
+};
+static unsigned char fontAtlas[ATLAS_HEIGHT][ATLAS_WIDTH];
+static int fontAtlasBuilt = 0;
+static GLuint fontTexture = 0;
+static TextBatch textCache[TEXT_CACHE_SIZE];
+static unsigned int textClock = 0;
+
+/* The counters of the main thread and the simulation thread. Every second the totals are
+ * turned into the rates shown by the overlay, and with -counters they are also printed as a
+ * line of JSON every counterInterval seconds.
+ */
+static CounterBlock counterBlocks[COUNTER_BLOCKS];
+static __thread CounterBlock *counters = &counterBlocks[0];
+static const char *counterNames[COUNTERS] = {
+    "ticks", "frames", "pairs_tested", "pairs_hit", "allocations",
+    "random_draws", "objects_drawn", "commands_dropped", "gravity_overflow", "asteroids", "photons", "dust", "enemies", "frame_us"
+};
+static long counterTotals[COUNTERS], counterWindow[COUNTERS];
+static double counterRates[COUNTERS];
+static double counterInterval = 0.0;
+static int showCounters = 0;
+
+// The telemetry blocks of the same two threads, and where -telemetry writes them out.
+static TelemetryBlock telemetryBlocks[COUNTER_BLOCKS];
+static __thread TelemetryBlock *telemetry = &telemetryBlocks[0];
+static const char *telemetryNames[TELEMETRY_KINDS] = {"deaths", "hits", "misses"};
+static const char *telemetryPath = NULL;
+
+// The HUD is kept in a display list, built again only when what it shows changes.
+static GLuint hudList = 0;
+static int hudGameState = -1, hudMode = -1;
+static double hudXMax = -1.0, hudYMax = -1.0;
+
 /* -- main ------------------------------------------------------------------ */
 
 int
 main(int argc, char *argv[])
 {
+    const char *audio = NULL, *levelFile = NULL, *scoreFile = NULL;
+    static char homeScores[4096];
+    int terminal = 0;
+    
     srand((unsigned int) time(NULL));
     
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-threaded") == 0){
+            threaded = 1;
+        }else if(strcmp(argv[i], "-stats") == 0){
+            showStats = 1;
+        }else if(strcmp(argv[i], "-counters") == 0 && i + 1 < argc){
+            counterInterval = atof(argv[++i]);
+        }else if(strcmp(argv[i], "-audio") == 0 && i + 1 < argc){
+            audio = argv[++i];
+        }else if(strcmp(argv[i], "-terminal") == 0){
+            terminal = 1;
+        }else if(strcmp(argv[i], "-levels") == 0 && i + 1 < argc){
+            levelFile = argv[++i];
+        }else if(strcmp(argv[i], "-scores") == 0 && i + 1 < argc){
+            scoreFile = argv[++i];
+        }else if(strcmp(argv[i], "-seed") == 0 && i + 1 < argc){
+            seedOverride = (unsigned int)strtoul(argv[++i], NULL, 0);
+        }else if(strcmp(argv[i], "-telemetry") == 0 && i + 1 < argc){
+            telemetryPath = argv[++i];
+        }
+    }
+    loadLevels(levelFile);
+    if(argc > 1 && strcmp(argv[1], "-bench") == 0){
+        runBenchmarks();
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "-autoplay") == 0){
+        batchRun = 1;
+    }
+    /* The scores are kept in the home directory unless -scores says where, or none to not keep
+     * them. A batch run keeps none unless asked to, so it doesn't fill up the player's log.
+     */
+    if(scoreFile == NULL && batchRun){
+        scoreFile = "none";
+    }else if(scoreFile == NULL){
+        snprintf(homeScores, sizeof(homeScores), "%s%s.asteroids-scores",
+                 (getenv("HOME") != NULL) ? getenv("HOME") : "", (getenv("HOME") != NULL) ? "/" : "");
+        scoreFile = homeScores;
+    }
+    if(strcmp(scoreFile, "none") != 0 && openScores(scoreFile)){
+        atexit(closeScores);
+    }
+    if(telemetryPath != NULL){
+        atexit(exportTelemetry);
+    }
+    if(audio != NULL){
+        startAudio(audio);
+    }
+    if(argc > 1 && strcmp(argv[1], "-autoplay") == 0){
+        runAutoplay((argc > 2 && argv[2][0] != '-') ? atoi(argv[2]) : 1);
+        return 0;
+    }
+    if(terminal){
+        runTerminal();
+        return 0;
+    }
+    
+    // A game with a window plays through the sound card unless -audio says otherwise.
+#ifdef HAVE_ALSA
+    if(audio == NULL){
+        startAudio("alsa");
+    }
+#endif
+    
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE|GLUT_RGB);
     glutInitWindowSize(1000, 600);
     glutCreateWindow("Asteroids");
     
-    glutDisplayFunc(myMenuDisplay);
+    glutDisplayFunc(renderFrame);
     glutIgnoreKeyRepeat(1);
     glutKeyboardFunc(myKey);
     glutSpecialFunc(keyPress);
     glutSpecialUpFunc(keyRelease);
     glutReshapeFunc(myReshape);
     glutMouseFunc(mouseClick);
-    glutTimerFunc(33, menuMyTimer, 0);
+    glutWindowStatusFunc(windowStatus);
     glClearColor(0.0, 0.0, 0.0, 1.0);
     glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
     
+    // The playfield starts out the shape of the window, before the first reshape comes in.
+    resizePlayfield(1000, 600);
+    buildShapeLibrary();
     menuInit();
+    showScreen(myMenuDisplay);
+    
+    scheduleTimer(menuMyTimer, 0);
+    if(threaded){
+        simRunning = 1;
+        pthread_create(&simThread, NULL, simulationThread, NULL);
+        // Handlers run last registered first, so the game stops before the scores and telemetry are written.
+        atexit(stopSimulation);
+        glutTimerFunc(4, renderPoll, 4);
+    }
     
     glutMainLoop();
     
@@ -206,38 +1409,18 @@ myMenuDisplay(){
      */
     glClear(GL_COLOR_BUFFER_BIT);
     
-    // Set the point size of the stars.
-    glPointSize(2.0);
-    
     // Draw the stars in the back.
-    for(int i = 0; i < MAX_STARS; i++){
-        glLoadIdentity();
-        drawStars(&stars[i]);
-    }
+    drawStarfield();
     
     // Reset the point size back to 4.0 for the photon shots.
     glPointSize(4.0);
     
-    // Load and store the identity matrix twice for use with the photons and asteroids.
-    glLoadIdentity();
+    // Draw the autopilot's game going on behind the menu.
+    drawPlayfield();
     
-    // Draw out the asteroids.
-    for(int i = 0; i < MAX_ASTEROIDS; i++){
-        if(asteroids[i].active){
-            glLoadIdentity();
-            myTranslate2D(asteroids[i].x, asteroids[i].y);
-            myRotate2D(DEG2RAD*asteroids[i].phi);
-            drawAsteroid(&asteroids[i]);
-        }
-    }
     // Draw the menu out in helvetica 18.
     glLoadIdentity();
-    drawMenu(GLUT_BITMAP_HELVETICA_18);
-    
-    // Draw a ship circling around the start button.
-    glLoadIdentity();
-    myTranslate2D(90, 49);
-    drawRotatingShip();
+    drawMenu();
     
     glutSwapBuffers();
 }
@@ -252,13 +1435,8 @@ myLevelDisplay(){
      */
     glClear(GL_COLOR_BUFFER_BIT);
     
-    // Set the point size of the stars.
-    glPointSize(2.0);
-    
-    for(int i = 0; i < MAX_STARS; i++){
-        glLoadIdentity();
-        drawStars(&stars[i]);
-    }
+    // Draw the stars in the back.
+    drawStarfield();
     
     // Reset the point size back to 4.0 for the photon shots.
     glPointSize(4.0);
@@ -268,7 +1446,7 @@ myLevelDisplay(){
     char* levelNumber = getLevelNumber();
     
     // Draw the level number.
-    drawText(levelNumber, GLUT_BITMAP_HELVETICA_18, 77, 50);
+    drawText(levelNumber, 77, 50);
     
     glutSwapBuffers();
 }
@@ -284,14 +1462,8 @@ gameOverDisplay(){
      */
     glClear(GL_COLOR_BUFFER_BIT);
     
-    // Set the point size of the stars.
-    glPointSize(2.0);
-    
-    // Draw the stars.
-    for(int i = 0; i < MAX_STARS; i++){
-        glLoadIdentity();
-        drawStars(&stars[i]);
-    }
+    // Draw the stars in the back.
+    drawStarfield();
     
     // Reset the point size back to 4.0 for the photon shots.
     glPointSize(4.0);
@@ -299,9 +1471,12 @@ gameOverDisplay(){
     glLoadIdentity();
     
     char* gameOver = "GAME OVER!!";
+    char text[TEXT_MAX];
     
-    // Draw the game over text.
-    drawText(gameOver, GLUT_BITMAP_HELVETICA_18, 77, 50);
+    // Draw the game over text and what the game scored.
+    drawText(gameOver, 77, 50);
+    snprintf(text, sizeof(text), "SCORE %d", view->score);
+    drawText(text, 77, 44);
     
     glutSwapBuffers();
 }
@@ -317,69 +1492,18 @@ myGameDisplay()
      */
     glClear(GL_COLOR_BUFFER_BIT);
     
-    // Set the point size of the stars. 
-    glPointSize(2.0);
-    
-    // Draw the stars.
-    for(int i = 0; i < MAX_STARS; i++){
-        glLoadIdentity();
-        drawStars(&stars[i]);
-    }
+    // Draw the stars in the back.
+    drawStarfield();
     
     // Reset the point size back to 4.0 for the photon shots.
     glPointSize(4.0);
     
-    glLoadIdentity();
-    
-    // Draw the ship on screen or an explosion if they have been hit.
-    myTranslate2D(ship.x, ship.y);
-    myRotate2D(DEG2RAD*ship.phi);
-    if(shipExplosion.active == 1){
-        drawDust(&shipExplosion);
-    }else{
-        drawShip(&ship);
-    }
-    
-    
-    // Draw the photons if they are active.
-    for (int i = 0; i < MAX_PHOTONS; i++){
-    	if (photons[i].active){
-            glLoadIdentity();
-            drawPhoton(&photons[i]);
-        }
-    }
-    
-    // Draw the asteroids if they are active.
-    for (int i = 0; i < MAX_ASTEROIDS; i++){
-    	if (asteroids[i].active){
-            glLoadIdentity();
-            myTranslate2D(asteroids[i].x, asteroids[i].y);
-            myRotate2D(DEG2RAD*asteroids[i].phi);
-            drawAsteroid(&asteroids[i]);
-        }
-    }
+    drawPlayfield();
     
-    // Draw the dust from any previous explosions and hangle its timers and flicker.
-    for (int i = 0; i < MAX_DUST; i++){
-        if(dust[i].active){
-            glLoadIdentity();
-            if(dust[i].drawThisFrame){
-                drawDust(&dust[i]);
-            }
-        }
-    }
-    // Draw the number of the level in which the player is currently playing.
-    glLoadIdentity();
-    drawText(getLevelNumber(), GLUT_BITMAP_HELVETICA_18, 10, yMax-6);
-
-    /* Draw the lives text and the ships that represent each life left
-     * to the player */
-    glLoadIdentity();
-    drawText("LIVES - ", GLUT_BITMAP_HELVETICA_18, xMax-30, yMax-6);
-    for(int i = 0; i < lives; i++){
-        glLoadIdentity();
-        myTranslate2D(xMax-(5*i)-5, yMax - 5);
-        drawLives(lives);
+    // Draw the level, and the lives left to the player as ships.
+    drawHud();
+    if(view->showCounters){
+        drawCounters();
     }
     
     glutSwapBuffers();
@@ -394,25 +1518,24 @@ levelMyTimer(int value){
      * Timer callback for screen between the levels.
      */
     
-    glutPostRedisplay();
-    
+    // Nothing moves on this screen, so it is drawn once and left alone until the wait is over.
     if(betweenLevelTimer < TIME_WAIT){
-        betweenLevelTimer = betweenLevelTimer + 1;
-        glutTimerFunc(33, levelMyTimer, 0);
-        
+        redisplay();
+        scheduleIdle(levelMyTimer, 0, TIME_WAIT - betweenLevelTimer);
+        betweenLevelTimer = TIME_WAIT;
     }else{
         // Reset the between level timer.
         betweenLevelTimer = 0;
         // Reset the asteroids
-        for(int i = 0; i < MAX_ASTEROIDS; i++){
+        for(int i = 0; i < MAX_WORLD_ASTEROIDS; i++){
             asteroids[i].active = 0;
         }
-        if(gameState > 8){
-            glutTimerFunc(33, gameOverMyTimer, 0);
-            glutDisplayFunc(gameOverDisplay);
+        if(gameWon(gameState)){
+            scheduleTimer(gameOverMyTimer, 0);
+            showScreen(gameOverDisplay);
         }else{
-            glutTimerFunc(33, gameMyTimer, 0);
-            glutDisplayFunc(myGameDisplay);
+            scheduleTimer(gameMyTimer, 0);
+            showScreen(myGameDisplay);
             gameInit();
         }
     }
@@ -427,21 +1550,22 @@ gameOverMyTimer(int value){
      * Timer callback for screen between the levels.
      */
     
-    glutPostRedisplay();
-    
+    // Just like the level screen, this one is drawn once for the whole wait.
     if(betweenLevelTimer < TIME_WAIT){
-        betweenLevelTimer = betweenLevelTimer + 1;
-        glutTimerFunc(33, gameOverMyTimer, 0);
+        redisplay();
+        scheduleIdle(gameOverMyTimer, 0, TIME_WAIT - betweenLevelTimer);
+        betweenLevelTimer = TIME_WAIT;
     }else{
         // Reset the between level timer.
         betweenLevelTimer = 0;
         // Reset the asteroids
-        for(int i = 0; i < MAX_ASTEROIDS; i++){
+        for(int i = 0; i < MAX_WORLD_ASTEROIDS; i++){
             asteroids[i].active = 0;
         }
+        endRun();
         menuInit();
-        glutTimerFunc(33, menuMyTimer, 0);
-        glutDisplayFunc(myMenuDisplay);
+        scheduleTimer(menuMyTimer, 0);
+        showScreen(myMenuDisplay);
         gameState = 0;
     }
 }
@@ -456,48 +1580,39 @@ menuMyTimer(int value){
      * Time callback function for menu.
      */
     
-    // Change this each frame to give a flicker animation effect on affected objects
-    if(otherFrame > 2){
-        otherFrame = 0;
-    }else{
-        otherFrame = otherFrame + 1;
+    // Nobody watches the menu while its window is hidden, so it just waits to be shown again.
+    if(windowHidden){
+        scheduleIdle(menuMyTimer, value, HIDDEN_WAIT_TICKS);
+        return;
     }
     
-    /* advance asteroids and update their rotation */
-    for (int i = 0; i < MAX_ASTEROIDS; i++){
-    	if (asteroids[i].active == 1){
-            asteroids[i].x = asteroids[i].x + (asteroids[i].dx);
-            asteroids[i].y = asteroids[i].y + (asteroids[i].dy);
-            
-            //asteroids[i].dx = (
-            asteroids[i].phi = asteroids[i].phi + asteroids[i].dphi;
-            
-            if(asteroids[i].x < 0){
-                asteroids[i].x = xMax;
-            }
-            else if (asteroids[i].x > xMax){
-                asteroids[i].x = 0;
-            }
-            else if(asteroids[i].y < 0){
-                asteroids[i].y = yMax;
-            }
-            else if(asteroids[i].y > yMax){
-                asteroids[i].y = 0;
-            }
+    // The autopilot flies around behind the menu, the same way it would play a game.
+    autopilotTick();
+    stepGame();
+    
+    // Start the ship over once its explosion has played out, and bring in new asteroids
+    // when it has shot them all.
+    if(shipExplosion.dustTimer > TIME_WAIT){
+        shipExplosion.active = 0;
+        shipExplosion.dustTimer = 0;
+        initShip();
+    }
+    for(int i = 0; i < ASTEROID_SLOTS; i++){
+        if(asteroids[i].active == 1){
+            break;
+        }
+        if(i == ASTEROID_SLOTS - 1){
+            menuAsteroids();
         }
     }
     
-    glutPostRedisplay();
+    pacedRedisplay();
     
     // If the player clicks on the start box the game begins.
     if(gameState == 0){
-        glutTimerFunc(33, menuMyTimer, value);		/* 30 frames per second */
+        scheduleTimer(menuMyTimer, value);		/* 30 frames per second */
     }else{
-        // Reset the lives at the start of each game.
-        lives = 3;
-        glutDisplayFunc(myLevelDisplay);
-        glutTimerFunc(33, levelMyTimer, 0);
-        
+        startGame();
     }
 }
 
@@ -512,141 +1627,24 @@ gameMyTimer(int value)
      *	timer callback function
      */
     
-    // Check if the explosion is still happening or to update the ships attributes.
-    if(shipExplosion.active == 1){
-        shipExplosion.dustTimer = shipExplosion.dustTimer + 1;
-    }else{
-        /*
-         * Update the ships velocity.
-         */
-        if(left == 1){
-            ship.phi = ship.phi + 10;
-        }
-        if(right == 1){
-            ship.phi = ship.phi - 10;
-        }
-        if(up == 1) {
-            ship.engine = 1;
-            updateVelocity(0);
-        }else if(down == 1) {
-            ship.engine = 1;
-            updateVelocity(1);
-        }else{
-            ship.engine = 0;
-        }
-        
-        /* advance the ship */
-        if(ship.x < 0){
-            ship.x = xMax;
-        }
-        else if (ship.x > xMax){
-            ship.x = 0;
-        }
-        else if(ship.y < 0){
-            ship.y = yMax;
-        }
-        else if(ship.y > yMax){
-            ship.y = 0;
-        }
-        ship.x = ship.x + ship.dx;
-        ship.y = ship.y + ship.dy;
-    }
-    
-    
-    /* Update the dust for each frame, its flicker and length.*/
-     for (int i = 0; i < MAX_DUST; i++){
-         if(dust[i].active){
-             if(dust[i].drawThisFrame){
-                 dust[i].drawThisFrame = 0;
-                 dust[i].dustTimer = dust[i].dustTimer + 1;
-             }else{
-                 dust[i].drawThisFrame = 1;
-                 dust[i].dustTimer = dust[i].dustTimer + 1;
-             }
-             if(dust[i].dustTimer > 6){
-                 dust[i].active = 0;
-             }
-         }
-     }
-     
-    /* advance photon laser shots, eliminating those that have gone past
-     the window boundaries */
-    for (int i = 0; i < MAX_PHOTONS; i++){
-    	if (photons[i].active == 1){
-            photons[i].x = photons[i].x + (photons[i].dx);
-            photons[i].y = photons[i].y + (photons[i].dy);
-            if(photons[i].x > xMax || photons[i].x < 0 || photons[i].y < 0 || photons[i].y > yMax){
-                photons[i].active = 0;
-            }
-        }
-    }
-    
-    /* advance asteroids and update their rotation */
-    for (int i = 0; i < MAX_ASTEROIDS; i++){
-    	if (asteroids[i].active == 1){
-            asteroids[i].x = asteroids[i].x + (asteroids[i].dx);
-            asteroids[i].y = asteroids[i].y + (asteroids[i].dy);
-            
-            //asteroids[i].dx = (
-            asteroids[i].phi = asteroids[i].phi + asteroids[i].dphi;
-            
-            if(asteroids[i].x < 0){ 
-                asteroids[i].x = xMax;
-            }
-            else if (asteroids[i].x > xMax){
-                asteroids[i].x = 0;
-            }
-            else if(asteroids[i].y < 0){
-                asteroids[i].y = yMax;
-            }
-            else if(asteroids[i].y > yMax){
-                asteroids[i].y = 0;
-            }
-        }
+    // The autopilot works the same keys a player would, before anything moves.
+    if(autopilot){
+        autopilotTick();
+        runAutopilot = 1;
     }
-
+    stepGame();
+    runTicks = runTicks + 1;
     
-    /* test for and handle collisions */
-    // Collision between a photon and an asteroid.
-    for(int i = 0; i < MAX_PHOTONS; i++){
-        if(photons[i].active == 1){
-            for(int j = 0; j < MAX_ASTEROIDS; j++){
-                if(asteroids[j].active == 1){
-                    if(PhotonCollision(&photons[i], &asteroids[j])){
-                        activateDust(asteroids[j].x, asteroids[j].y);
-                        // Deactivate for the photon that hit and the main asteroid
-                        photons[i].active = 0;
-                        asteroids[j].active = 0;
-                        // Reduce the size of the asteroid based on the size it is now.
-                        if(asteroids[j].size == LARGE_SIZE){
-                            initAsteroid(&asteroids[findInactiveAsteroid(&asteroids)], asteroids[j].x, asteroids[j].y, MEDIUM_SIZE);
-                            initAsteroid(&asteroids[findInactiveAsteroid(&asteroids)], asteroids[j].x, asteroids[j].y, MEDIUM_SIZE);
-                        }else if(asteroids[j].size == MEDIUM_SIZE){
-                            initAsteroid(&asteroids[findInactiveAsteroid(&asteroids)], asteroids[j].x, asteroids[j].y, SMALL_SIZE);
-                            initAsteroid(&asteroids[findInactiveAsteroid(&asteroids)], asteroids[j].x, asteroids[j].y, SMALL_SIZE);
-                        }
-                        break;
-                    }
-                }
-            }
-        }
+    // Running out of time on a timed level costs a life, the same as being hit.
+    levelTicks = levelTicks + 1;
+    if(levelTimeLeft() == 0 && shipExplosion.active == 0){
+        activateExplosion(0, 0);
+        lives = lives - 1;
     }
     
-    // Collision between the ship and an asteroid.
-    for(int j = 0; j < SHIP_VERTICES; j++){
-        for(int i = 0; i < MAX_ASTEROIDS; i++){
-            if(asteroids[i].active == 1 && shipExplosion.active == 0){
-                if(ShipCollision(&ship.coords[j], &asteroids[i])){
-                    activateExplosion(0, 0);
-                    lives = lives - 1;
-                    j = SHIP_VERTICES + 1;
-                    i = MAX_ASTEROIDS + 1;
-                }
-            }
-        }
-    }
+    countEvent(COUNT_TICKS, 1);
     
-    glutPostRedisplay();
+    pacedRedisplay();
     
     // Checks to see which call back functions to continue on with. Depends on the state of the game.
     if (shipExplosion.dustTimer > TIME_WAIT){
@@ -654,18 +1652,18 @@ gameMyTimer(int value)
         shipExplosion.dustTimer = 0;
         // If there are no lives left load the game over screen.
         if( lives == 0){
-            glutDisplayFunc(gameOverDisplay);
-            glutTimerFunc(33, gameOverMyTimer, value);
+            showScreen(gameOverDisplay);
+            scheduleTimer(gameOverMyTimer, value);
         } else {
-            glutDisplayFunc(myLevelDisplay);
-            glutTimerFunc(33, levelMyTimer, value);
+            showScreen(myLevelDisplay);
+            scheduleTimer(levelMyTimer, value);
         }
     }else if(levelBeat()){
-        glutTimerFunc(33, gameMyTimer, value);		/* 30 frames per second */
+        scheduleTimer(gameMyTimer, value);		/* 30 frames per second */
     }else{
         gameState = gameState + 1;
-        glutDisplayFunc(myLevelDisplay);
-        glutTimerFunc(33, levelMyTimer, value);
+        showScreen(myLevelDisplay);
+        scheduleTimer(levelMyTimer, value);
     }
 }
 
@@ -673,24 +1671,10 @@ void
 myKey(unsigned char key, int x, int y)
 {
     /*
-     *	keyboard callback function; add code here for firing the laser,
-     *	starting and/or pausing the game, etc.
+     *	keyboard callback function; the key is queued up and handled by
+     *	applyKey at the start of the next tick.
      */
-    switch(key)
-    {
-        case 32:
-            for (int i=0; i<MAX_PHOTONS; i++){
-                if (photons[i].active == 0){
-                    photons[i].active = 1;
-                    photons[i].x = ship.x - 5*sin(ship.phi*DEG2RAD);
-                    photons[i].y = ship.y + 5*cos(ship.phi*DEG2RAD);
-                    photons[i].dx = -5*sin(ship.phi*DEG2RAD);
-                    photons[i].dy = 5*cos(ship.phi*DEG2RAD);
-                    break;
-                }
-            }
-            break;
-    }
+    queueInput(INPUT_KEY, key, 0, x, y);
 }
 
 /* The mouse click call back function is used to determine if the player clicks
@@ -698,13 +1682,7 @@ myKey(unsigned char key, int x, int y)
  */
 void
 mouseClick(int button, int state, int x, int y){
-    if(state == GLUT_DOWN){
-        if(gameState == 0){
-            if(withinBox(x, y, &startbox)){
-                gameState = 1;
-            }
-        }
-    }
+    queueInput(INPUT_MOUSE, button, state, x, y);
 }
 
 void
@@ -714,18 +1692,7 @@ keyPress(int key, int x, int y)
      *	this function is called when a special key is pressed; we are
      *	interested in the cursor keys only
      */
-    
-    switch (key)
-    {
-        case 100:
-            left = 1; break;
-        case 101:
-            up = 1; break;
-        case 102:
-            right = 1; break;
-        case 103:
-            down = 1; break;
-    }
+    queueInput(INPUT_SPECIAL_DOWN, key, 0, x, y);
 }
 
 void
@@ -735,18 +1702,7 @@ keyRelease(int key, int x, int y)
      *	this function is called when a special key is released; we are
      *	interested in the cursor keys only
      */
-    
-    switch (key)
-    {
-        case 100:
-            left = 0; break;
-        case 101:
-            up = 0; break;
-        case 102:
-            right = 0; break;
-        case 103:
-            down = 0; break;
-    }
+    queueInput(INPUT_SPECIAL_UP, key, 0, x, y);
 }
 
 void
@@ -758,15 +1714,26 @@ myReshape(int w, int h)
      *  determined by the aspect ratio of the viewport
      */
     
-    xMax = 100.0*w/h;
-    yMax = 100.0;
+    double width = 100.0*w/h, height = 100.0;
     
     glViewport(0, 0, w, h);
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
-    glOrtho(0.0, xMax, 0.0, yMax, -1.0, 1.0);
+    glOrtho(0.0, width, 0.0, height, -1.0, 1.0);
     
     glMatrixMode(GL_MODELVIEW);
+    
+    // The star geometry covers exactly one playfield so it has to follow the new size.
+    buildStarfield(width, height);
+    
+    // The game itself takes on the new size at its next tick.
+    queueInput(INPUT_RESHAPE, 0, 0, w, h);
+}
+
+// Lets the game know when its window is hidden or covered, and when it can be seen again.
+void
+windowStatus(int state){
+    queueInput(INPUT_VISIBILITY, 0, state, 0, 0);
 }
 
 
@@ -781,17 +1748,21 @@ menuInit(){
     startbox.coords[3].x = 102; startbox.coords[3].y = 54;
         
     
-    // Set up the coordinates of the stars. They will be displayed randomly across the screen.
-    for(int i = 0; i < MAX_STARS; i++){
-        stars[i].x = myRandom(0, 160);
-        stars[i].y = myRandom(0, 100);
+    // The autopilot's ship and the asteroids it shoots at behind the menu, without a swarm or bosses.
+    initShip();
+    menuAsteroids();
+    clearEntities(ARCH_ENEMY);
+    for(int i = 0; i < MAX_BOSSES; i++){
+        bosses[i].active = 0;
     }
-    
-    /*
-     * Set up the asteroids to float through the menu screen.
-     * Initialize all the asteroids that are necessary for this level of the
-     * game. Each asteroid can have two children so that
-     */
+}
+
+/* Set up the asteroids to float through the menu screen.
+ * Initialize all the asteroids that are necessary for this level of the
+ * game. Each asteroid can have two children so that
+ */
+void
+menuAsteroids(){
     for(int i = 0; i < MAX_LARGE_ASTEROIDS; i++){
         if(myRandom(-1, 1) < 0){
             initAsteroid(&asteroids[i], 0, myRandom(0.0, yMax), LARGE_SIZE);
@@ -800,23 +1771,19 @@ menuInit(){
             initAsteroid(&asteroids[i], myRandom(0, xMax), 0, LARGE_SIZE);
         }
     }
+    buildInstances();
+    refitSpatialTree();
 }
+
+/* Set the start position of the ship as well as the initial velocity and
+ * angle. The angle points the ship towards the top of the screen.
+ */
 void
-gameInit(){
-    /*
-     * set parameters including the numbers of asteroids and photons present,
-     * the maximum velocity of the ship, the velocity of the laser shots, the
-     * ship's coordinates and velocity, etc.
-     */
-    
+initShip(){
     // Ships dimensions
     double scaleX = 2;
     double scaleY = 3.5;
     
-    /*
-     * Set the start position of the ship as well as the initial velocity and
-     * angle. The angle points the ship towards the top of the screen.
-     */
     ship.x = 83, ship.y = 50, ship.dx = 0, ship.dy = 0, ship.phi = 0; ship.engine = 0;
     ship.coords[0].x = cos(DEG2RAD*90);
     ship.coords[0].y = sin(DEG2RAD*90)*scaleY;
@@ -824,101 +1791,426 @@ gameInit(){
     ship.coords[1].y = sin(DEG2RAD*225)*scaleY;
     ship.coords[2].x = cos(DEG2RAD*315)*scaleX;
     ship.coords[2].y = sin(DEG2RAD*315)*scaleY;
+}
+
+/* Leaves the menu for the first level. Whatever the autopilot was doing behind the menu
+ * is cleared away so the game starts from nothing.
+ */
+void
+startGame(){
+    // Reset the lives at the start of each game.
+    lives = 3;
+    score = 0, runTicks = 0, runAutopilot = 0;
+    // A new game starts with the player at the controls, except in -autoplay.
+    if(!batchRun){
+        autopilot = 0;
+    }
+    // The game's random numbers all come from its seed, which -seed can pick to play it again.
+    runSeed = seedOverride ? seedOverride : (unsigned int)rand();
+    srand(runSeed);
+    seedLevels(runSeed);
+    // Every game of the open world gets its own layout.
+    worldSeed = (unsigned int)rand();
+    clearEntities(ARCH_PHOTON);
+    shipExplosion.active = 0;
+    shipExplosion.dustTimer = 0;
+    up = down = left = right = 0;
+    showScreen(myLevelDisplay);
+    scheduleTimer(levelMyTimer, 0);
+}
+
+/* Moves everything on the playfield ahead by one tick and handles the collisions. The game
+ * and the menu both use this, the menu just has the autopilot at the controls.
+ */
+void
+stepGame(){
+    int rocks = 0;
     
-    /*
-     * Set the velocity of each of the photon shots that could possibly exist
-     * by being shop by the ship.
-     */
-    for (int i = 0; i < MAX_PHOTONS; i++){
-        photons[i].dx = 2.0;
-        photons[i].dy = 2.0;
+    // Everything gets pulled around before it moves in the gravity wells mode.
+    if(gameMode == MODE_GRAVITY){
+        applyGravity();
     }
     
-    /*
-     * Set the point size of the photon shots
-     */
-    glPointSize(4.0);
+    // Check if the explosion is still happening or to update the ships attributes.
+    if(shipExplosion.active == 1){
+        shipExplosion.dustTimer = shipExplosion.dustTimer + 1;
+    }else{
+        /*
+         * Update the ships velocity.
+         */
+        if(left == 1){
+            ship.phi = ship.phi + 10;
+        }
+        if(right == 1){
+            ship.phi = ship.phi - 10;
+        }
+        if(up == 1) {
+            ship.engine = 1;
+            updateVelocity(0);
+        }else if(down == 1) {
+            ship.engine = 1;
+            updateVelocity(1);
+        }else{
+            ship.engine = 0;
+        }
+        
+        /* advance the ship */
+        ship.x = ship.x + ship.dx;
+        ship.y = ship.y + ship.dy;
+        wrapPosition(&ship.x, &ship.y);
+        updateCamera();
+        
+        // The background scrolls against the ship's motion.
+        scrollStarfield(ship.dx, ship.dy);
+    }
+    engineSound(gameState > 0 && shipExplosion.active == 0 && ship.engine);
     
-    /*
-     * Initialize all the asteroids that are necessary for this level of the
-     * game. Each asteroid can have two children so that 
-     */
-    for(int i = 0; i < gameState; i++){
-        if(myRandom(-1, 1) < 0){
-            initAsteroid(&asteroids[i], 0, myRandom(0.0, yMax), LARGE_SIZE);
+    
+    /* Update the dust for each frame, its flicker and length, and advance the photon laser
+     shots, eliminating those that have gone past the window boundaries. */
+    lifetimeSystem();
+    movementSystem();
+    boundsSystem();
+    flushCommands();
+    
+    /* advance asteroids and update their rotation */
+    for (int i = 0; i < ASTEROID_SLOTS; i++){
+    	if (asteroids[i].active == 1){
+            asteroids[i].x = asteroids[i].x + (asteroids[i].dx);
+            asteroids[i].y = asteroids[i].y + (asteroids[i].dy);
+            
+            //asteroids[i].dx = (
+            asteroids[i].phi = asteroids[i].phi + asteroids[i].dphi;
+            
+            wrapPosition(&asteroids[i].x, &asteroids[i].y);
         }
-        else{
-            initAsteroid(&asteroids[i], myRandom(0, xMax), 0, LARGE_SIZE);
+    }
+    
+    // Put far away sectors to sleep and bring the ones near the ship to life.
+    if(WORLD_ACTIVE){
+        streamSectors();
+    }
+    buildInstances();
+    refitSpatialTree();
+    
+    /* test for and handle collisions */
+    // The fracture arena only holds the clipped outlines of this tick.
+    fractureArenaUsed = 0;
+    
+    // Collision between a photon and an asteroid.
+    collisionSystem();
+    
+    // Collision between the ship and an asteroid.
+    for(int k = 0; k < nShipInstances && shipExplosion.active == 0; k++){
+        for(int i = 0; i < nAsteroidInstances; i++){
+            if(asteroids[asteroidInstances[i].index].active == 1 &&
+               ShipCollision(&shipInstances[k], &asteroidInstances[i].body)){
+                recordEvent(TELEMETRY_DEATH, ship.x, ship.y);
+                activateExplosion(0, 0);
+                lives = lives - 1;
+                break;
+            }
         }
     }
     
-}
-
-void
-initAsteroid(Asteroid *a, double x, double y, double size)
-{
-    /*
-     *	generate an asteroid at the given position; velocity, rotational
-     *	velocity, and shape are generated randomly; size serves as a scale
-     *	parameter that allows generating asteroids of different sizes; feel
-     *	free to adjust the parameters according to your needs.
-     */
+    // The bosses move on their own and take the photons that reach them.
+    bossSystem();
     
-    double	theta, r;
-    int		i;
+    // The swarm steers around what is left and finds out what it hit.
+    if(gameMode == MODE_SWARM){
+        swarmSystem();
+    }
     
-    a->x = x;
-    a->y = y;
-    a->dx = myRandom(-0.8, 0.8);
-    a->dy = myRandom(-0.8, 0.8);
-    a->dphi = myRandom(-0.4, 0.4);
-    a->size = size;
+    // Only now do the asteroids that were hit break up.
+    flushCommands();
     
-    a->nVertices = 6+rand()%(MAX_VERTICES-6);
-    for (i=0; i<a->nVertices; i++)
-    {
-        theta = 2.0*M_PI*i/a->nVertices;
-        r = size*myRandom(2.0, 3.0);
-        a->coords[i].x = -r*sin(theta);
-        a->coords[i].y = r*cos(theta);
+    // The gauges show what is left at the end of the tick, the menu's as well as a game's.
+    for(int i = 0; i < ASTEROID_SLOTS; i++){
+        rocks = rocks + (asteroids[i].active == 1);
     }
+    setGauge(GAUGE_ASTEROIDS, rocks);
+    setGauge(GAUGE_PHOTONS, countEntities(ARCH_PHOTON));
+    setGauge(GAUGE_DUST, countEntities(ARCH_DUST));
+    setGauge(GAUGE_ENEMIES, countEntities(ARCH_ENEMY));
+}
+
+// Fires a photon from the nose of the ship, if one is free, and returns if it did.
+int
+firePhoton(){
+    Entity e = spawnEntity(ARCH_PHOTON);
     
-    a->active = 1;
+    if(e != NO_ENTITY){
+        initEntity(e, ship.x - 5*sin(ship.phi*DEG2RAD), ship.y + 5*cos(ship.phi*DEG2RAD),
+                   -5*sin(ship.phi*DEG2RAD), 5*cos(ship.phi*DEG2RAD));
+        playSound(SOUND_FIRE);
+    }
+    return e != NO_ENTITY;
 }
 
-// Activate an explosion when the photon hits an asteroid.
+/* The screens chain into each other through GLUT timers. These go through here so that a
+ * headless run can step the same chain itself, without a window.
+ */
 void
-activateDust(double x, double y){
-    for(int i = 0; i < MAX_DUST; i++){
-        if(dust[i].active == 0){
-            dust[i].active = 1;
-            dust[i].drawThisFrame = 1;
-            for(int j = 0; j < DUST_PARTICLES; j++){
-                dust[i].coords[j].x = myRandom(x-7.5, x+7.5);
-                dust[i].coords[j].y = myRandom(y-7.5, y+7.5);
-            }
-            dust[i].dustTimer = 0;
-            break;
-        }
+scheduleTimer(void (*timer)(int), int value){
+    scheduleIdle(timer, value, 1);
+}
+
+// Schedules the next timer a number of ticks from now, for a screen with nothing to animate.
+void
+scheduleIdle(void (*timer)(int), int value, int ticks){
+    pendingTimer = timer;
+    pendingValue = value;
+    pendingTicks = ticks;
+    if(!headless && !threaded){
+        glutTimerFunc(TICK_MS*ticks, runTick, value);
     }
 }
 
-// Activate an explosion when the ship hits an asteroid.
 void
-activateExplosion(double x, double y){
-    shipExplosion.active = 1;
-    shipExplosion.drawThisFrame = 1;
-    for(int j = 0; j < DUST_PARTICLES; j++){
-        shipExplosion.coords[j].x = myRandom(x-7.5, x+7.5);
-        shipExplosion.coords[j].y = myRandom(y-7.5, y+7.5);
+showScreen(void (*display)(void)){
+    if(display != currentScreen){
+        accountScreen(display);
     }
-    shipExplosion.dustTimer = 0;
+    // The engine only runs on the game screen, the others stop its loop.
+    if(display != myGameDisplay){
+        engineSound(0);
+    }
+    currentScreen = display;
 }
 
-// Used to draw the ship and its engine flames.
+// With -threaded this marks the frame to be handed over after the tick instead.
 void
-drawShip(Ship *s){
-    // Check if the engine is on.
+redisplay(){
+    redrawWanted = 1;
+    if(!headless && !threaded){
+        glutPostRedisplay();
+    }
+}
+
+/* Draws the moving screens only as often as it takes for nothing on them to move more than
+ * PACE_STEP between frames, which is every tick for most of a game but drops to a few frames
+ * a second when only slow asteroids are drifting around. The game itself still ticks at the
+ * full rate.
+ */
+void
+pacedRedisplay(){
+    static int skipped = 0;
+    double motion = sceneMotion();
+    int every = (motion > 0) ? (int)(PACE_STEP/motion) : PACE_MAX_TICKS;
+    
+    skipped = skipped + 1;
+    if(skipped >= every || skipped >= PACE_MAX_TICKS){
+        skipped = 0;
+        redisplay();
+    }
+}
+
+/* Returns how far the fastest thing on the screen moves in a tick. Anything the player is
+ * steering or that only lasts a moment, like photons and explosions, needs every tick.
+ */
+double
+sceneMotion(){
+    double motion = hypot(ship.dx, ship.dy);
+    
+    if(up || down || left || right || shipExplosion.active ||
+       countEntities(ARCH_PHOTON) > 0 || countEntities(ARCH_DUST) > 0){
+        return HUGE_VAL;
+    }
+    for(int i = 0; i < ASTEROID_SLOTS; i++){
+        Asteroid *a = &asteroids[i];
+        if(a->active == 1){
+            double speed = hypot(a->dx, a->dy) + fabs(a->dphi)*DEG2RAD*asteroidShape(a)->radius;
+            motion = (speed > motion) ? speed : motion;
+        }
+    }
+    return motion;
+}
+
+/* Input that comes in while a screen sits idle is applied straight away rather than at the
+ * end of the wait, and the screen is drawn again in case it changed, like a new window size.
+ */
+void
+wakeIdle(){
+    handleInputs();
+    redisplay();
+}
+
+/* Keeps track of what each screen costs. With -stats, leaving a screen prints how much cpu
+ * time the whole program took per second of it and how many frames it drew.
+ */
+void
+accountScreen(void (*display)(void)){
+    static double wallMark = 0.0, cpuMark = 0.0;
+    double wall = monotonicSeconds(), cpu = cpuSeconds();
+    
+    if(showStats && currentScreen != NULL && wall > wallMark){
+        printf("%s screen: %.1f s, %.1f ms of cpu per second, %.1f frames per second\n",
+               screenName(currentScreen), wall - wallMark, 1e3*(cpu - cpuMark)/(wall - wallMark),
+               screenFrames/(wall - wallMark));
+    }
+    wallMark = wall;
+    cpuMark = cpu;
+    screenFrames = 0;
+}
+
+const char *
+screenName(void (*display)(void)){
+    if(display == myMenuDisplay){
+        return "menu";
+    }else if(display == myGameDisplay){
+        return "game";
+    }else if(display == myLevelDisplay){
+        return "level";
+    }
+    return "game over";
+}
+
+// Returns the cpu time used by the whole program so far, across all of its threads.
+double
+cpuSeconds(){
+    struct timespec now;
+    
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+// The playfield is always 100 high and as wide as the window's shape allows.
+void
+resizePlayfield(int w, int h){
+    xMax = 100.0*w/h;
+    yMax = 100.0;
+}
+
+// Draws the ship, photons, asteroids and dust of the frame being shown.
+void
+drawPlayfield(){
+    int drawn = 0;
+    
+    loadWorldMatrix();
+    
+    // Draw the ship on screen or an explosion if they have been hit.
+    if(view->shipExplosion.active == 1){
+        myTranslate2D(view->ship.x, view->ship.y);
+        myRotate2D(DEG2RAD*view->ship.phi);
+        drawDust(view->shipExplosion.coords);
+        drawn = drawn + 1;
+    }else{
+        for(int i = 0; i < view->nShipInstances; i++){
+            loadWorldMatrix();
+            myTranslate2D(view->shipInstances[i].x, view->shipInstances[i].y);
+            myRotate2D(DEG2RAD*view->shipInstances[i].phi);
+            drawShip(&view->shipInstances[i]);
+        }
+        drawn = drawn + view->nShipInstances;
+    }
+    
+    
+    // Draw the photons.
+    for (int i = 0; i < view->nPhotons; i++){
+        loadWorldMatrix();
+        drawPhoton(&view->photons[i]);
+    }
+    drawn = drawn + view->nPhotons;
+    
+    // Draw the asteroids, including the copies of those crossing an edge.
+    for (int i = 0; i < view->nAsteroidInstances; i++){
+        Asteroid *a = &view->asteroidInstances[i].body;
+        loadWorldMatrix();
+        myTranslate2D(a->x, a->y);
+        myRotate2D(DEG2RAD*a->phi);
+        drawAsteroid(a);
+    }
+    drawn = drawn + view->nAsteroidInstances;
+    
+    drawBosses();
+    
+    if(view->nEnemies > 0){
+        loadWorldMatrix();
+        drawEnemies();
+        drawn = drawn + view->nEnemies;
+    }
+    
+    if(view->gameMode == MODE_GRAVITY){
+        loadWorldMatrix();
+        drawWells();
+    }
+    
+    // Draw the dust from any previous explosions, only what flickers on this frame is here.
+    for (int i = 0; i < view->nDust; i++){
+        loadWorldMatrix();
+        drawDust(view->dust[i].coords);
+    }
+    drawn = drawn + view->nDust;
+    countEvent(COUNT_DRAWN, drawn);
+}
+
+
+void
+gameInit(){
+    /*
+     * set parameters including the numbers of asteroids and photons present,
+     * the maximum velocity of the ship, the velocity of the laser shots, the
+     * ship's coordinates and velocity, etc.
+     */
+    
+    initShip();
+    
+    /*
+     * Initialize all the asteroids that are necessary for this level of the
+     * game. Each asteroid can have two children so that 
+     */
+    if(gameMode == MODE_WORLD){
+        // The open world fills itself in around the ship.
+        resetWorld();
+    }else{
+        spawnLevel(gameState);
+        if(gameMode == MODE_SWARM){
+            spawnSwarm((SWARM_PER_LEVEL*gameState < MAX_ENEMIES) ? SWARM_PER_LEVEL*gameState : MAX_ENEMIES);
+        }
+        updateCamera();
+    }
+    buildInstances();
+    refitSpatialTree();
+}
+
+void
+initAsteroid(Asteroid *a, double x, double y, double size)
+{
+    /*
+     *	generate an asteroid at the given position; velocity, rotational
+     *	velocity, and shape are picked randomly; size selects which part of
+     *	the shape library the outline is taken from, so spawning never has
+     *	to build any geometry.
+     */
+    
+    a->x = x;
+    a->y = y;
+    a->dx = myRandom(-0.8, 0.8);
+    a->dy = myRandom(-0.8, 0.8);
+    a->dphi = myRandom(-0.4, 0.4);
+    a->shape = ((int)size - 1)*SHAPES_PER_SIZE + rand()%SHAPES_PER_SIZE;
+    countEvent(COUNT_RANDOM, 1);
+    
+    a->active = 1;
+}
+
+// Activate an explosion when the ship hits an asteroid.
+void
+activateExplosion(double x, double y){
+    shipExplosion.active = 1;
+    shipExplosion.drawThisFrame = 1;
+    for(int j = 0; j < DUST_PARTICLES; j++){
+        shipExplosion.coords[j].x = myRandom(x-7.5, x+7.5);
+        shipExplosion.coords[j].y = myRandom(y-7.5, y+7.5);
+    }
+    shipExplosion.dustTimer = 0;
+    playSound(SOUND_EXPLOSION);
+}
+
+// Used to draw the ship and its engine flames.
+void
+drawShip(Ship *s){
+    // Check if the engine is on.
     if(s->engine == 1){
         glColor3f(1.0, 0.0, 0.0);
         glBegin(GL_TRIANGLES);
@@ -941,7 +2233,7 @@ drawShip(Ship *s){
  
 // Used to draw the photons.
 void
-drawPhoton(Photon *p)
+drawPhoton(Position *p)
 {
     // Make the shots white.
     glColor3f(1.0, 1.0, 1.0);
@@ -952,83 +2244,149 @@ drawPhoton(Photon *p)
     
 }
 
-// Used to draw the asteroids.
+/* Used to draw the asteroids. The outline of each shape is compiled into a display list the
+ * first time it is drawn, after that every asteroid using it is a single list call.
+ */
 void
 drawAsteroid(Asteroid *a){
-    // Have the asteroids be filled up.
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-    // Make the asteroids white.
-    glColor3f(0.6, 0.6, 0.6);
-    
-    glBegin(GL_POLYGON);
-        for(int i = 0; i < a->nVertices; i++){
-            glVertex2d(a->coords[i].x, a->coords[i].y);
-        }
-    glEnd();
+    int n, version;
+    Coords *coords;
     
-    // Reset the mode back to line.
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-    glColor3f(0.0, 0.0, 0.0);
+    // Fracture pieces come from the frame, since the game may be rewriting their slot.
+    if(a->shape >= MAX_SHAPES){
+        FrameOutline *outline = &view->outlines[a->shape - MAX_SHAPES];
+        n = outline->nVertices, coords = outline->coords, version = outline->version;
+    }else{
+        AsteroidShape *shape = &shapeLibrary[a->shape];
+        n = shape->nVertices, coords = shape->coords, version = shape->version;
+    }
     
-    glBegin(GL_POLYGON);
-    for(int i = 0; i < a->nVertices; i++){
-        glVertex2d(a->coords[i].x, a->coords[i].y);
+    // Fracture shapes are rewritten when their slot is reused, so they recompile their list.
+    if(shapeListVersion[a->shape] != version){
+        if(shapeLists[a->shape] == 0){
+            shapeLists[a->shape] = glGenLists(1);
+        }
+        glNewList(shapeLists[a->shape], GL_COMPILE);
+            // Have the asteroids be filled up.
+            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+            // Make the asteroids white.
+            glColor3f(0.6, 0.6, 0.6);
+            
+            glBegin(GL_POLYGON);
+                for(int i = 0; i < n; i++){
+                    glVertex2d(coords[i].x, coords[i].y);
+                }
+            glEnd();
+            
+            // Reset the mode back to line.
+            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+            glColor3f(0.0, 0.0, 0.0);
+            
+            glBegin(GL_POLYGON);
+                for(int i = 0; i < n; i++){
+                    glVertex2d(coords[i].x, coords[i].y);
+                }
+            glEnd();
+        glEndList();
+        shapeListVersion[a->shape] = version;
     }
-    glEnd();
+    
+    glCallList(shapeLists[a->shape]);
 }
 
 // Draw sparkly dust that happens when an asteroid is destroyed.
 void
-drawDust(Dust *dust){
+drawDust(Coords *coords){
     // Set the size of the dust to 2.0
     glPointSize(3.0);
     
     glBegin(GL_POINTS);
         for(int i = 0; i < DUST_PARTICLES; i++){
             glColor3f(myRandom(0.0, 1.0),myRandom(0.0, 1.0),myRandom(0.0, 1.0));
-            glVertex2d(dust->coords[i].x, dust->coords[i].y);
+            glVertex2d(coords[i].x, coords[i].y);
         }
     glEnd();
     
 }
 
-// Draw the lives in the top right corner of the screen. They are just ships! :)
+/* Draw the number of the level the player is on in the top left corner, and the lives in
+ * the top right corner of the screen. They are just ships! :) The text only changes with the
+ * level, so it is compiled into a display list that is only built again when that has
+ * changed, or the playfield was resized.
+ */
 void
-drawLives(int i){
-    drawShip(&ship);
+drawHud(){
+    char text[TEXT_MAX];
+    Ship icon = view->ship;
+    
+    if(hudList == 0){
+        hudList = glGenLists(1);
+    }
+    if(view->gameState != hudGameState || view->gameMode != hudMode ||
+       view->xMax != hudXMax || view->yMax != hudYMax){
+        hudGameState = view->gameState, hudMode = view->gameMode;
+        hudXMax = view->xMax, hudYMax = view->yMax;
+        
+        // The atlas has to be in place before anything that uses it is compiled.
+        beginText();
+        endText();
+        
+        glNewList(hudList, GL_COMPILE);
+        glLoadIdentity();
+        glColor3f(1.0, 1.0, 1.0);
+        beginText();
+        emitText(getLevelNumber(), 10, view->yMax-6);
+        emitText("LIVES - ", view->xMax-30, view->yMax-6);
+        endText();
+        glEndList();
+    }
+    glCallList(hudList);
+    
+    // The lives are drawn from the ship of this frame, so they are left out of the list too.
+    // They never show the engine burning.
+    icon.engine = 0;
+    for(int i = 0; i < view->lives; i++){
+        glLoadIdentity();
+        myTranslate2D(view->xMax-(5*i)-5, view->yMax - 5);
+        drawShip(&icon);
+    }
+    glLoadIdentity();
+    
+    // The score changes with every hit, so it is left out of the list as well.
+    snprintf(text, sizeof(text), "SCORE %d", view->score);
+    glColor3f(1.0, 1.0, 1.0);
+    drawString(text, 30, view->yMax-6);
+    
+    // The time left on a timed level counts down every second, so it is left out of the list.
+    if(view->timeLeft >= 0){
+        snprintf(text, sizeof(text), "TIME %d", view->timeLeft);
+        glColor3f(1.0, (view->timeLeft > 10) ? 1.0 : 0.3, (view->timeLeft > 10) ? 1.0 : 0.3);
+        drawString(text, view->xMax/2 - 6, view->yMax-6);
+    }
 }
 
 // Draw any text supplied to the position x and y on the screen.
 void
-drawText(char* text, void * font, double x, double y){
+drawText(char* text, double x, double y){
     // Make the title gray.
     glColor3f(1.0, 1.0, 1.0);
-    glRasterPos2f(x, y);
-    for (int i = 0; i < strlen (text); i++)
-        glutBitmapCharacter (font, text[i]);
+    drawString(text, x, y);
 }
 
 /* This is used to draw the menu. It is slightly more hardcoded than I wanted
  * but I didn't manage to find a better solution at the moment.
  */
 void
-drawMenu(void * font){
-    char* startGame = "START";
-    char* gameTitle = "ASTEROIDS ";
+drawMenu(){
+    char mode[TEXT_MAX];
     
     // Make the title gray.
     glColor3f(1.0, 1.0, 1.0);
-    glRasterPos2f(50, 50);
-    
-    // Draw the game title character by character.
-    for (int i = 0; i < strlen (gameTitle); i++)
-        glutBitmapCharacter (font, gameTitle[i]);
+    drawString("ASTEROIDS ", 50, 50);
     
     // Change the colour and draw the start button.
     glColor3f(1.0, 0.0, 0.0);
-    glRasterPos2f(105, 50);
-    for (int i = 0; i < strlen (startGame); i++)
-        glutBitmapCharacter (font, startGame[i]);
+    drawString("START", 105, 50);
     
     // Draw the box around the start button.
     glBegin(GL_POLYGON);
@@ -1037,104 +2395,92 @@ drawMenu(void * font){
         glVertex2d(startbox.coords[2].x, startbox.coords[2].y);
         glVertex2d(startbox.coords[3].x, startbox.coords[3].y);
     glEnd();
-}
-
-// Used to draw the stars in the background.
-void
-drawStars(Stars * stars){
+    
+    // Show the selected game mode under the title, M switches between them.
     glColor3f(1.0, 1.0, 1.0);
+    snprintf(mode, sizeof(mode), "MODE - %s", modeNames[view->gameMode]);
+    drawString(mode, 50, 44);
     
-    glBegin(GL_POINTS);
-        glVertex2f(stars->x, stars->y);
-    glEnd();
-}
-
-/* Used to draw the ship in the start screen, was supposed to rotate 
- * around but feature was but on hold for other more pressing issues.
- */
-void
-drawRotatingShip(){
-    // Draw the ship flames on the back.
-    if (otherFrame > 0){
-        glBegin(GL_TRIANGLES);
-            glVertex2d(-2, 2);
-            glVertex2d(0, 3);
-            glVertex2d(0, 1);
-        glEnd();
+    // The best games kept in the score log, if there are any yet.
+    if(view->nBest > 0){
+        drawString("HIGH SCORES", 50, 32);
+    }
+    for(int i = 0; i < view->nBest; i++){
+        snprintf(mode, sizeof(mode), "%d %7d LEVEL %d", i + 1, view->best[i].score, view->best[i].level);
+        drawString(mode, 50, 28 - 3*i);
     }
-    
-    // Draw the ship body.
-    glColor3f(1.0, 1.0, 1.0);
-    glBegin(GL_TRIANGLES);
-        glVertex2d(0, 0);
-        glVertex2d(0, 4);
-        glVertex2d(8, 2);
-    glEnd();
 }
 
-/* This functions detects if a photon has collided with an asteroid by checking if the number of 
- * lines crossed by the projection of the point in the positive x in odd.
+/* This functions detects if a photon has collided with an asteroid at any point during the
+ * last tick rather than only where it ended up, so fast photons can't skip over small asteroids.
+ * The asteroid moved as well, so the photon's path is taken relative to it. The point where the
+ * photon entered the asteroid is stored in hit.
  */
 int
-PhotonCollision(Photon *p, Asteroid *a){
-    double xIntersect = 0.0;
-    int lines = a->nVertices;
-    int number_intersections = 0;
-    // Generate the lines of the asteroid
-    double px1, py1, ax1, ay1, ax2, ay2;
-    px1 = p->x;
-    py1 = p->y;
-    
-    // Run through each line in the polygon to check if it is a candidate and intersected.
-    for(int i = 0; i < a->nVertices; i++){
-        ax1 = a->x + a->coords[i%(lines)].x;
-        ay1 = a->y + a->coords[i%(lines)].y;
-        ax2 = a->x + a->coords[(i+1)%(lines)].x;
-        ay2 = a->y + a->coords[(i+1)%(lines)].y;
-        // Check to see if it is in between the y values
-        if( (py1 < ay1 && py1 > ay2) || (py1 > ay1 && py1 < ay2)){
-            xIntersect = (((py1 - ay1)/(ay2-ay1))*ax2) + (((ay2 - py1)/(ay2-ay1))*ax1);
-            if((xIntersect >= px1) && (((xIntersect < ax1) && (xIntersect > ax2)) || ((xIntersect > ax1) && (xIntersect < ax2)))){
-                number_intersections = number_intersections + 1;
-            }
-        }
+PhotonCollision(Position *p, Velocity *v, Asteroid *a, Coords *hit){
+    double x0 = p->x - v->dx + a->dx;
+    double y0 = p->y - v->dy + a->dy;
+    double t = segmentAsteroid(a, x0, y0, p->x, p->y);
+    
+    countEvent(COUNT_PAIRS_TESTED, 1);
+    if(t < 0){
+        return 0;
     }
-    return number_intersections % 2;
+    countEvent(COUNT_PAIRS_HIT, 1);
+    hit->x = x0 + (p->x - x0)*t;
+    hit->y = y0 + (p->y - y0)*t;
+    return 1;
 }
 
-/* This functions detects if a ship has collided with an asteroid by checking if the number of
- * lines crossed by the projection of the point in the positive x in odd. This is done for each
- * of the three points of the ship by using they calls to this function.
+/* This functions detects if a ship has collided with an asteroid during the last tick. First
+ * the two outlines are tested for overlap where they ended up. To catch them passing through
+ * each other, relative to the asteroid each corner of the ship swept a line, and relative to the
+ * ship each corner of the asteroid swept the opposite line. If any of those lines touches the
+ * other body they hit.
  */
 int
-ShipCollision(Coords *c, Asteroid *a){
-    // Get the number of vertices in the asteroids which will be the number of lines as well.
-    int lines = a->nVertices;
-    // Used to store the number of intersections, there is a collision if it is odd.
-    int number_intersections = 0;
-    // Generate the lines of the asteroid
-    double px1, py1, ax1, ay1, ax2, ay2;
-    
-    // Holds onto the value of where the x intersection occurs on a line.
-    double x_intersect = 0.0;
-    
-    px1 = c->x + ship.x;
-    py1 = c->y + ship.y;
-    // Check this point aginst the asteroid.
-    for(int i = 0; i < a->nVertices; i++){
-        ax1 = a->x + a->coords[i%(lines)].x;
-        ay1 = a->y + a->coords[i%(lines)].y;
-        ax2 = a->x + a->coords[(i+1)%(lines)].x;
-        ay2 = a->y + a->coords[(i+1)%(lines)].y;
-        // Check to see if it is in between the y values
-        if( (py1 <= ay1 && py1 >= ay2) || (py1 >= ay1 && py1 <= ay2)){
-            x_intersect = (((py1 - ay1)/(ay2-ay1))*ax2) + (((ay2 - py1)/(ay2-ay1))*ax1);
-            if((x_intersect >= px1) && (((x_intersect <= ax1) && (x_intersect >= ax2)) || ((x_intersect >= ax1) && (x_intersect <= ax2)))){
-                number_intersections = number_intersections + 1;
-            }
+ShipCollision(Ship *s, Asteroid *a){
+    AsteroidShape *shape = asteroidShape(a);
+    Coords corners[SHIP_VERTICES];
+    double relX = s->dx - a->dx;
+    double relY = s->dy - a->dy;
+    double reach = shape->radius + SHIP_RADIUS + sqrt(relX*relX + relY*relY);
+    double c, sn;
+    
+    countEvent(COUNT_PAIRS_TESTED, 1);
+    // Too far apart to touch during this tick.
+    if((s->x - a->x)*(s->x - a->x) + (s->y - a->y)*(s->y - a->y) > reach*reach){
+        return 0;
+    }
+    
+    shipVertices(s, corners);
+    if(shipAsteroidOverlap(corners, a)){
+        countEvent(COUNT_PAIRS_HIT, 1);
+        return 1;
+    }
+    if(relX == 0 && relY == 0){
+        return 0;
+    }
+    
+    for(int i = 0; i < SHIP_VERTICES; i++){
+        if(segmentAsteroid(a, corners[i].x - relX, corners[i].y - relY, corners[i].x, corners[i].y) >= 0){
+            countEvent(COUNT_PAIRS_HIT, 1);
+            return 1;
         }
     }
-    return number_intersections % 2;
+    
+    c = cos(DEG2RAD*a->phi);
+    sn = sin(DEG2RAD*a->phi);
+    for(int i = 0; i < shape->nVertices; i++){
+        double x = a->x + c*shape->coords[i].x - sn*shape->coords[i].y;
+        double y = a->y + sn*shape->coords[i].x + c*shape->coords[i].y;
+        if(pointInPolygon(corners, SHIP_VERTICES, x + relX, y + relY) ||
+           segmentPolygon(corners, SHIP_VERTICES, x + relX, y + relY, x, y) >= 0){
+            countEvent(COUNT_PAIRS_HIT, 1);
+            return 1;
+        }
+    }
+    return 0;
 }
 
 
@@ -1147,6 +2493,7 @@ myRandom(double min, double max){
 	
 	/* return a random number uniformly draw from [min,max] */
 	d = min+(max-min)*(rand()%0x7fff)/32767.0;
+    countEvent(COUNT_RANDOM, 1);
 	
 	return d;
 }
@@ -1154,19 +2501,9 @@ myRandom(double min, double max){
 // Finds an integer position of an inactive asteroid so it can be used for an initialization of a new one.
 int
 findInactiveAsteroid(){
-    for(int i = 0; i < MAX_ASTEROIDS; i++){
+    for(int i = 0; i < ASTEROID_SLOTS; i++){
         if(asteroids[i].active == 0){
-            return i;
-        }
-    }
-    return -1;
-}
-
-// Finds an integer position of an inactive photon so it can be used for an initialization of a new one.
-int
-findInactivePhoton(){
-    for(int i = 0; i < MAX_PHOTONS; i++){
-        if(photons[i].active == 0){
+            countEvent(COUNT_ALLOCATIONS, 1);
             return i;
         }
     }
@@ -1187,11 +2524,17 @@ withinBox(double x, double y, StartBox *box){
     }
 }
 
-// Check if there are any asteroids left. If no then the level is over so return 0.
+/* Check if there are any asteroids left. If no then the level is over so return 0. The open
+ * world never runs out of asteroids so it only ends with the last life.
+ */
 int
 levelBeat(){
-    int numberLeft = 0;
-    for(int i = 0; i < MAX_ASTEROIDS; i++){
+    int numberLeft = bossesLeft();
+    
+    if(gameMode == MODE_WORLD){
+        return 1;
+    }
+    for(int i = 0; i < ASTEROID_SLOTS; i++){
         if(asteroids[i].active == 1)
             numberLeft = numberLeft + 1;
     }
@@ -1206,25 +2549,13 @@ levelBeat(){
 // Returns the appropriate level title depending on the current game state.
 char *
 getLevelNumber(){
-    switch (gameState){
-        case 1:
-            return "LEVEL 1";
-        case 2:
-            return "LEVEL 2";
-        case 3:
-            return "LEVEL 3";
-        case 4:
-            return "LEVEL 4";
-        case 5:
-            return "LEVEL 5";
-        case 6:
-            return "LEVEL 6";
-        case 7:
-            return "LEVEL 7";
-        case 8:
-            return "LEVEL 8";
-    }
-    return "ERROR";
+    static char title[TEXT_MAX];
+    
+    if(view->gameMode == MODE_WORLD){
+        return "OPEN SPACE";
+    }
+    snprintf(title, sizeof(title), "LEVEL %d", view->gameState);
+    return title;
 }
 
 /*
@@ -1275,3 +2606,6522 @@ updateVelocity(int state){
         }
     }
 }
+
+/* -- text ------------------------------------------------------------------ */
+
+/* Draws every glyph of the font into its own cell of the atlas. The cells are a little
+ * larger than the glyphs so that neighbours never bleed into each other when sampled.
+ */
+void
+buildFontAtlas(){
+    memset(fontAtlas, 0, sizeof(fontAtlas));
+    for(int g = 0; g < FONT_GLYPHS; g++){
+        int cellX = (g%ATLAS_COLUMNS)*ATLAS_CELL;
+        int cellY = (g/ATLAS_COLUMNS)*ATLAS_CELL;
+        for(int row = 0; row < FONT_HEIGHT; row++){
+            for(int column = 0; column < FONT_WIDTH; column++){
+                if(font5x7[g][row] & (1 << (FONT_WIDTH - 1 - column))){
+                    fontAtlas[cellY + row][cellX + column] = 255;
+                }
+            }
+        }
+    }
+    fontAtlasBuilt = 1;
+}
+
+// Returns the glyph for a character, lower case as upper case and anything else as a space.
+int
+glyphIndex(char c){
+    if(c >= 'a' && c <= 'z'){
+        c = c - 'a' + 'A';
+    }
+    if(c < FONT_FIRST || c >= FONT_FIRST + FONT_GLYPHS){
+        return 0;
+    }
+    return c - FONT_FIRST;
+}
+
+/* Returns the laid out batch for the text at this place, laying it out into the batch that
+ * has gone the longest without being drawn if it isn't in the cache already.
+ */
+TextBatch *
+textBatch(const char *text, double x, double y){
+    TextBatch *batch = &textCache[0];
+    
+    textClock = textClock + 1;
+    for(int i = 0; i < TEXT_CACHE_SIZE; i++){
+        TextBatch *b = &textCache[i];
+        if(b->list != 0 && b->x == x && b->y == y && strncmp(b->text, text, TEXT_MAX) == 0){
+            b->lastUsed = textClock;
+            return b;
+        }
+        if(b->lastUsed < batch->lastUsed){
+            batch = b;
+        }
+    }
+    
+    if(batch->list == 0){
+        batch->list = glGenLists(1);
+    }
+    snprintf(batch->text, TEXT_MAX, "%s", text);
+    batch->x = x;
+    batch->y = y;
+    batch->lastUsed = textClock;
+    glNewList(batch->list, GL_COMPILE);
+    emitText(batch->text, x, y);
+    glEndList();
+    return batch;
+}
+
+/* Sends the quads for the text with its baseline starting at (x, y), one per glyph, each
+ * cut out of the atlas by its texture coordinates.
+ */
+void
+emitText(const char *text, double x, double y){
+    double w = FONT_WIDTH*TEXT_PIXEL, h = FONT_HEIGHT*TEXT_PIXEL;
+    
+    glBegin(GL_QUADS);
+    for(int i = 0; text[i] != '\0'; i++){
+        int g = glyphIndex(text[i]);
+        double left = x + i*(FONT_WIDTH + 1)*TEXT_PIXEL;
+        double u = (double)((g%ATLAS_COLUMNS)*ATLAS_CELL)/ATLAS_WIDTH;
+        double v = (double)((g/ATLAS_COLUMNS)*ATLAS_CELL)/ATLAS_HEIGHT;
+        double du = (double)FONT_WIDTH/ATLAS_WIDTH, dv = (double)FONT_HEIGHT/ATLAS_HEIGHT;
+        
+        if(g == 0){
+            continue;
+        }
+        glTexCoord2d(u, v + dv);
+        glVertex2d(left, y);
+        glTexCoord2d(u + du, v + dv);
+        glVertex2d(left + w, y);
+        glTexCoord2d(u + du, v);
+        glVertex2d(left + w, y + h);
+        glTexCoord2d(u, v);
+        glVertex2d(left, y + h);
+    }
+    glEnd();
+}
+
+// Draws the text in the current colour with its baseline starting at (x, y).
+void
+drawString(const char *text, double x, double y){
+    beginText();
+    // Text too long for the cache is laid out every time rather than cut short.
+    if(strlen(text) >= TEXT_MAX){
+        emitText(text, x, y);
+    }else{
+        glCallList(textBatch(text, x, y)->list);
+    }
+    endText();
+}
+
+/* Sets up for drawing text: filled quads, textured from the atlas, with the empty part of
+ * every glyph cut away. The atlas is uploaded here the first time.
+ */
+void
+beginText(){
+    if(fontTexture == 0){
+        if(!fontAtlasBuilt){
+            buildFontAtlas();
+        }
+        glGenTextures(1, &fontTexture);
+        glBindTexture(GL_TEXTURE_2D, fontTexture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, ATLAS_WIDTH, ATLAS_HEIGHT, 0, GL_ALPHA,
+                     GL_UNSIGNED_BYTE, fontAtlas);
+    }
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glBindTexture(GL_TEXTURE_2D, fontTexture);
+    glEnable(GL_TEXTURE_2D);
+    glAlphaFunc(GL_GREATER, 0.5);
+    glEnable(GL_ALPHA_TEST);
+}
+
+// Puts back the state everything else is drawn with.
+void
+endText(){
+    glDisable(GL_ALPHA_TEST);
+    glDisable(GL_TEXTURE_2D);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+}
+
+/* -- starfield ------------------------------------------------------------- */
+
+/* Scatter the stars of every layer across the current playfield and compile each layer
+ * into its own display list. Only called when the playfield size changes, so the per frame
+ * cost of the stars is a handful of glCallList calls no matter how many stars there are.
+ */
+void
+buildStarfield(double width, double height){
+    for(int l = 0; l < STAR_LAYERS; l++){
+        StarLayer *layer = &starLayers[l];
+        
+        if(layer->list == 0){
+            layer->list = glGenLists(1);
+        }
+        
+        glNewList(layer->list, GL_COMPILE);
+            glPointSize(layer->pointSize);
+            glColor3f(layer->brightness, layer->brightness, layer->brightness);
+            glBegin(GL_POINTS);
+                for(int i = 0; i < layer->nStars; i++){
+                    glVertex2d(myRandom(0.0, width), myRandom(0.0, height));
+                }
+            glEnd();
+        glEndList();
+    }
+}
+
+/* Move every layer by the given velocity scaled by its depth so the near layers slide past
+ * faster than the far ones. The offsets are kept inside the playfield so they never grow.
+ */
+void
+scrollStarfield(double dx, double dy){
+    for(int l = 0; l < STAR_LAYERS; l++){
+        StarLayer *layer = &starLayers[l];
+        
+        layer->offsetX = fmod(layer->offsetX + dx*layer->depth, xMax);
+        layer->offsetY = fmod(layer->offsetY + dy*layer->depth, yMax);
+        if(layer->offsetX < 0){
+            layer->offsetX = layer->offsetX + xMax;
+        }
+        if(layer->offsetY < 0){
+            layer->offsetY = layer->offsetY + yMax;
+        }
+    }
+}
+
+/* Draw the stars in the background. Each layer is one playfield wide, so a scrolled layer is
+ * drawn as four tiles to cover the part that wrapped around. That is four list calls per
+ * layer regardless of the star count.
+ */
+void
+drawStarfield(){
+    for(int l = 0; l < STAR_LAYERS; l++){
+        StarLayer *layer = &starLayers[l];
+        
+        if(layer->list == 0){
+            continue;
+        }
+        for(int tx = 0; tx < 2; tx++){
+            for(int ty = 0; ty < 2; ty++){
+                glLoadIdentity();
+                myTranslate2D(tx*view->xMax - view->starOffsetX[l], ty*view->yMax - view->starOffsetY[l]);
+                glCallList(layer->list);
+            }
+        }
+    }
+    glLoadIdentity();
+}
+
+/* -- asteroid shape library ------------------------------------------------ */
+
+/* Generate every asteroid outline the game will use. This is the only place asteroid
+ * geometry is built, each size class gets its own set of random outlines and asteroids
+ * only keep an index into the library.
+ */
+void
+buildShapeLibrary(){
+    double sizes[SIZE_CLASSES] = {SMALL_SIZE, MEDIUM_SIZE, LARGE_SIZE};
+    Coords coords[MAX_VERTICES];
+    
+    for(int c = 0; c < SIZE_CLASSES; c++){
+        for(int i = 0; i < SHAPES_PER_SIZE; i++){
+            int nVertices = 6+rand()%(MAX_VERTICES-6);
+            
+            for(int v = 0; v < nVertices; v++){
+                double theta = 2.0*M_PI*v/nVertices;
+                double r = sizes[c]*myRandom(2.0, 3.0);
+                coords[v].x = -r*sin(theta);
+                coords[v].y = r*cos(theta);
+            }
+            buildShape(&shapeLibrary[c*SHAPES_PER_SIZE + i], sizes[c], nVertices, coords);
+        }
+    }
+}
+
+/* Fill in a shape from its outline and precompute the bounding radius, area and sector
+ * table. The outline must be counter-clockwise around the origin. The vertices are rotated so
+ * the sector angles come out sorted, and the shape is only marked star shaped when the origin
+ * lies on the inner side of every edge.
+ */
+void
+buildShape(AsteroidShape *shape, double size, int nVertices, Coords *coords){
+    int first = 0;
+    double smallest = 4.0*M_PI;
+    
+    shape->nVertices = nVertices;
+    shape->size = size;
+    shape->radius = 0.0;
+    shape->area = 0.0;
+    shape->starShaped = 1;
+    shape->segment = segmentKernel(nVertices);
+    shape->version = shape->version + 1;
+    
+    // Start the outline at the vertex with the smallest angle.
+    for(int i = 0; i < nVertices; i++){
+        double theta = atan2(-coords[i].x, coords[i].y);
+        if(theta < 0){
+            theta = theta + 2.0*M_PI;
+        }
+        if(theta < smallest){
+            smallest = theta;
+            first = i;
+        }
+    }
+    
+    for(int i = 0; i < nVertices; i++){
+        Coords *a = &coords[(first+i)%nVertices];
+        Coords *b = &coords[(first+i+1)%nVertices];
+        double r = sqrt(a->x*a->x + a->y*a->y);
+        double theta = atan2(-a->x, a->y);
+        
+        shape->coords[i] = *a;
+        if(r > shape->radius){
+            shape->radius = r;
+        }
+        shape->area = shape->area + 0.5*(a->x*b->y - b->x*a->y);
+        
+        // Angles are measured counter-clockwise from the positive y axis like the outline.
+        if(theta < 0){
+            theta = theta + 2.0*M_PI;
+        }
+        shape->sectorAngle[i] = theta;
+        
+        // Outward normal of the edge from this vertex to the next one.
+        shape->edgeNormalX[i] = b->y - a->y;
+        shape->edgeNormalY[i] = a->x - b->x;
+        shape->edgeOffset[i] = shape->edgeNormalX[i]*a->x + shape->edgeNormalY[i]*a->y;
+        
+        if(shape->edgeOffset[i] <= 0 || (i > 0 && theta <= shape->sectorAngle[i-1])){
+            shape->starShaped = 0;
+        }
+    }
+}
+
+// Find the sector, and so the edge, of a shape that a point in shape coordinates lies in.
+int
+shapeSector(AsteroidShape *shape, double x, double y){
+    double theta = atan2(-x, y);
+    int low = 0, high = shape->nVertices - 1;
+    
+    if(theta < 0){
+        theta = theta + 2.0*M_PI;
+    }
+    
+    // The angles are sorted so the sector is the last vertex at or before the point.
+    while(low < high){
+        int mid = (low + high + 1)/2;
+        if(shape->sectorAngle[mid] <= theta){
+            low = mid;
+        }else{
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+/* Checks if a point in shape coordinates lies inside a shape. Star shaped outlines compare
+ * the point against the single edge of its sector, anything else counts crossings.
+ */
+int
+pointInShape(AsteroidShape *shape, double x, double y){
+    int i;
+    
+    if(x*x + y*y > shape->radius*shape->radius){
+        return 0;
+    }
+    if(shape->starShaped){
+        i = shapeSector(shape, x, y);
+        return x*shape->edgeNormalX[i] + y*shape->edgeNormalY[i] <= shape->edgeOffset[i];
+    }
+    return pointInPolygon(shape->coords, shape->nVertices, x, y);
+}
+
+/* -- swept collision ------------------------------------------------------- */
+
+/* Finds where the line from (x0, y0) to (x1, y1) first touches an asteroid. Returns the
+ * fraction along the line, 0 if it already starts inside, or -1 if it misses completely.
+ */
+double
+segmentAsteroid(Asteroid *a, double x0, double y0, double x1, double y1){
+    AsteroidShape *shape = asteroidShape(a);
+    double c, s, lx0, ly0, lx1, ly1, ex, ey, t, closestX, closestY, len;
+    
+    x0 = x0 - a->x, y0 = y0 - a->y;
+    x1 = x1 - a->x, y1 = y1 - a->y;
+    
+    // Reject on the closest point of the line to the center.
+    ex = x1 - x0, ey = y1 - y0;
+    len = ex*ex + ey*ey;
+    t = (len > 0) ? -(x0*ex + y0*ey)/len : 0.0;
+    t = (t < 0) ? 0.0 : ((t > 1) ? 1.0 : t);
+    closestX = x0 + ex*t;
+    closestY = y0 + ey*t;
+    if(closestX*closestX + closestY*closestY > shape->radius*shape->radius){
+        return -1;
+    }
+    
+    c = cos(DEG2RAD*a->phi);
+    s = sin(DEG2RAD*a->phi);
+    lx0 = c*x0 + s*y0, ly0 = -s*x0 + c*y0;
+    lx1 = c*x1 + s*y1, ly1 = -s*x1 + c*y1;
+    
+    if(pointInShape(shape, lx0, ly0)){
+        return 0.0;
+    }
+    return shape->segment(shape, lx0, ly0, lx1, ly1);
+}
+
+/* The edge loop of the segment test against a shape. Edge i runs from vertex i along its
+ * normal turned back a quarter, so there is no wrapping around to the first vertex. Edges
+ * the line misses or runs parallel to come out as infinities or NaN that fail the range
+ * tests, which leaves the loop without branches. With n known it unrolls completely.
+ */
+static inline double
+segmentEdges(AsteroidShape *shape, int n, double x0, double y0, double x1, double y1){
+    double rx = x1 - x0, ry = y1 - y0;
+    double first = 2.0;
+    
+#if defined(__GNUC__)
+#pragma GCC unroll 16
+#endif
+    for(int i = 0; i < n; i++){
+        double sx = -shape->edgeNormalY[i], sy = shape->edgeNormalX[i];
+        double qx = shape->coords[i].x - x0, qy = shape->coords[i].y - y0;
+        double denom = rx*sy - ry*sx;
+        double t = (qx*sy - qy*sx)/denom;
+        double u = (qx*ry - qy*rx)/denom;
+        int hit = (t >= 0) & (t <= 1) & (u >= 0) & (u <= 1) & (t < first);
+        first = hit ? t : first;
+    }
+    return (first <= 1) ? first : -1;
+}
+
+// The same test with the number of vertices only known when it runs.
+double
+segmentShape(AsteroidShape *shape, double x0, double y0, double x1, double y1){
+    return segmentEdges(shape, shape->nVertices, x0, y0, x1, y1);
+}
+
+// One copy of the segment test for every number of vertices an outline can have.
+#define SEGMENT_KERNEL(n) \
+    static double segmentShape##n(AsteroidShape *shape, double x0, double y0, double x1, double y1){ \
+        return segmentEdges(shape, n, x0, y0, x1, y1); \
+    }
+SEGMENT_KERNEL(3) SEGMENT_KERNEL(4) SEGMENT_KERNEL(5) SEGMENT_KERNEL(6) SEGMENT_KERNEL(7)
+SEGMENT_KERNEL(8) SEGMENT_KERNEL(9) SEGMENT_KERNEL(10) SEGMENT_KERNEL(11) SEGMENT_KERNEL(12)
+SEGMENT_KERNEL(13) SEGMENT_KERNEL(14) SEGMENT_KERNEL(15) SEGMENT_KERNEL(16)
+
+static SegmentKernel segmentKernels[MAX_VERTICES + 1] = {
+    NULL, NULL, NULL, segmentShape3, segmentShape4, segmentShape5, segmentShape6, segmentShape7,
+    segmentShape8, segmentShape9, segmentShape10, segmentShape11, segmentShape12, segmentShape13,
+    segmentShape14, segmentShape15, segmentShape16
+};
+
+// Returns the segment test made for this number of vertices.
+SegmentKernel
+segmentKernel(int n){
+    if(n < 0 || n > MAX_VERTICES || segmentKernels[n] == NULL){
+        return segmentShape;
+    }
+    return segmentKernels[n];
+}
+
+// Returns the fraction along a line where it first crosses an edge of a polygon, or -1.
+double
+segmentPolygon(Coords *poly, int n, double x0, double y0, double x1, double y1){
+    double rx = x1 - x0, ry = y1 - y0;
+    double first = -1;
+    
+    for(int i = 0; i < n; i++){
+        Coords *a = &poly[i];
+        Coords *b = &poly[(i+1)%n];
+        double sx = b->x - a->x, sy = b->y - a->y;
+        double denom = rx*sy - ry*sx;
+        double qx = a->x - x0, qy = a->y - y0;
+        double t, u;
+        
+        // Parallel lines never cross at a single point.
+        if(denom == 0){
+            continue;
+        }
+        t = (qx*sy - qy*sx)/denom;
+        u = (qx*ry - qy*rx)/denom;
+        if(t >= 0 && t <= 1 && u >= 0 && u <= 1 && (first < 0 || t < first)){
+            first = t;
+        }
+    }
+    return first;
+}
+
+// Checks if a point lies inside a polygon by counting crossings of a ray in the positive x direction.
+int
+pointInPolygon(Coords *poly, int n, double x, double y){
+    int inside = 0;
+    
+    for(int i = 0, j = n - 1; i < n; j = i++){
+        Coords *a = &poly[i];
+        Coords *b = &poly[j];
+        if((a->y > y) != (b->y > y) && x < (b->x - a->x)*(y - a->y)/(b->y - a->y) + a->x){
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+// Stores the corners of the ship in world coordinates, rotated the same way it is drawn.
+void
+shipVertices(Ship *s, Coords *out){
+    double c = cos(DEG2RAD*s->phi);
+    double sn = sin(DEG2RAD*s->phi);
+    
+    for(int i = 0; i < SHIP_VERTICES; i++){
+        out[i].x = s->x + c*s->coords[i].x - sn*s->coords[i].y;
+        out[i].y = s->y + sn*s->coords[i].x + c*s->coords[i].y;
+    }
+}
+
+/* -- ship overlap ---------------------------------------------------------- */
+
+/* Checks if the ship triangle, given by its corners in world coordinates, overlaps an asteroid.
+ * A star shaped asteroid is a fan of triangles around its center, so the test is a separating
+ * axis test of the ship against each fan triangle. The axes of the fan triangles are its outer
+ * edge and its two spokes; those are checked for every triangle in one pass over the shape
+ * first, so only the one or two triangles the ship actually reaches get the full test.
+ */
+int
+shipAsteroidOverlap(Coords *corners, Asteroid *a){
+    AsteroidShape *shape = asteroidShape(a);
+    double separation[MAX_VERTICES], spokeLow[MAX_VERTICES], spokeHigh[MAX_VERTICES];
+    double px[SHIP_VERTICES], py[SHIP_VERTICES];
+    Coords tri[SHIP_VERTICES], fan[3];
+    double c, s, dx, dy, reach;
+    int n = shape->nVertices;
+    
+    // Bounding circles first, every point of the ship is within twice its radius of its nose.
+    dx = corners[0].x - a->x, dy = corners[0].y - a->y;
+    reach = shape->radius + 2*SHIP_RADIUS;
+    if(dx*dx + dy*dy > reach*reach){
+        return 0;
+    }
+    
+    c = cos(DEG2RAD*a->phi);
+    s = sin(DEG2RAD*a->phi);
+    
+    // Move the ship into the frame of the asteroid's shape.
+    for(int k = 0; k < SHIP_VERTICES; k++){
+        double x = corners[k].x - a->x;
+        double y = corners[k].y - a->y;
+        tri[k].x = px[k] = c*x + s*y;
+        tri[k].y = py[k] = -s*x + c*y;
+    }
+    
+    if(!shape->starShaped){
+        return polygonsOverlap(tri, SHIP_VERTICES, shape->coords, n);
+    }
+    
+    /* How far the ship lies outside each edge, and the range of sides of each spoke it covers.
+     * This loop has no branches and walks the shape as plain arrays so the compiler can
+     * evaluate several edges per instruction.
+     */
+    for(int i = 0; i < n; i++){
+        double vx = shape->coords[i].x, vy = shape->coords[i].y;
+        double d0 = shape->edgeNormalX[i]*px[0] + shape->edgeNormalY[i]*py[0];
+        double d1 = shape->edgeNormalX[i]*px[1] + shape->edgeNormalY[i]*py[1];
+        double d2 = shape->edgeNormalX[i]*px[2] + shape->edgeNormalY[i]*py[2];
+        double s0 = vx*py[0] - vy*px[0];
+        double s1 = vx*py[1] - vy*px[1];
+        double s2 = vx*py[2] - vy*px[2];
+        double low = d0 < d1 ? d0 : d1;
+        double sLow = s0 < s1 ? s0 : s1;
+        double sHigh = s0 > s1 ? s0 : s1;
+        separation[i] = (low < d2 ? low : d2) - shape->edgeOffset[i];
+        spokeLow[i] = sLow < s2 ? sLow : s2;
+        spokeHigh[i] = sHigh > s2 ? sHigh : s2;
+    }
+    
+    fan[0].x = 0.0, fan[0].y = 0.0;
+    for(int i = 0; i < n; i++){
+        /* The triangle lies counter-clockwise of its first spoke, clockwise of its second and
+         * inside its edge. If the whole ship is on the wrong side of any of those it can't touch.
+         */
+        if(separation[i] > 0 || spokeHigh[i] < 0 || spokeLow[(i+1)%n] > 0){
+            continue;
+        }
+        fan[1] = shape->coords[i];
+        fan[2] = shape->coords[(i+1)%n];
+        if(trianglesOverlap(fan, tri)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Separating axis test of two triangles, using the edge normals of both as the axes.
+int
+trianglesOverlap(Coords *a, Coords *b){
+    Coords *tris[2] = {a, b};
+    
+    for(int t = 0; t < 2; t++){
+        Coords *tri = tris[t];
+        for(int i = 0; i < 3; i++){
+            double nx = tri[(i+1)%3].y - tri[i].y;
+            double ny = tri[i].x - tri[(i+1)%3].x;
+            double minA = 0, maxA = 0, minB = 0, maxB = 0;
+            
+            for(int k = 0; k < 3; k++){
+                double pa = nx*a[k].x + ny*a[k].y;
+                double pb = nx*b[k].x + ny*b[k].y;
+                if(k == 0 || pa < minA) minA = pa;
+                if(k == 0 || pa > maxA) maxA = pa;
+                if(k == 0 || pb < minB) minB = pb;
+                if(k == 0 || pb > maxB) maxB = pb;
+            }
+            if(maxA < minB || maxB < minA){
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Overlap of two arbitrary polygons, used for fracture pieces that can't be split into a fan.
+ * They overlap when any of their edges cross or one has a corner inside the other.
+ */
+int
+polygonsOverlap(Coords *a, int na, Coords *b, int nb){
+    for(int i = 0; i < na; i++){
+        if(segmentPolygon(b, nb, a[i].x, a[i].y, a[(i+1)%na].x, a[(i+1)%na].y) >= 0){
+            return 1;
+        }
+    }
+    return pointInPolygon(b, nb, a[0].x, a[0].y) || pointInPolygon(a, na, b[0].x, b[0].y);
+}
+
+/* -- playfield wrapping ---------------------------------------------------- */
+
+// Wraps a position back onto the playfield, on both axes at once.
+void
+wrapPosition(Scalar *x, Scalar *y){
+    if(WORLD_ACTIVE){
+        return;
+    }
+    if(*x < 0){
+        *x = *x + xMax;
+    }else if(*x > xMax){
+        *x = *x - xMax;
+    }
+    if(*y < 0){
+        *y = *y + yMax;
+    }else if(*y > yMax){
+        *y = *y - yMax;
+    }
+}
+
+/* Finds the offsets at which a body of radius r at (x, y) shows up on the playfield. The
+ * first offset is always the body itself; a body crossing one edge gets one more and a body
+ * in a corner gets three more.
+ */
+int
+wrapOffsets(double x, double y, double r, Coords *offsets){
+    double ox = 0.0, oy = 0.0;
+    int count = 1;
+    
+    // The open world doesn't wrap.
+    if(WORLD_ACTIVE){
+        offsets[0].x = 0.0, offsets[0].y = 0.0;
+        return 1;
+    }
+    if(x - r < 0){
+        ox = xMax;
+    }else if(x + r > xMax){
+        ox = -xMax;
+    }
+    if(y - r < 0){
+        oy = yMax;
+    }else if(y + r > yMax){
+        oy = -yMax;
+    }
+    
+    offsets[0].x = 0.0, offsets[0].y = 0.0;
+    if(ox != 0){
+        offsets[count].x = ox, offsets[count].y = 0.0;
+        count++;
+    }
+    if(oy != 0){
+        offsets[count].x = 0.0, offsets[count].y = oy;
+        count++;
+    }
+    if(ox != 0 && oy != 0){
+        offsets[count].x = ox, offsets[count].y = oy;
+        count++;
+    }
+    return count;
+}
+
+/* Rebuilds the lists of asteroid and ship copies after everything has moved. Bodies well
+ * inside the playfield are a single copy, so the collision loops and the drawing only pay
+ * for the few bodies actually crossing an edge.
+ */
+void
+buildInstances(){
+    Coords offsets[4];
+    int count;
+    
+    nAsteroidInstances = 0;
+    for(int i = 0; i < ASTEROID_SLOTS; i++){
+        if(asteroids[i].active == 1){
+            count = wrapOffsets(asteroids[i].x, asteroids[i].y, asteroidShape(&asteroids[i])->radius, offsets);
+            for(int k = 0; k < count; k++){
+                AsteroidInstance *inst = &asteroidInstances[nAsteroidInstances++];
+                inst->index = i;
+                inst->body = asteroids[i];
+                inst->body.x = asteroids[i].x + offsets[k].x;
+                inst->body.y = asteroids[i].y + offsets[k].y;
+            }
+        }
+    }
+    
+    count = wrapOffsets(ship.x, ship.y, SHIP_RADIUS, offsets);
+    for(int k = 0; k < count; k++){
+        shipInstances[k] = ship;
+        shipInstances[k].x = ship.x + offsets[k].x;
+        shipInstances[k].y = ship.y + offsets[k].y;
+    }
+    nShipInstances = count;
+}
+
+/* -- open world ------------------------------------------------------------ */
+
+/* Start a fresh open world around the ship. Nothing is generated up front, the sectors next
+ * to the ship are created from the world seed as they are woken up.
+ */
+void
+resetWorld(){
+    memset(sectorTable, 0, sizeof(sectorTable));
+    for(int i = 0; i < MAX_WORLD_ASTEROIDS; i++){
+        asteroids[i].active = 0;
+    }
+    
+    ship.x = 0.0;
+    ship.y = 0.0;
+    updateCamera();
+    
+    activeSectorX = 0;
+    activeSectorY = 0;
+    for(int sx = -1; sx <= 1; sx++){
+        for(int sy = -1; sy <= 1; sy++){
+            wakeSector(sx, sy);
+        }
+    }
+}
+
+// Keep the ship in the middle of the screen in the open world.
+void
+updateCamera(){
+    if(WORLD_ACTIVE){
+        cameraX = ship.x - xMax/2;
+        cameraY = ship.y - yMax/2;
+    }else{
+        cameraX = 0.0;
+        cameraY = 0.0;
+    }
+}
+
+/* Only the three by three block of sectors around the ship is simulated. Asteroids that
+ * drift out of it are packed into the sector they ended up in, and when the ship moves into a
+ * new sector the row or column of sectors that came into range is woken up. The work per
+ * tick depends on that block alone, not on how much of the world has been visited. A sector
+ * that just left the block starts an empty record, any other sector has to be generated
+ * before an asteroid can drift into it.
+ */
+void
+streamSectors(){
+    int sx = (int)floor(ship.x/SECTOR_SIZE);
+    int sy = (int)floor(ship.y/SECTOR_SIZE);
+    int oldX = activeSectorX, oldY = activeSectorY;
+    
+    activeSectorX = sx;
+    activeSectorY = sy;
+    
+    // Every sector leaving the block keeps a record, even with nothing left in it, so a
+    // cleared sector isn't generated again.
+    for(int x = oldX - 1; x <= oldX + 1; x++){
+        for(int y = oldY - 1; y <= oldY + 1; y++){
+            if(abs(x - sx) > 1 || abs(y - sy) > 1){
+                sectorRecord(x, y, 0);
+            }
+        }
+    }
+    
+    for(int i = 0; i < ASTEROID_SLOTS; i++){
+        if(asteroids[i].active == 1){
+            int ax = (int)floor(asteroids[i].x/SECTOR_SIZE);
+            int ay = (int)floor(asteroids[i].y/SECTOR_SIZE);
+            if(abs(ax - sx) > 1 || abs(ay - sy) > 1){
+                sleepAsteroid(&asteroids[i], abs(ax - oldX) > 1 || abs(ay - oldY) > 1);
+            }
+        }
+    }
+    
+    // Wake every sector of the new block that wasn't part of the old one.
+    for(int x = sx - 1; x <= sx + 1; x++){
+        for(int y = sy - 1; y <= sy + 1; y++){
+            if(abs(x - oldX) > 1 || abs(y - oldY) > 1){
+                wakeSector(x, y);
+            }
+        }
+    }
+}
+
+/* Finds the record of a sleeping sector. A missing record is either generated, for sectors
+ * that have never been seen or were dropped from the table, or started empty. The record
+ * takes over the slot of whatever was in it.
+ */
+Sector *
+sectorRecord(int sx, int sy, int generate){
+    unsigned int hash = (unsigned int)sx*73856093u;
+    Sector *sector;
+    
+    // Mix x before y goes in, a plain xor of the two puts (1, 1) and (-1, -1) in one slot.
+    hash = (hash ^ (hash >> 16))*0x45d9f3bu;
+    hash = hash ^ ((unsigned int)sy*19349663u);
+    hash = (hash ^ (hash >> 16))*0x45d9f3bu;
+    hash = hash ^ (hash >> 16);
+    sector = &sectorTable[hash%SECTOR_TABLE_SIZE];
+    
+    if(!sector->used || sector->sx != sx || sector->sy != sy){
+        sector->used = 1;
+        sector->sx = sx;
+        sector->sy = sy;
+        sector->count = 0;
+        if(generate){
+            generateSector(sector);
+        }
+    }
+    return sector;
+}
+
+/* Fills a sector with asteroids. Everything comes from a random sequence seeded by the world
+ * seed and the sector's position, so a sector always comes out the same. The area around the
+ * ship's starting point is kept clear.
+ */
+void
+generateSector(Sector *sector){
+    unsigned int state = worldSeed ^ ((unsigned int)sector->sx*2654435761u) ^ ((unsigned int)sector->sy*40503u);
+    int count;
+    
+    // Mix the seed a little so neighbouring sectors don't start out alike.
+    for(int i = 0; i < 4; i++){
+        worldRandom(&state);
+    }
+    
+    count = 2 + worldRandom(&state)%4;
+    sector->count = 0;
+    for(int i = 0; i < count; i++){
+        SleepingAsteroid *rock = &sector->rocks[sector->count];
+        double x = worldRange(&state, 0.0, SECTOR_SIZE);
+        double y = worldRange(&state, 0.0, SECTOR_SIZE);
+        double wx = sector->sx*SECTOR_SIZE + x;
+        double wy = sector->sy*SECTOR_SIZE + y;
+        int sizeClass = (worldRandom(&state)%3 == 0) ? 1 : 2;
+        
+        rock->x = x;
+        rock->y = y;
+        rock->dx = worldRange(&state, -0.8, 0.8);
+        rock->dy = worldRange(&state, -0.8, 0.8);
+        rock->phi = 0.0f;
+        rock->dphi = worldRange(&state, -0.4, 0.4);
+        rock->shape = sizeClass*SHAPES_PER_SIZE + worldRandom(&state)%SHAPES_PER_SIZE;
+        
+        if(wx*wx + wy*wy > SECTOR_SAFE_RADIUS*SECTOR_SAFE_RADIUS){
+            sector->count++;
+        }
+    }
+}
+
+/* Packs an asteroid into the record of the sector it is in and frees its slot. Pieces of a
+ * fracture have a shape owned by their slot, so they are stored as a library shape of the
+ * same size instead.
+ */
+void
+sleepAsteroid(Asteroid *a, int generate){
+    int sx = (int)floor(a->x/SECTOR_SIZE);
+    int sy = (int)floor(a->y/SECTOR_SIZE);
+    Sector *sector = sectorRecord(sx, sy, generate);
+    SleepingAsteroid *rock;
+    int shape = a->shape;
+    
+    a->active = 0;
+    if(sector->count == SECTOR_MAX_ROCKS){
+        return;
+    }
+    
+    if(shape >= MAX_SHAPES){
+        shape = ((int)shapeLibrary[shape].size - 1)*SHAPES_PER_SIZE + (shape - MAX_SHAPES)%SHAPES_PER_SIZE;
+    }
+    
+    rock = &sector->rocks[sector->count++];
+    rock->x = a->x - sx*SECTOR_SIZE;
+    rock->y = a->y - sy*SECTOR_SIZE;
+    rock->dx = a->dx;
+    rock->dy = a->dy;
+    rock->phi = a->phi;
+    rock->dphi = a->dphi;
+    rock->shape = shape;
+}
+
+/* Brings the asteroids of a sector back to life and empties its record, the sector is now
+ * simulated like the rest of the block around the ship.
+ */
+void
+wakeSector(int sx, int sy){
+    Sector *sector = sectorRecord(sx, sy, 1);
+    
+    for(int i = 0; i < sector->count; i++){
+        SleepingAsteroid *rock = &sector->rocks[i];
+        int slot = findInactiveAsteroid();
+        if(slot < 0){
+            break;
+        }
+        asteroids[slot].x = sx*SECTOR_SIZE + rock->x;
+        asteroids[slot].y = sy*SECTOR_SIZE + rock->y;
+        asteroids[slot].dx = rock->dx;
+        asteroids[slot].dy = rock->dy;
+        asteroids[slot].phi = rock->phi;
+        asteroids[slot].dphi = rock->dphi;
+        asteroids[slot].shape = rock->shape;
+        asteroids[slot].active = 1;
+    }
+    sector->used = 0;
+    sector->count = 0;
+}
+
+// Start the model view matrix looking through the camera, used for everything in the world.
+void
+loadWorldMatrix(){
+    glLoadIdentity();
+    myTranslate2D(-view->cameraX, -view->cameraY);
+}
+
+// A small xorshift generator so the world doesn't depend on the order rand() is called in.
+unsigned int
+worldRandom(unsigned int *state){
+    unsigned int x = *state ? *state : 0x9e3779b9u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Returns a number uniformly drawn from [min,max] out of a world random sequence.
+double
+worldRange(unsigned int *state, double min, double max){
+    countEvent(COUNT_RANDOM, 1);
+    return min + (max - min)*(worldRandom(state)%0x7fff)/32767.0;
+}
+
+/* -- spatial queries ------------------------------------------------------- */
+
+/* Builds the bounding volume tree over the asteroid slots. Every slot is a leaf, active or
+ * not, so the shape of the tree never has to change as asteroids come and go; the slots are
+ * only split up by where they are at the moment, halving the longer side each time.
+ */
+void
+buildSpatialTree(){
+    int slots[MAX_WORLD_ASTEROIDS];
+    int n = ASTEROID_SLOTS;
+    
+    for(int i = 0; i < n; i++){
+        slots[i] = i;
+    }
+    spatialNodesUsed = 0;
+    spatialNode(slots, n);
+    spatialBuilt = n;
+    spatialBuiltArea = 0.0;
+    refitSpatialTree();
+    spatialBuiltArea = spatialArea();
+}
+
+// Makes the node for the given slots and everything below it, returning its index.
+int
+spatialNode(int *slots, int n){
+    int node = spatialNodesUsed++;
+    SpatialNode *s = &spatialNodes[node];
+    double minX = 0, minY = 0, maxX = 0, maxY = 0;
+    int half = n/2, alongX;
+    
+    if(n == 1){
+        s->slot = slots[0];
+        s->left = s->right = -1;
+        return node;
+    }
+    
+    for(int i = 0; i < n; i++){
+        Asteroid *a = &asteroids[slots[i]];
+        if(i == 0 || a->x < minX) minX = a->x;
+        if(i == 0 || a->x > maxX) maxX = a->x;
+        if(i == 0 || a->y < minY) minY = a->y;
+        if(i == 0 || a->y > maxY) maxY = a->y;
+    }
+    
+    // Split the slots around the middle one along the longer side, so each child gets half.
+    alongX = (maxX - minX > maxY - minY);
+    for(int lo = 0, hi = n - 1; lo < hi; ){
+        Asteroid *pivot = &asteroids[slots[(lo + hi)/2]];
+        double key = alongX ? pivot->x : pivot->y;
+        int i = lo, j = hi;
+        while(i <= j){
+            while((alongX ? asteroids[slots[i]].x : asteroids[slots[i]].y) < key) i++;
+            while((alongX ? asteroids[slots[j]].x : asteroids[slots[j]].y) > key) j--;
+            if(i <= j){
+                int swap = slots[i];
+                slots[i] = slots[j], slots[j] = swap;
+                i++, j--;
+            }
+        }
+        if(half <= j){
+            hi = j;
+        }else if(half >= i){
+            lo = i;
+        }else{
+            break;
+        }
+    }
+    
+    s->slot = -1;
+    s->left = spatialNode(slots, half);
+    s->right = spatialNode(slots + half, n - half);
+    return node;
+}
+
+/* Moves the boxes of the tree to where the asteroids are now. Children always come after
+ * their parent in the node array, so one pass from the back fixes every box. When the boxes
+ * have grown to twice the size they had after the last build the tree is built again.
+ */
+void
+refitSpatialTree(){
+    // The tree is built again when a game changes how many slots are in use.
+    if(spatialBuilt != ASTEROID_SLOTS){
+        buildSpatialTree();
+        return;
+    }
+    
+    for(int node = spatialNodesUsed - 1; node >= 0; node--){
+        SpatialNode *s = &spatialNodes[node];
+        if(s->slot >= 0){
+            Asteroid *a = &asteroids[s->slot];
+            if(a->active == 1){
+                double r = asteroidShape(a)->radius;
+                s->minX = a->x - r, s->maxX = a->x + r;
+                s->minY = a->y - r, s->maxY = a->y + r;
+            }else{
+                // An empty box, which nothing can hit.
+                s->minX = s->minY = HUGE_VAL;
+                s->maxX = s->maxY = -HUGE_VAL;
+            }
+        }else{
+            SpatialNode *l = &spatialNodes[s->left];
+            SpatialNode *r = &spatialNodes[s->right];
+            s->minX = (l->minX < r->minX) ? l->minX : r->minX;
+            s->maxX = (l->maxX > r->maxX) ? l->maxX : r->maxX;
+            s->minY = (l->minY < r->minY) ? l->minY : r->minY;
+            s->maxY = (l->maxY > r->maxY) ? l->maxY : r->maxY;
+        }
+    }
+    
+    if(spatialBuiltArea > 0 && spatialArea() > 2*spatialBuiltArea){
+        buildSpatialTree();
+    }
+}
+
+// Adds up the areas of the inner boxes of the tree, how much of the field a query has to look at.
+double
+spatialArea(){
+    double area = 0.0;
+    
+    for(int node = 0; node < spatialNodesUsed; node++){
+        SpatialNode *s = &spatialNodes[node];
+        if(s->slot < 0 && s->maxX >= s->minX){
+            area = area + (s->maxX - s->minX)*(s->maxY - s->minY);
+        }
+    }
+    return area;
+}
+
+/* Finds the first asteroid a ray from (x, y) hits within the given distance. On the wrapping
+ * playfield the ray is cut into pieces at the edges and carries on from the far side, and
+ * every piece is also tested against the copies of asteroids poking in over the edges. The
+ * queries below only read the tree, so any number of them can run at once on different
+ * threads as long as nothing is refitting it.
+ */
+int
+raycastAsteroids(double x, double y, double dirX, double dirY, double maxDist, SpatialHit *hit){
+    double len = sqrt(dirX*dirX + dirY*dirY);
+    double ux, uy, travelled = 0.0;
+    int wrap = !WORLD_ACTIVE;
+    
+    if(len == 0 || maxDist <= 0){
+        return 0;
+    }
+    ux = dirX/len, uy = dirY/len;
+    // Start from inside the playfield, the same as wrapPosition.
+    if(wrap){
+        x = (x < 0) ? x + xMax : ((x > xMax) ? x - xMax : x);
+        y = (y < 0) ? y + yMax : ((y > yMax) ? y - yMax : y);
+    }
+    
+    for(int pieces = 0; travelled < maxDist && pieces < 64; pieces++){
+        double piece = maxDist - travelled;
+        double best = -1;
+        int bestSlot = -1;
+        
+        // Stop this piece where it leaves the playfield.
+        if(wrap){
+            if(ux > 0) piece = fmin(piece, (xMax - x)/ux);
+            if(ux < 0) piece = fmin(piece, -x/ux);
+            if(uy > 0) piece = fmin(piece, (yMax - y)/uy);
+            if(uy < 0) piece = fmin(piece, -y/uy);
+            piece = fmax(piece, 1e-9);
+        }
+        
+        if(ASTEROID_SLOTS < SPATIAL_RAY_SLOTS){
+            spatialScanRay(x, y, ux*piece, uy*piece, wrap, &best, &bestSlot);
+        }else{
+            SpatialNode *root = &spatialNodes[0];
+            double x0 = fmin(x, x + ux*piece), x1 = fmax(x, x + ux*piece);
+            double y0 = fmin(y, y + uy*piece), y1 = fmax(y, y + uy*piece);
+            // Only walk the tree again for the copies of the field this piece reaches into.
+            for(int ox = -wrap; ox <= wrap; ox++){
+                if(!spatialOverlap(x0, x1, ox*xMax, root->minX, root->maxX)){
+                    continue;
+                }
+                for(int oy = -wrap; oy <= wrap; oy++){
+                    if(spatialOverlap(y0, y1, oy*yMax, root->minY, root->maxY)){
+                        spatialRaycast(x - ox*xMax, y - oy*yMax, ux*piece, uy*piece, &best, &bestSlot);
+                    }
+                }
+            }
+        }
+        if(bestSlot >= 0){
+            hit->index = bestSlot;
+            hit->distance = travelled + best*piece;
+            hit->x = x + ux*best*piece;
+            hit->y = y + uy*best*piece;
+            return 1;
+        }
+        
+        travelled = travelled + piece;
+        x = x + ux*piece;
+        y = y + uy*piece;
+        if(wrap){
+            if(ux > 0 && x >= xMax) x = x - xMax;
+            if(ux < 0 && x <= 0) x = x + xMax;
+            if(uy > 0 && y >= yMax) y = y - yMax;
+            if(uy < 0 && y <= 0) y = y + yMax;
+        }
+    }
+    return 0;
+}
+
+/* Walks the tree for the segment from (x, y) along (ex, ey), nearest boxes first, and keeps
+ * the closest hit as a fraction of the segment. Boxes further along than the best hit so
+ * far are skipped.
+ */
+void
+spatialRaycast(double x, double y, double ex, double ey, double *best, int *bestSlot){
+    int stack[2*MAX_WORLD_ASTEROIDS];
+    double enter[2*MAX_WORLD_ASTEROIDS];
+    int top = 0;
+    double t = spatialRayBox(&spatialNodes[0], x, y, ex, ey);
+    
+    if(t < 0){
+        return;
+    }
+    stack[top] = 0, enter[top] = t, top++;
+    while(top > 0){
+        SpatialNode *s;
+        top--;
+        if(*best >= 0 && enter[top] > *best){
+            continue;
+        }
+        s = &spatialNodes[stack[top]];
+        if(s->slot >= 0){
+            Asteroid *a = &asteroids[s->slot];
+            double hitT = segmentAsteroid(a, x, y, x + ex, y + ey);
+            if(hitT >= 0 && (*best < 0 || hitT < *best)){
+                *best = hitT;
+                *bestSlot = s->slot;
+            }
+        }else{
+            double tl = spatialRayBox(&spatialNodes[s->left], x, y, ex, ey);
+            double tr = spatialRayBox(&spatialNodes[s->right], x, y, ex, ey);
+            // Push the further child first so the nearer one is looked at first.
+            if(tl > tr){
+                stack[top] = s->left, enter[top] = tl, top++;
+                if(tr >= 0) stack[top] = s->right, enter[top] = tr, top++;
+            }else{
+                if(tr >= 0) stack[top] = s->right, enter[top] = tr, top++;
+                if(tl >= 0) stack[top] = s->left, enter[top] = tl, top++;
+            }
+        }
+    }
+}
+
+/* The same as spatialRaycast without the tree: every live asteroid, and each copy of it the
+ * segment comes near.
+ */
+void
+spatialScanRay(double x, double y, double ex, double ey, int wrap, double *best, int *bestSlot){
+    double x0 = fmin(x, x + ex), x1 = fmax(x, x + ex);
+    double y0 = fmin(y, y + ey), y1 = fmax(y, y + ey);
+    
+    for(int i = 0; i < ASTEROID_SLOTS; i++){
+        Asteroid *a = &asteroids[i];
+        double r;
+        
+        if(a->active != 1){
+            continue;
+        }
+        r = asteroidShape(a)->radius;
+        // Only an asteroid over an edge has a copy on the far side, as in wrapOffsets.
+        for(int ox = -(wrap && a->x + r > xMax); ox <= (wrap && a->x - r < 0); ox++){
+            if(!spatialOverlap(x0, x1, ox*xMax, a->x - r, a->x + r)){
+                continue;
+            }
+            for(int oy = -(wrap && a->y + r > yMax); oy <= (wrap && a->y - r < 0); oy++){
+                double t;
+                if(!spatialOverlap(y0, y1, oy*yMax, a->y - r, a->y + r)){
+                    continue;
+                }
+                t = segmentAsteroid(a, x - ox*xMax, y - oy*yMax, x - ox*xMax + ex, y - oy*yMax + ey);
+                if(t >= 0 && (*best < 0 || t < *best)){
+                    *best = t;
+                    *bestSlot = i;
+                }
+            }
+        }
+    }
+}
+
+// Tells whether the range from lo to hi, moved back by shift, overlaps the one from min to max.
+int
+spatialOverlap(double lo, double hi, double shift, double min, double max){
+    return lo - shift <= max && hi - shift >= min;
+}
+
+// Returns the fraction along a segment where it enters a box, 0 if it starts inside, or -1.
+double
+spatialRayBox(SpatialNode *s, double x, double y, double ex, double ey){
+    double tMin = 0.0, tMax = 1.0;
+    double lo[2] = {s->minX, s->minY}, hi[2] = {s->maxX, s->maxY};
+    double p[2] = {x, y}, e[2] = {ex, ey};
+    
+    if(s->maxX < s->minX){
+        return -1;
+    }
+    for(int axis = 0; axis < 2; axis++){
+        if(e[axis] == 0){
+            if(p[axis] < lo[axis] || p[axis] > hi[axis]){
+                return -1;
+            }
+        }else{
+            double t0 = (lo[axis] - p[axis])/e[axis];
+            double t1 = (hi[axis] - p[axis])/e[axis];
+            if(t0 > t1){
+                double swap = t0;
+                t0 = t1, t1 = swap;
+            }
+            tMin = fmax(tMin, t0);
+            tMax = fmin(tMax, t1);
+            if(tMin > tMax){
+                return -1;
+            }
+        }
+    }
+    return tMin;
+}
+
+/* Finds the k asteroids with centers closest to (x, y), nearest first, and returns how many
+ * there were. On the wrapping playfield the distance is to the nearest copy of an asteroid,
+ * and that copy's position is what gets stored.
+ */
+int
+nearestAsteroids(double x, double y, int k, SpatialHit *hits){
+    int stack[2*MAX_WORLD_ASTEROIDS];
+    double near[2*MAX_WORLD_ASTEROIDS];
+    int top = 0, count = 0;
+    
+    if(k <= 0){
+        return 0;
+    }
+    if(ASTEROID_SLOTS < SPATIAL_NEAR_SLOTS){
+        for(int i = 0; i < ASTEROID_SLOTS; i++){
+            if(asteroids[i].active == 1){
+                count = spatialKeepNearest(i, x, y, k, hits, count);
+            }
+        }
+    }else{
+        stack[top] = 0, near[top] = spatialBoxDistance(&spatialNodes[0], x, y), top++;
+    }
+    while(top > 0){
+        SpatialNode *s;
+        top--;
+        // Distances are squared until they are stored.
+        if(near[top] == HUGE_VAL || (count == k && near[top] >= hits[k-1].distance)){
+            continue;
+        }
+        s = &spatialNodes[stack[top]];
+        if(s->slot >= 0){
+            count = spatialKeepNearest(s->slot, x, y, k, hits, count);
+        }else{
+            // Look at the nearer child first so the list fills up with close ones quickly.
+            double dl = spatialBoxDistance(&spatialNodes[s->left], x, y);
+            double dr = spatialBoxDistance(&spatialNodes[s->right], x, y);
+            if(dl < dr){
+                stack[top] = s->right, near[top] = dr, top++;
+                stack[top] = s->left, near[top] = dl, top++;
+            }else{
+                stack[top] = s->left, near[top] = dl, top++;
+                stack[top] = s->right, near[top] = dr, top++;
+            }
+        }
+    }
+    
+    for(int j = 0; j < count; j++){
+        hits[j].distance = sqrt(hits[j].distance);
+    }
+    return count;
+}
+
+/* Puts an asteroid into the list of the nearest ones so far if it is closer than the last of
+ * them, keeping the list in order, and returns how long the list is now. The distances are
+ * still squared.
+ */
+int
+spatialKeepNearest(int slot, double x, double y, int k, SpatialHit *hits, int count){
+    Asteroid *a = &asteroids[slot];
+    double dx = spatialWrapDelta(a->x - x, xMax);
+    double dy = spatialWrapDelta(a->y - y, yMax);
+    double dist = dx*dx + dy*dy;
+    int j;
+    
+    // Insert it in order, dropping the furthest if the list is full.
+    if(count < k){
+        j = count++;
+    }else if(dist < hits[k-1].distance){
+        j = k - 1;
+    }else{
+        return count;
+    }
+    while(j > 0 && hits[j-1].distance > dist){
+        hits[j] = hits[j-1];
+        j--;
+    }
+    hits[j].index = slot;
+    hits[j].distance = dist;
+    hits[j].x = x + dx;
+    hits[j].y = y + dy;
+    return count;
+}
+
+/* Finds every asteroid whose outline may come within the given distance of (x, y), up to
+ * max of them, in no particular order. The stored distance is from the point to the center.
+ */
+int
+asteroidsInRadius(double x, double y, double radius, SpatialHit *hits, int max){
+    int stack[2*MAX_WORLD_ASTEROIDS];
+    int top = 0, count = 0;
+    
+    if(ASTEROID_SLOTS < SPATIAL_NEAR_SLOTS){
+        for(int i = 0; i < ASTEROID_SLOTS && count < max; i++){
+            if(asteroids[i].active == 1){
+                count = spatialKeepInRadius(i, x, y, radius, hits, count);
+            }
+        }
+        return count;
+    }
+    
+    stack[top++] = 0;
+    while(top > 0 && count < max){
+        SpatialNode *s = &spatialNodes[stack[--top]];
+        
+        if(spatialBoxDistance(s, x, y) > radius*radius){
+            continue;
+        }
+        if(s->slot >= 0){
+            count = spatialKeepInRadius(s->slot, x, y, radius, hits, count);
+        }else{
+            stack[top++] = s->left;
+            stack[top++] = s->right;
+        }
+    }
+    return count;
+}
+
+// Adds an asteroid to the list if its outline may come within the radius, returning how long the list is now.
+int
+spatialKeepInRadius(int slot, double x, double y, double radius, SpatialHit *hits, int count){
+    Asteroid *a = &asteroids[slot];
+    double dx = spatialWrapDelta(a->x - x, xMax);
+    double dy = spatialWrapDelta(a->y - y, yMax);
+    double dist = sqrt(dx*dx + dy*dy);
+    
+    if(dist <= radius + asteroidShape(a)->radius){
+        hits[count].index = slot;
+        hits[count].distance = dist;
+        hits[count].x = x + dx;
+        hits[count].y = y + dy;
+        count++;
+    }
+    return count;
+}
+
+// Returns the squared distance from a point to the nearest copy of a box, or HUGE_VAL for an empty box.
+double
+spatialBoxDistance(SpatialNode *s, double x, double y){
+    double dx, dy;
+    
+    if(s->maxX < s->minX){
+        return HUGE_VAL;
+    }
+    dx = spatialIntervalDistance(s->minX, s->maxX, x, xMax);
+    dy = spatialIntervalDistance(s->minY, s->maxY, y, yMax);
+    return dx*dx + dy*dy;
+}
+
+// Returns how far a coordinate is from an interval, also trying the wrapped copies of it.
+double
+spatialIntervalDistance(double lo, double hi, double p, double size){
+    double below = lo - p, above = p - hi;
+    
+    if(below <= 0 && above <= 0){
+        return 0.0;
+    }
+    // Coming round the other side of the playfield may be shorter.
+    if(!WORLD_ACTIVE){
+        if(below > 0 && p + size - hi < below){
+            below = (p + size - hi > 0) ? p + size - hi : 0.0;
+        }
+        if(above > 0 && lo - p + size < above){
+            above = (lo - p + size > 0) ? lo - p + size : 0.0;
+        }
+    }
+    return (below > above) ? below : above;
+}
+
+// Returns the shortest way along one axis between two points, going round the playfield if that's shorter.
+double
+spatialWrapDelta(double d, double size){
+    if(!WORLD_ACTIVE){
+        if(d > size/2){
+            d = d - size;
+        }else if(d < -size/2){
+            d = d + size;
+        }
+    }
+    return d;
+}
+
+/* -- frames and threads ---------------------------------------------------- */
+
+/* Copies what the screens draw into the back frame and swaps it into the middle, marked
+ * fresh. Fracture and boss outlines are only copied when they were rewritten since this
+ * buffer last held them.
+ */
+void
+publishFrame(){
+    FrameState *f = &frames[frameBack];
+    
+    f->display = currentScreen;
+    f->xMax = xMax, f->yMax = yMax;
+    f->cameraX = cameraX, f->cameraY = cameraY;
+    f->inputsApplied = inputHead;
+    f->showCounters = showCounters;
+    screenFrames = screenFrames + 1;
+    for(int l = 0; l < STAR_LAYERS; l++){
+        f->starOffsetX[l] = starLayers[l].offsetX;
+        f->starOffsetY[l] = starLayers[l].offsetY;
+    }
+    f->gameState = gameState, f->gameMode = gameMode, f->lives = lives;
+    f->timeLeft = levelTimeLeft();
+    f->score = score;
+    f->nBest = (scoreBoard.nTop < SCORE_SHOWN) ? (int)scoreBoard.nTop : SCORE_SHOWN;
+    memcpy(f->best, scoreBoard.top, f->nBest*sizeof(ScoreEntry));
+    f->ship = ship;
+    f->shipExplosion = shipExplosion;
+    memcpy(f->shipInstances, shipInstances, sizeof(shipInstances));
+    f->nShipInstances = nShipInstances;
+    renderSystem(f);
+    for(int i = 0; i < MAX_BOSSES; i++){
+        Boss *b = &bosses[i], *copy = &f->bosses[i];
+        if(copy->shape.version != b->shape.version){
+            memcpy(&copy->shape, &b->shape, sizeof(BossShape));
+        }
+        copy->active = b->active;
+        copy->x = b->x, copy->y = b->y, copy->phi = b->phi;
+    }
+    memcpy(f->asteroidInstances, asteroidInstances, nAsteroidInstances*sizeof(AsteroidInstance));
+    f->nAsteroidInstances = nAsteroidInstances;
+    for(int i = 0; i < ASTEROID_SLOTS; i++){
+        AsteroidShape *shape = &shapeLibrary[FRACTURE_SHAPE(i)];
+        if(f->outlines[i].version != shape->version){
+            f->outlines[i].version = shape->version;
+            f->outlines[i].nVertices = shape->nVertices;
+            memcpy(f->outlines[i].coords, shape->coords, shape->nVertices*sizeof(Coords));
+        }
+    }
+    
+    frameBack = __atomic_exchange_n(&frameMiddle, frameBack | FRAME_FRESH, __ATOMIC_ACQ_REL) & 3;
+}
+
+// Takes the newest finished frame for drawing, if there is one since the last time.
+void
+acquireFrame(){
+    if(__atomic_load_n(&frameMiddle, __ATOMIC_ACQUIRE) & FRAME_FRESH){
+        frameFront = __atomic_exchange_n(&frameMiddle, frameFront, __ATOMIC_ACQ_REL) & 3;
+    }
+    view = &frames[frameFront];
+}
+
+/* The one display callback given to GLUT. It draws the newest frame with the screen that
+ * was showing when it was made. Without the simulation thread the game is on this thread and
+ * between ticks, so the frame is simply made right here. With -stats it keeps track of how
+ * evenly frames come out and how long fired photons take to show up.
+ */
+void
+renderFrame(){
+    static double lastSwap = 0.0, frameSum = 0.0, frameSquares = 0.0;
+    static int frameCount = 0;
+    static unsigned int shown = 0;
+    double now;
+    
+    if(!threaded){
+        publishFrame();
+    }
+    acquireFrame();
+    now = monotonicSeconds();
+    if(view->display != NULL){
+        view->display();
+    }
+    countEvent(COUNT_FRAMES, 1);
+    setGauge(GAUGE_FRAME_US, 1e6*(monotonicSeconds() - now));
+    now = monotonicSeconds();
+    sampleCounters(now);
+    
+    if(!showStats){
+        return;
+    }
+    if(lastSwap > 0){
+        frameSum = frameSum + (now - lastSwap);
+        frameSquares = frameSquares + (now - lastSwap)*(now - lastSwap);
+        frameCount = frameCount + 1;
+    }
+    lastSwap = now;
+    /* Every event the game had applied by the time it made this frame is on screen now.
+     * Input comes in on this thread too, so the times of the ones still in the queue
+     * can't be written over while they are read.
+     */
+    if(inputTail - shown > INPUT_QUEUE_SIZE){
+        shown = inputTail - INPUT_QUEUE_SIZE;
+    }
+    while(shown != view->inputsApplied && shown != inputTail){
+        recordLatency(latencyBuckets, &latencyCount, now - inputQueue[shown%INPUT_QUEUE_SIZE].time);
+        shown = shown + 1;
+    }
+    
+    if(frameCount == STATS_FRAMES){
+        double mean = frameSum/frameCount;
+        FILE *out;
+        int i;
+        printf("%s: frames %.1f ms apart, %.2f ms deviation; input to screen %.0f ms p50, %.0f ms p99 over %ld events\n",
+               threaded ? "threaded" : "single thread", 1e3*mean,
+               1e3*sqrt(fmax(0.0, frameSquares/frameCount - mean*mean)),
+               latencyPercentile(latencyBuckets, latencyCount, 0.5),
+               latencyPercentile(latencyBuckets, latencyCount, 0.99), latencyCount);
+        // The whole histogram goes out as well, for a closer look at the tail.
+        out = fopen("input_latency.csv", "w");
+        if(out != NULL){
+            fprintf(out, "bucket_ms,count\n");
+            for(i = 0; i <= LATENCY_BUCKETS; i++){
+                fprintf(out, "%d,%ld\n", i, latencyBuckets[i]);
+            }
+            fclose(out);
+        }
+        frameSum = frameSquares = 0.0;
+        frameCount = 0;
+    }
+}
+
+/* Counts a latency in a histogram of 1 ms buckets, for input or for sound. The last bucket
+ * holds everything from LATENCY_BUCKETS ms up.
+ */
+void
+recordLatency(long *buckets, long *count, double latency){
+    int bucket = (int)(latency*1e3);
+    
+    if(bucket < 0){
+        bucket = 0;
+    }
+    if(bucket > LATENCY_BUCKETS){
+        bucket = LATENCY_BUCKETS;
+    }
+    buckets[bucket] = buckets[bucket] + 1;
+    *count = *count + 1;
+}
+
+/* Returns the latency in ms that the given fraction of events came in under, as the upper
+ * edge of the bucket it lands in.
+ */
+double
+latencyPercentile(long *buckets, long count, double fraction){
+    long seen = 0;
+    int i;
+    
+    for(i = 0; i <= LATENCY_BUCKETS; i++){
+        seen = seen + buckets[i];
+        if(seen > 0 && seen >= fraction*count){
+            return i + 1;
+        }
+    }
+    return 0.0;
+}
+
+/* Adds up the counter blocks of both threads, once a frame. Every COUNTER_WINDOW seconds
+ * the counts since the last window are turned into rates per second for the overlay.
+ */
+void
+sampleCounters(double now){
+    static double startTime = 0.0, windowStart = 0.0, lastDump = 0.0;
+    static int started = 0;
+    
+    if(!started){
+        startTime = windowStart = lastDump = now;
+        started = 1;
+    }
+    for(int c = 0; c < COUNTERS; c++){
+        long total = 0;
+        for(int b = 0; b < COUNTER_BLOCKS; b++){
+            total = total + __atomic_load_n(&counterBlocks[b].value[c], __ATOMIC_RELAXED);
+        }
+        counterTotals[c] = total;
+    }
+    
+    if(now - windowStart >= COUNTER_WINDOW){
+        for(int c = 0; c < COUNTERS; c++){
+            if(c < FIRST_GAUGE){
+                counterRates[c] = (counterTotals[c] - counterWindow[c])/(now - windowStart);
+                counterWindow[c] = counterTotals[c];
+            }else{
+                counterRates[c] = counterTotals[c];
+            }
+        }
+        windowStart = now;
+    }
+    if(counterInterval > 0 && now - lastDump >= counterInterval){
+        dumpCounters(now - startTime);
+        lastDump = now;
+    }
+}
+
+/* Prints the counters as one line of JSON: the seconds since the first sample, the totals so
+ * far and the latest gauges, along with the rates of the last window.
+ */
+void
+dumpCounters(double time){
+    printf("{\"time\": %.2f", time);
+    for(int c = 0; c < COUNTERS; c++){
+        printf(", \"%s\": %ld", counterNames[c], counterTotals[c]);
+    }
+    printf(", \"ticks_per_s\": %.1f, \"frame_ms\": %.2f}\n",
+           counterRates[COUNT_TICKS], 1e-3*counterRates[GAUGE_FRAME_US]);
+    fflush(stdout);
+}
+
+// Shows the rates of the last window under the level in the top left corner, P toggles it.
+void
+drawCounters(){
+    char lines[COUNTER_LINES][TEXT_MAX];
+    
+    formatCounters(lines);
+    glLoadIdentity();
+    glColor3f(0.6, 1.0, 0.6);
+    for(int i = 0; i < COUNTER_LINES; i++){
+        drawString(lines[i], 10, view->yMax - 10 - 3*i);
+    }
+}
+
+// The lines of the counter overlay, shared by the window and the terminal.
+void
+formatCounters(char lines[COUNTER_LINES][TEXT_MAX]){
+    snprintf(lines[0], TEXT_MAX, "TICKS/S %.0f FRAME MS %.2f", counterRates[COUNT_TICKS],
+             1e-3*counterRates[GAUGE_FRAME_US]);
+    snprintf(lines[1], TEXT_MAX, "PAIRS/S %.0f HITS/S %.1f", counterRates[COUNT_PAIRS_TESTED],
+             counterRates[COUNT_PAIRS_HIT]);
+    snprintf(lines[2], TEXT_MAX, "ROCKS %.0f SHOTS %.0f DUST %.0f", counterRates[GAUGE_ASTEROIDS],
+             counterRates[GAUGE_PHOTONS], counterRates[GAUGE_DUST]);
+    snprintf(lines[3], TEXT_MAX, "ALLOCS/S %.0f RANDOM/S %.0f", counterRates[COUNT_ALLOCATIONS],
+             counterRates[COUNT_RANDOM]);
+    snprintf(lines[4], TEXT_MAX, "DRAWN/S %.0f SHIPS %.0f", counterRates[COUNT_DRAWN],
+             counterRates[GAUGE_ENEMIES]);
+}
+
+/* Asks GLUT to draw whenever the simulation thread has finished a new frame. While none
+ * come, as on an idle screen, it looks less and less often, down to every RENDER_POLL_MAX_MS.
+ */
+void
+renderPoll(int value){
+    int wait = 4;
+    
+    if(__atomic_load_n(&frameMiddle, __ATOMIC_ACQUIRE) & FRAME_FRESH){
+        glutPostRedisplay();
+    }else{
+        wait = (2*value < RENDER_POLL_MAX_MS) ? 2*value : RENDER_POLL_MAX_MS;
+    }
+    glutTimerFunc(wait, renderPoll, wait);
+}
+
+/* Runs the game with -threaded. The screens keep chaining their timers through
+ * scheduleTimer, and this runs each tick when it is due and hands over the frame it made, if
+ * the tick drew one. In between it sleeps, waking early only to apply input on an idle screen.
+ */
+void *
+simulationThread(void *arg){
+    double next = monotonicSeconds();
+    
+    counters = &counterBlocks[1];
+    telemetry = &telemetryBlocks[1];
+    while(__atomic_load_n(&simRunning, __ATOMIC_ACQUIRE)){
+        double wait = next - monotonicSeconds();
+        if(wait > 0){
+            struct timespec until;
+            pthread_mutex_lock(&simLock);
+            // The condition variable waits on the time of day, so the wait is made relative.
+            clock_gettime(CLOCK_REALTIME, &until);
+            wait = wait + until.tv_nsec*1e-9;
+            until.tv_sec = until.tv_sec + (time_t)wait;
+            until.tv_nsec = (long)((wait - floor(wait))*1e9);
+            // Queued input only cuts the wait short on an idle screen, the others take it at the tick.
+            if(simRunning && (pendingTicks == 1 || inputHead == __atomic_load_n(&inputTail, __ATOMIC_ACQUIRE))){
+                pthread_cond_timedwait(&simWake, &simLock, &until);
+            }
+            pthread_mutex_unlock(&simLock);
+            
+            if(pendingTicks > 1 && inputHead != __atomic_load_n(&inputTail, __ATOMIC_ACQUIRE)){
+                wakeIdle();
+            }else if(monotonicSeconds() < next){
+                // Anything else waits for the tick, so input still lands on tick boundaries.
+                continue;
+            }
+        }else{
+            runTick(pendingValue);
+            // Don't try to catch up on ticks after a long stall, just carry on from now.
+            next = fmax(next + pendingTicks*TICK_MS*1e-3, monotonicSeconds() - 0.1);
+        }
+        if(redrawWanted){
+            redrawWanted = 0;
+            publishFrame();
+        }
+    }
+    return arg;
+}
+
+/* Stops the game's thread and waits for it to finish the tick it is on, so that whatever runs
+ * after this has the game's state to itself. The flag is cleared under the lock so the thread
+ * can't miss the wakeup between looking at it and going to sleep.
+ */
+void
+stopSimulation(){
+    if(!simRunning){
+        return;
+    }
+    pthread_mutex_lock(&simLock);
+    __atomic_store_n(&simRunning, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&simWake);
+    pthread_mutex_unlock(&simLock);
+    pthread_join(simThread, NULL);
+}
+
+/* Puts an input event on the queue, stamped with the time it came in. Whichever thread runs
+ * the game takes them off at the start of its next tick, or right away on an idle screen.
+ * Events are dropped if it falls so far behind that the queue fills up.
+ */
+void
+queueInput(int type, int key, int state, int x, int y){
+    unsigned int tail = inputTail;
+    InputEvent *event;
+    
+    if(tail - __atomic_load_n(&inputHead, __ATOMIC_ACQUIRE) == INPUT_QUEUE_SIZE){
+        return;
+    }
+    event = &inputQueue[tail%INPUT_QUEUE_SIZE];
+    event->type = type, event->key = key, event->state = state;
+    event->x = x, event->y = y;
+    event->time = monotonicSeconds();
+    __atomic_store_n(&inputTail, tail + 1, __ATOMIC_RELEASE);
+    
+    if(threaded){
+        pthread_mutex_lock(&simLock);
+        pthread_cond_signal(&simWake);
+        pthread_mutex_unlock(&simLock);
+    }else if(!headless && pendingTicks > 1){
+        wakeIdle();
+    }
+}
+
+// Takes the oldest event off the input queue, returning 0 if there wasn't one.
+int
+popInput(InputEvent *event){
+    unsigned int head = inputHead;
+    
+    if(head == __atomic_load_n(&inputTail, __ATOMIC_ACQUIRE)){
+        return 0;
+    }
+    *event = inputQueue[head%INPUT_QUEUE_SIZE];
+    __atomic_store_n(&inputHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Applies everything that came in since the last tick, in the order it came in. A cursor
+ * key counts as held for the tick if it was down at any point since the last one, so a tap
+ * shorter than a tick still turns or pushes the ship.
+ */
+void
+handleInputs(){
+    InputEvent event;
+    int pressed = 0;
+    
+    while(popInput(&event)){
+        switch(event.type){
+            case INPUT_KEY:
+                applyKey((unsigned char)event.key);
+                break;
+            case INPUT_SPECIAL_DOWN:
+                keysDown = keysDown | keyBit(event.key);
+                pressed = pressed | keyBit(event.key);
+                break;
+            case INPUT_SPECIAL_UP:
+                keysDown = keysDown & ~keyBit(event.key);
+                break;
+            case INPUT_MOUSE:
+                applyClick(event.key, event.state, event.x, event.y);
+                break;
+            case INPUT_RESHAPE:
+                resizePlayfield(event.x, event.y);
+                break;
+            case INPUT_VISIBILITY:
+                windowHidden = (event.state == GLUT_HIDDEN || event.state == GLUT_FULLY_COVERED);
+                break;
+        }
+    }
+    left = ((keysDown | pressed) & KEY_LEFT) != 0;
+    up = ((keysDown | pressed) & KEY_UP) != 0;
+    right = ((keysDown | pressed) & KEY_RIGHT) != 0;
+    down = ((keysDown | pressed) & KEY_DOWN) != 0;
+}
+
+// Returns the held key bit for a cursor key, or nothing for any other special key.
+int
+keyBit(int key){
+    switch (key)
+    {
+        case 100:
+            return KEY_LEFT;
+        case 101:
+            return KEY_UP;
+        case 102:
+            return KEY_RIGHT;
+        case 103:
+            return KEY_DOWN;
+    }
+    return 0;
+}
+
+// Handles a key taken off the input queue.
+void
+applyKey(unsigned char key){
+    switch(key)
+    {
+        // Pick the game mode while on the menu.
+        case 'm':
+        case 'M':
+            if(gameState == 0){
+                gameMode = (gameMode + 1)%MODE_COUNT;
+            }
+            break;
+        // Tune how coarse the gravity approximation is.
+        case '[':
+            gravityTheta = (gravityTheta > 0.1) ? gravityTheta - 0.1 : 0.0;
+            break;
+        case ']':
+            gravityTheta = (gravityTheta < 1.5) ? gravityTheta + 0.1 : 1.5;
+            break;
+        // Hand the ship over to the autopilot and back.
+        case 'a':
+        case 'A':
+            if(gameState > 0){
+                autopilot = !autopilot;
+            }
+            break;
+        // Show the counters over the HUD.
+        case 'p':
+        case 'P':
+            showCounters = !showCounters;
+            break;
+        case 32:
+            firePhoton();
+            break;
+        // Enter starts a game from the menu, for the terminal that has no mouse.
+        case 13:
+            if(gameState == 0){
+                pressStart();
+            }
+            break;
+    }
+}
+
+// Handles a mouse click taken off the input queue, starting a game from the start button.
+void
+applyClick(int button, int state, int x, int y){
+    if(state == GLUT_DOWN){
+        if(gameState == 0){
+            if(withinBox(x, y, &startbox)){
+                pressStart();
+            }
+        }
+    }
+}
+
+void
+pressStart(){
+    gameState = 1;
+}
+
+/* Runs the next tick of whichever screen is up: first the input that came in since the
+ * last one, then the screen's timer.
+ */
+void
+runTick(int value){
+    void (*timer)(int) = pendingTimer;
+    
+    handleInputs();
+    pendingTimer = NULL;
+    if(timer != NULL){
+        timer(value);
+    }
+}
+
+// Returns the time in seconds on a clock that never jumps, for timing things across threads.
+double
+monotonicSeconds(){
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+/* Returns the cpu time this thread has used in seconds. Unlike clock() it leaves out the
+ * other threads, the renderer, the mixer and any OpenMP workers.
+ */
+double
+threadSeconds(){
+    struct timespec now;
+    
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+/* -- autopilot ------------------------------------------------------------- */
+
+/* Plays the ship for one tick by setting the same key flags a player would. It aims at the
+ * asteroid that is quickest to shoot, leading it by where it will be when a photon gets
+ * there, and tries every way of steering against a look ahead at the asteroids around the
+ * ship. The look ahead doubles for as long as the time budget lasts, and the best move of
+ * the longest look ahead that was finished is the one taken. The budget is this thread's own
+ * cpu time, and a look ahead still going at the deadline is given up part way through.
+ */
+void
+autopilotTick(){
+    static int cooldown = 0;
+    SpatialHit threats[MAX_WORLD_ASTEROIDS];
+    double start = threadSeconds(), budget = AUTOPILOT_BUDGET_US*1e-6;
+    // What is left after the deadline is for aiming the shot.
+    double deadline = start + (AUTOPILOT_BUDGET_US - AUTOPILOT_RESERVE_US)*1e-6;
+    double aimPhi = ship.phi, elapsed;
+    int nThreats, target, best = -1, depth = 0;
+    
+    if(shipExplosion.active == 1){
+        up = down = left = right = 0;
+        return;
+    }
+    
+    target = autopilotTarget(&aimPhi);
+    nThreats = asteroidsInRadius(ship.x, ship.y, AUTOPILOT_LOOKOUT, threats, MAX_WORLD_ASTEROIDS);
+    
+    // A look ahead only counts once every move of it is finished.
+    for(int horizon = 4; horizon <= AUTOPILOT_MAX_HORIZON; horizon = horizon*2){
+        double bestScore = 0.0;
+        int bestHere = -1, finished = 1;
+        
+        for(int move = 0; move < AUTOPILOT_MOVES && finished; move++){
+            double score = autopilotScore(move, horizon, threats, nThreats, aimPhi, deadline);
+            
+            if(score < 0){
+                finished = 0;
+            }else if(bestHere < 0 || score > bestScore){
+                bestHere = move;
+                bestScore = score;
+            }
+        }
+        if(!finished){
+            break;
+        }
+        best = bestHere;
+        depth = horizon;
+    }
+    
+    // Without even one finished look ahead just turn towards the target.
+    if(best < 0){
+        best = 1 + ((angleDifference(aimPhi, ship.phi) > 0) ? 1 : -1);
+    }
+    left = (best%3 == 2);
+    right = (best%3 == 0);
+    up = (best/3 == 1);
+    down = 0;
+    
+    // Shoot when the ship will be lined up with the lead on the target after this turn, or
+    // when something is right in front of it anyway.
+    if(cooldown > 0){
+        cooldown = cooldown - 1;
+    }else{
+        double phi = ship.phi + 10*(left - right);
+        SpatialHit hit;
+        if((target >= 0 && fabs(angleDifference(aimPhi, phi)) < AUTOPILOT_AIM) ||
+           raycastAsteroids(ship.x - 5*sin(DEG2RAD*phi), ship.y + 5*cos(DEG2RAD*phi),
+                            -sin(DEG2RAD*phi), cos(DEG2RAD*phi), 15.0, &hit)){
+            firePhoton();
+            cooldown = AUTOPILOT_COOLDOWN;
+        }
+    }
+    
+    elapsed = threadSeconds() - start;
+    autopilotDecisions = autopilotDecisions + 1;
+    autopilotTime = autopilotTime + elapsed;
+    autopilotDepth = autopilotDepth + depth;
+    if(elapsed > autopilotWorst){
+        autopilotWorst = elapsed;
+    }
+    if(elapsed > budget){
+        autopilotOverBudget = autopilotOverBudget + 1;
+    }
+}
+
+/* Picks the asteroid that takes the least time to turn towards and reach with a photon,
+ * out of the few nearest ones, and stores the heading that leads it. Returns -1 if none of
+ * them can be reached before the photon would leave the screen.
+ */
+int
+autopilotTarget(double *aimPhi){
+    SpatialHit near[AUTOPILOT_TARGETS];
+    int count = nearestAsteroids(ship.x, ship.y, AUTOPILOT_TARGETS, near);
+    double bestCost = 0.0;
+    int best = -1;
+    
+    for(int k = 0; k < count; k++){
+        Asteroid *a = &asteroids[near[k].index];
+        double px = near[k].x - ship.x, py = near[k].y - ship.y;
+        double qa = a->dx*a->dx + a->dy*a->dy - 25.0;
+        double qb = 2*(px*a->dx + py*a->dy);
+        double qc = px*px + py*py;
+        double disc = qb*qb - 4*qa*qc;
+        double t, aimX, aimY, phi, cost;
+        
+        // Photons fly at 5 a tick, which is always faster than any asteroid.
+        if(qa >= 0 || disc < 0){
+            continue;
+        }
+        t = (-qb - sqrt(disc))/(2*qa);
+        aimX = px + a->dx*t;
+        aimY = py + a->dy*t;
+        if(ship.x + aimX < cameraX || ship.x + aimX > cameraX + xMax ||
+           ship.y + aimY < cameraY || ship.y + aimY > cameraY + yMax){
+            continue;
+        }
+        phi = RAD2DEG*atan2(-aimX, aimY);
+        cost = fabs(angleDifference(phi, ship.phi))/10 + t;
+        if(best < 0 || cost < bestCost){
+            best = near[k].index;
+            bestCost = cost;
+            *aimPhi = phi;
+        }
+    }
+    return best;
+}
+
+/* Plays a move forward for the given number of ticks against the asteroids around the
+ * ship, which are taken to keep going in a straight line. The move is turning right, not
+ * at all or left, with or without thrust, held for a few ticks before the ship coasts.
+ * Lasting longer before a hit counts for far more than ending up pointed at the target.
+ * Returns -1 if the deadline passed before the move was played out, which the clock is
+ * checked against every few ticks of it.
+ */
+double
+autopilotScore(int move, int horizon, SpatialHit *threats, int nThreats, double aimPhi, double deadline){
+    double x = ship.x, y = ship.y, dx = ship.dx, dy = ship.dy, phi = ship.phi;
+    int turn = move%3 - 1, thrust = move/3;
+    
+    for(int t = 1; t <= horizon; t++){
+        if(t%4 == 1 && threadSeconds() > deadline){
+            return -1.0;
+        }
+        if(t <= AUTOPILOT_HOLD){
+            phi = phi + 10*turn;
+            if(thrust){
+                double speed;
+                dx = dx - ACCELERATION_STEP_FORWARD*sin(DEG2RAD*phi);
+                dy = dy + ACCELERATION_STEP_FORWARD*cos(DEG2RAD*phi);
+                speed = sqrt(dx*dx + dy*dy);
+                if(speed > SHIP_VELOCITY_MAX){
+                    dx = dx*SHIP_VELOCITY_MAX/speed;
+                    dy = dy*SHIP_VELOCITY_MAX/speed;
+                }
+            }
+        }
+        x = x + dx;
+        y = y + dy;
+        
+        for(int k = 0; k < nThreats; k++){
+            Asteroid *a = &asteroids[threats[k].index];
+            double ax = spatialWrapDelta(threats[k].x + a->dx*t - x, xMax);
+            double ay = spatialWrapDelta(threats[k].y + a->dy*t - y, yMax);
+            double reach = asteroidShape(a)->radius + SHIP_RADIUS + AUTOPILOT_MARGIN;
+            if(ax*ax + ay*ay < reach*reach){
+                return 1000.0*t;
+            }
+        }
+    }
+    return 1000.0*(horizon + 1) - fabs(angleDifference(aimPhi, phi)) - 20*sqrt(dx*dx + dy*dy);
+}
+
+// Returns how far to turn from one heading to reach another, between -180 and 180 degrees.
+double
+angleDifference(double to, double from){
+    double d = fmod(to - from, 360.0);
+    
+    if(d > 180){
+        d = d - 360;
+    }else if(d < -180){
+        d = d + 360;
+    }
+    return d;
+}
+
+/* Plays whole games with the autopilot as fast as they will go, without a window, and
+ * reports how far it got and how long its decisions took. This makes a soak test of the
+ * whole game and a benchmark that plays through every level.
+ */
+void
+runAutoplay(int games){
+    long played = 0;
+    
+    headless = 1;
+    batchRun = 1;
+    autopilot = 1;
+    xMax = 100.0*1000/600;
+    yMax = 100.0;
+    buildShapeLibrary();
+    
+    for(int g = 0; g < games; g++){
+        clock_t start = clock();
+        long ticks = 0;
+        int level = 1;
+        
+        menuInit();
+        gameState = 1;
+        startGame();
+        
+        // Back on the menu means the game is over, one way or the other.
+        while(pendingTimer != NULL && gameState > 0 && ticks < AUTOPLAY_MAX_TICKS){
+            ticks = ticks + pendingTicks;
+            played = played + pendingTicks;
+            runTick(pendingValue);
+            // Without frames the counters are gathered every tick, on the time of the game,
+            // and the sounds of the tick are mixed in before the next one.
+            sampleCounters(played*TICK_MS*1e-3);
+            audioGameTime = played*TICK_MS*1e-3;
+            catchUpAudio(audioGameTime);
+            if(gameState > level){
+                level = gameState;
+            }
+        }
+        pendingTimer = NULL;
+        
+        printf("autoplay game %d: %s level %d with %d lives left and %d points after %ld ticks (%.1f s of play) in %.2f s\n",
+               g + 1, gameWon(level) ? "beat" : "lost on", gameWon(level) ? levelCount : level, lives, score, ticks, ticks*0.033,
+               (double)(clock() - start)/CLOCKS_PER_SEC);
+    }
+    if(scoreFd >= 0){
+        printf("scores: %ld runs kept in %s, %ld commits\n", scoreCount, scorePath, scoreCommits);
+    }
+    printf("autopilot: %ld decisions, %.1f us mean, %.1f us worst, budget %d us, %ld over budget, look ahead %.1f ticks on average\n",
+           autopilotDecisions, 1e6*autopilotTime/autopilotDecisions, 1e6*autopilotWorst,
+           AUTOPILOT_BUDGET_US, autopilotOverBudget, (double)autopilotDepth/autopilotDecisions);
+}
+
+/* -- gravity wells --------------------------------------------------------- */
+
+/* Pull the asteroids, photons and the ship towards the wells and towards every asteroid. The
+ * asteroids' masses are the areas of their outlines. Forces come from a Barnes-Hut tree over
+ * the wells and asteroids, so each body only looks at the far away ones as a few clumps.
+ */
+void
+applyGravity(){
+    static double ax[MAX_WORLD_ASTEROIDS + GRAVITY_WELLS], ay[MAX_WORLD_ASTEROIDS + GRAVITY_WELLS];
+    int index[MAX_WORLD_ASTEROIDS];
+    ChunkView views[ECS_CHUNKS];
+    int n = 0, root;
+    double px, py, speed;
+    
+    for(int w = 0; w < GRAVITY_WELLS; w++){
+        gravityBodies[n].x = xMax*(w + 1)/(GRAVITY_WELLS + 1);
+        gravityBodies[n].y = yMax/2;
+        gravityBodies[n].mass = GRAVITY_WELL_MASS;
+        n++;
+    }
+    for(int i = 0; i < ASTEROID_SLOTS; i++){
+        if(asteroids[i].active == 1){
+            index[n - GRAVITY_WELLS] = i;
+            gravityBodies[n].x = asteroids[i].x;
+            gravityBodies[n].y = asteroids[i].y;
+            gravityBodies[n].mass = asteroidShape(&asteroids[i])->area;
+            n++;
+        }
+    }
+    root = buildGravityTree(gravityBodies, n);
+    gravityAll(root, ax, ay);
+    
+    // The wells stay put, everything else is pulled.
+    for(int k = GRAVITY_WELLS; k < n; k++){
+        Asteroid *a = &asteroids[index[k - GRAVITY_WELLS]];
+        a->dx = a->dx + ax[k];
+        a->dy = a->dy + ay[k];
+        
+        // Keep anything from being slung off faster than the game can follow.
+        speed = sqrt(a->dx*a->dx + a->dy*a->dy);
+        if(speed > GRAVITY_MAX_SPEED){
+            a->dx = a->dx*GRAVITY_MAX_SPEED/speed;
+            a->dy = a->dy*GRAVITY_MAX_SPEED/speed;
+        }
+    }
+    
+    n = queryChunks(HAS(COMP_POSITION) | HAS(COMP_VELOCITY), views);
+    for(int c = 0; c < n; c++){
+        Position *position = chunkColumn(&views[c], Position, COMP_POSITION);
+        Velocity *velocity = chunkColumn(&views[c], Velocity, COMP_VELOCITY);
+        for(int i = 0; i < views[c].count; i++){
+            gravityAt(root, position[i].x, position[i].y, &px, &py);
+            velocity[i].dx = velocity[i].dx + px;
+            velocity[i].dy = velocity[i].dy + py;
+        }
+    }
+    
+    if(shipExplosion.active == 0){
+        gravityAt(root, ship.x, ship.y, &px, &py);
+        ship.dx = ship.dx + px;
+        ship.dy = ship.dy + py;
+        speed = sqrt(ship.dx*ship.dx + ship.dy*ship.dy);
+        if(speed > GRAVITY_MAX_SPEED){
+            ship.dx = ship.dx*GRAVITY_MAX_SPEED/speed;
+            ship.dy = ship.dy*GRAVITY_MAX_SPEED/speed;
+        }
+    }
+}
+
+/* Builds the quadtree over the given bodies and returns its root. The bodies are first put in
+ * Morton order, which interleaves the bits of their quantized x and y, so every node of the
+ * tree covers one contiguous run of them and splitting a node only means finding where its
+ * run changes quadrant.
+ */
+int
+buildGravityTree(GravityBody *bodies, int n){
+    double minX = 0, minY = 0, maxX = 0, maxY = 0, size, scale;
+    
+    gravityNodesUsed = 0;
+    gravityLeafCount = 0;
+    
+    for(int i = 0; i < n; i++){
+        if(i == 0 || bodies[i].x < minX) minX = bodies[i].x;
+        if(i == 0 || bodies[i].x > maxX) maxX = bodies[i].x;
+        if(i == 0 || bodies[i].y < minY) minY = bodies[i].y;
+        if(i == 0 || bodies[i].y > maxY) maxY = bodies[i].y;
+    }
+    size = fmax(maxX - minX, maxY - minY)*1.0001 + 1e-9;
+    scale = 65536.0/size;
+    
+    for(int i = 0; i < n; i++){
+        unsigned int qx = (unsigned int)((bodies[i].x - minX)*scale);
+        unsigned int qy = (unsigned int)((bodies[i].y - minY)*scale);
+        unsigned int key = 0;
+        for(int bit = 15; bit >= 0; bit--){
+            key = (key << 2) | (((qy >> bit) & 1) << 1) | ((qx >> bit) & 1);
+        }
+        gravityKeys[i] = key;
+        gravityOrder[i] = i;
+    }
+    
+    // Radix sort on the keys, a byte at a time.
+    for(int shift = 0; shift < 32; shift += 8){
+        int counts[257] = {0};
+        for(int i = 0; i < n; i++){
+            counts[((gravityKeys[i] >> shift) & 0xff) + 1]++;
+        }
+        for(int b = 0; b < 256; b++){
+            counts[b+1] = counts[b+1] + counts[b];
+        }
+        for(int i = 0; i < n; i++){
+            int slot = counts[(gravityKeys[i] >> shift) & 0xff]++;
+            gravityKeysSorted[slot] = gravityKeys[i];
+            gravityOrderSorted[slot] = gravityOrder[i];
+        }
+        memcpy(gravityKeys, gravityKeysSorted, n*sizeof(unsigned int));
+        memcpy(gravityOrder, gravityOrderSorted, n*sizeof(int));
+    }
+    
+    for(int i = 0; i < n; i++){
+        gravityX[i] = bodies[gravityOrder[i]].x;
+        gravityY[i] = bodies[gravityOrder[i]].y;
+        gravityMass[i] = bodies[gravityOrder[i]].mass;
+    }
+    
+    // The root takes the first slot of the pool.
+    gravityNodesUsed = 1;
+    gravityNode(0, minX, minY, size, 0, n, 0);
+    return 0;
+}
+
+/* Fills in the given node for the sorted bodies from start to end, which all lie in the given
+ * square, and everything below it. A node takes the slots for all of its children at once
+ * before filling any of them, so when the pool runs out the node simply stays a leaf and its
+ * bodies are summed up directly; no body is ever left out of the tree.
+ */
+void
+gravityNode(int node, double x, double y, double size, int start, int end, int depth){
+    GravityNode *g = &gravityNodes[node];
+    int split, quadrants = 0, bounds[5];
+    
+    g->x = x, g->y = y, g->size = size;
+    g->start = start, g->end = end;
+    g->child[0] = g->child[1] = g->child[2] = g->child[3] = -1;
+    g->isLeaf = (end - start <= GRAVITY_LEAF_SIZE || depth == 16);
+    
+    if(!g->isLeaf){
+        // The two bits of the key for this level say which quadrant a body is in.
+        int shift = 30 - 2*depth;
+        split = start;
+        for(int q = 0; q < 4; q++){
+            bounds[q] = split;
+            while(split < end && (int)((gravityKeys[split] >> shift) & 3) == q){
+                split++;
+            }
+            quadrants = quadrants + (split > bounds[q]);
+        }
+        bounds[4] = end;
+        if(gravityNodesUsed + quadrants > GRAVITY_MAX_NODES){
+            countEvent(COUNT_GRAVITY_OVERFLOW, 1);
+            g->isLeaf = 1;
+        }else{
+            for(int q = 0; q < 4; q++){
+                if(bounds[q+1] > bounds[q]){
+                    g->child[q] = gravityNodesUsed++;
+                }
+            }
+        }
+    }
+    
+    g->mass = 0.0, g->cx = 0.0, g->cy = 0.0;
+    if(g->isLeaf){
+        for(int i = start; i < end; i++){
+            g->mass = g->mass + gravityMass[i];
+            g->cx = g->cx + gravityMass[i]*gravityX[i];
+            g->cy = g->cy + gravityMass[i]*gravityY[i];
+        }
+        gravityLeaves[gravityLeafCount++] = node;
+    }else{
+        double half = size/2;
+        for(int q = 0; q < 4; q++){
+            int child = g->child[q];
+            if(child >= 0){
+                gravityNode(child, x + half*(q&1), y + half*(q>>1), half, bounds[q], bounds[q+1], depth + 1);
+                g->mass = g->mass + gravityNodes[child].mass;
+                g->cx = g->cx + gravityNodes[child].mass*gravityNodes[child].cx;
+                g->cy = g->cy + gravityNodes[child].mass*gravityNodes[child].cy;
+            }
+        }
+    }
+    if(g->mass > 0){
+        g->cx = g->cx/g->mass;
+        g->cy = g->cy/g->mass;
+    }
+}
+
+/* Finds the pull of the tree on a point that is not one of its bodies. A node that looks
+ * smaller than the opening angle from the point counts as one mass at its center of mass,
+ * anything bigger is opened up.
+ */
+void
+gravityAt(int root, double x, double y, double *ax, double *ay){
+    int stack[4*16 + 4];
+    int top = 0;
+    
+    *ax = 0.0;
+    *ay = 0.0;
+    stack[top++] = root;
+    while(top > 0){
+        GravityNode *g = &gravityNodes[stack[--top]];
+        double dx = g->cx - x;
+        double dy = g->cy - y;
+        double d2 = dx*dx + dy*dy;
+        
+        if(g->size*g->size < gravityTheta*gravityTheta*d2){
+            double r2 = d2 + GRAVITY_SOFTENING*GRAVITY_SOFTENING;
+            double f = GRAVITY_CONSTANT*g->mass/(r2*sqrt(r2));
+            *ax = *ax + f*dx;
+            *ay = *ay + f*dy;
+        }else if(g->isLeaf){
+            for(int i = g->start; i < g->end; i++){
+                double bx = gravityX[i] - x;
+                double by = gravityY[i] - y;
+                double r2 = bx*bx + by*by + GRAVITY_SOFTENING*GRAVITY_SOFTENING;
+                double f = GRAVITY_CONSTANT*gravityMass[i]/(r2*sqrt(r2));
+                *ax = *ax + f*bx;
+                *ay = *ay + f*by;
+            }
+        }else{
+            for(int q = 0; q < 4; q++){
+                if(g->child[q] >= 0){
+                    stack[top++] = g->child[q];
+                }
+            }
+        }
+    }
+}
+
+/* Finds the pull on every body of the tree, stored in the order the bodies were given in.
+ * The bodies of a leaf share one walk of the tree: any node far enough from the whole leaf
+ * goes on a list as a single mass, and the bodies of leaves that are too close go on it one
+ * by one. Each body of the leaf then adds up that list. The leaves don't share anything but
+ * the tree, so they are split across threads when built with OpenMP.
+ */
+void
+gravityAll(int root, double *ax, double *ay){
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 16)
+#endif
+    for(int l = 0; l < gravityLeafCount; l++){
+        GravityNode *leaf = &gravityNodes[gravityLeaves[l]];
+        GravityList list;
+        double sumX[GRAVITY_LEAF_SIZE], sumY[GRAVITY_LEAF_SIZE];
+        double centerX = leaf->x + leaf->size/2;
+        double centerY = leaf->y + leaf->size/2;
+        double reach = leaf->size*0.7072;
+        int stack[4*16 + 4];
+        
+        // A leaf at the bottom of the tree can hold more bodies than usual, walk it in pieces.
+        for(int first = leaf->start; first < leaf->end; first = first + GRAVITY_LEAF_SIZE){
+            int bodies = (leaf->end - first < GRAVITY_LEAF_SIZE) ? leaf->end - first : GRAVITY_LEAF_SIZE;
+            int top = 0;
+            
+            for(int b = 0; b < bodies; b++){
+                sumX[b] = 0.0;
+                sumY[b] = 0.0;
+            }
+            list.count = 0;
+            stack[top++] = root;
+            while(top > 0){
+                GravityNode *g = &gravityNodes[stack[--top]];
+                double dx = g->cx - centerX;
+                double dy = g->cy - centerY;
+                double d = sqrt(dx*dx + dy*dy) - reach;
+                int inside = centerX >= g->x && centerX <= g->x + g->size &&
+                             centerY >= g->y && centerY <= g->y + g->size;
+                
+                if(!inside && d > 0 && g->size < gravityTheta*d){
+                    if(list.count == GRAVITY_LIST_SIZE){
+                        gravityFlush(&list, first, bodies, sumX, sumY);
+                    }
+                    list.x[list.count] = g->cx;
+                    list.y[list.count] = g->cy;
+                    list.mass[list.count] = g->mass;
+                    list.count++;
+                }else if(g->isLeaf){
+                    // The leaf's own bodies are on here too, but pull on themselves with no force.
+                    for(int i = g->start; i < g->end; i++){
+                        if(list.count == GRAVITY_LIST_SIZE){
+                            gravityFlush(&list, first, bodies, sumX, sumY);
+                        }
+                        list.x[list.count] = gravityX[i];
+                        list.y[list.count] = gravityY[i];
+                        list.mass[list.count] = gravityMass[i];
+                        list.count++;
+                    }
+                }else{
+                    for(int q = 0; q < 4; q++){
+                        if(g->child[q] >= 0){
+                            stack[top++] = g->child[q];
+                        }
+                    }
+                }
+            }
+            gravityFlush(&list, first, bodies, sumX, sumY);
+            
+            for(int b = 0; b < bodies; b++){
+                ax[gravityOrder[first + b]] = GRAVITY_CONSTANT*sumX[b];
+                ay[gravityOrder[first + b]] = GRAVITY_CONSTANT*sumY[b];
+            }
+        }
+    }
+}
+
+/* Adds the pull of everything on the list to the sorted bodies from first on, and empties
+ * the list. Each body keeps its own sums, so the inner loop runs across the bodies and can
+ * be vectorized without changing the order anything is added in.
+ */
+void
+gravityFlush(GravityList *list, int first, int bodies, double *sumX, double *sumY){
+    const double *x = &gravityX[first];
+    const double *y = &gravityY[first];
+    
+    for(int k = 0; k < list->count; k++){
+        double lx = list->x[k], ly = list->y[k], mass = list->mass[k];
+        for(int b = 0; b < bodies; b++){
+            double dx = lx - x[b];
+            double dy = ly - y[b];
+            double r2 = dx*dx + dy*dy + GRAVITY_SOFTENING*GRAVITY_SOFTENING;
+            double f = mass/(r2*sqrt(r2));
+            sumX[b] = sumX[b] + f*dx;
+            sumY[b] = sumY[b] + f*dy;
+        }
+    }
+    list->count = 0;
+}
+
+// Draw the wells as glowing cores in the gravity wells mode.
+void
+drawWells(){
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    for(int w = 0; w < GRAVITY_WELLS; w++){
+        double x = view->xMax*(w + 1)/(GRAVITY_WELLS + 1);
+        double y = view->yMax/2;
+        
+        glColor3f(0.5, 0.2, 0.8);
+        glBegin(GL_POLYGON);
+            for(int i = 0; i < 16; i++){
+                glVertex2d(x + 2.0*cos(2.0*M_PI*i/16), y + 2.0*sin(2.0*M_PI*i/16));
+            }
+        glEnd();
+    }
+    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+}
+
+/* -- asteroid fracture ----------------------------------------------------- */
+
+/* Break an asteroid that was hit at (x, y) by a photon travelling along (dx, dy). The outline
+ * is cut in two along the photon's path and each side becomes a new asteroid of the next
+ * smaller size, centered on its own centroid. The pieces share the momentum of the asteroid
+ * and the photon between them and are pushed apart along the cut. Small asteroids and pieces
+ * too small to see just turn into dust.
+ */
+void
+fractureAsteroid(Asteroid *a, double x, double y, double dx, double dy){
+    AsteroidShape *shape = asteroidShape(a);
+    Asteroid parent = *a;
+    double childSize, c, s, lx, ly, nx, ny, len, d;
+    double mass[2], px, py, total;
+    Coords *pieces[2], centroid[2];
+    int counts[2];
+    
+    a->active = 0;
+    
+    // Reduce the size of the asteroid based on the size it is now.
+    if(shape->size == LARGE_SIZE){
+        childSize = MEDIUM_SIZE;
+    }else if(shape->size == MEDIUM_SIZE){
+        childSize = SMALL_SIZE;
+    }else{
+        return;
+    }
+    
+    // Move the impact point and the photon's direction into the frame of the shape.
+    c = cos(DEG2RAD*parent.phi);
+    s = sin(DEG2RAD*parent.phi);
+    lx = c*(x - parent.x) + s*(y - parent.y);
+    ly = -s*(x - parent.x) + c*(y - parent.y);
+    nx = -(-s*dx + c*dy);
+    ny = c*dx + s*dy;
+    len = sqrt(nx*nx + ny*ny);
+    if(len == 0){
+        nx = 1.0, ny = 0.0;
+    }else{
+        nx = nx/len, ny = ny/len;
+    }
+    
+    // The cut is the line through the impact point along the photon's path.
+    d = nx*lx + ny*ly;
+    for(int attempt = 0; attempt < 2; attempt++){
+        pieces[0] = fractureAlloc(2*shape->nVertices);
+        pieces[1] = fractureAlloc(2*shape->nVertices);
+        if(pieces[0] == NULL || pieces[1] == NULL){
+            return;
+        }
+        counts[0] = clipPolygon(shape->coords, shape->nVertices, nx, ny, d, pieces[0]);
+        counts[1] = clipPolygon(shape->coords, shape->nVertices, -nx, -ny, -d, pieces[1]);
+        mass[0] = polygonCentroid(pieces[0], counts[0], &centroid[0]);
+        mass[1] = polygonCentroid(pieces[1], counts[1], &centroid[1]);
+        
+        // A grazing hit only shaves off a sliver, so cut through the center instead.
+        if(mass[0] > 0.1*shape->area && mass[1] > 0.1*shape->area){
+            break;
+        }
+        d = 0.0;
+    }
+    
+    // Momentum of the asteroid and the photon that both pieces have to carry.
+    total = mass[0] + mass[1];
+    px = total*parent.dx + PHOTON_MASS*dx;
+    py = total*parent.dy + PHOTON_MASS*dy;
+    
+    for(int k = 0; k < 2; k++){
+        double sign = (k == 0) ? -1.0 : 1.0;
+        double wx, wy, push;
+        int slot;
+        
+        if(mass[k] < FRACTURE_MIN_AREA || counts[k] < 3){
+            continue;
+        }
+        slot = findInactiveAsteroid();
+        if(slot < 0){
+            return;
+        }
+        
+        // Recenter the piece on its centroid and keep it small enough for a shape.
+        for(int i = 0; i < counts[k]; i++){
+            pieces[k][i].x = pieces[k][i].x - centroid[k].x;
+            pieces[k][i].y = pieces[k][i].y - centroid[k].y;
+        }
+        counts[k] = simplifyPolygon(pieces[k], counts[k], MAX_VERTICES);
+        buildShape(&shapeLibrary[FRACTURE_SHAPE(slot)], childSize, counts[k], pieces[k]);
+        
+        // Each piece leaves the cut in opposite directions with the same total momentum.
+        wx = c*nx - s*ny;
+        wy = s*nx + c*ny;
+        push = sign*FRACTURE_SPEED*mass[1-k]/total;
+        
+        asteroids[slot].shape = FRACTURE_SHAPE(slot);
+        asteroids[slot].x = parent.x + c*centroid[k].x - s*centroid[k].y;
+        asteroids[slot].y = parent.y + s*centroid[k].x + c*centroid[k].y;
+        asteroids[slot].dx = px/total + push*wx;
+        asteroids[slot].dy = py/total + push*wy;
+        asteroids[slot].phi = parent.phi;
+        asteroids[slot].dphi = parent.dphi + myRandom(-0.4, 0.4);
+        asteroids[slot].active = 1;
+    }
+}
+
+/* Clip a polygon to the side of the line nx*x + ny*y = d that the normal points away from,
+ * keeping the points where nx*x + ny*y <= d. The output can hold up to twice the input.
+ */
+int
+clipPolygon(Coords *in, int n, double nx, double ny, double d, Coords *out){
+    int count = 0;
+    
+    for(int i = 0; i < n; i++){
+        Coords *a = &in[i];
+        Coords *b = &in[(i+1)%n];
+        double da = nx*a->x + ny*a->y - d;
+        double db = nx*b->x + ny*b->y - d;
+        
+        if(da <= 0){
+            out[count++] = *a;
+        }
+        if((da <= 0) != (db <= 0)){
+            double t = da/(da - db);
+            out[count].x = a->x + (b->x - a->x)*t;
+            out[count].y = a->y + (b->y - a->y)*t;
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Drop the vertices that add the least area to the outline until it fits in the given
+ * number of vertices. Vertices that are on top of each other are always removed.
+ */
+int
+simplifyPolygon(Coords *coords, int n, int maxVertices){
+    while(n > 3){
+        int smallest = -1;
+        double smallestArea = 0.0;
+        
+        for(int i = 0; i < n; i++){
+            Coords *prev = &coords[(i+n-1)%n];
+            Coords *next = &coords[(i+1)%n];
+            double area = fabs((coords[i].x - prev->x)*(next->y - prev->y) -
+                               (next->x - prev->x)*(coords[i].y - prev->y));
+            if(smallest < 0 || area < smallestArea){
+                smallest = i;
+                smallestArea = area;
+            }
+        }
+        if(n <= maxVertices && smallestArea > 1e-9){
+            break;
+        }
+        
+        memmove(&coords[smallest], &coords[smallest+1], (n - smallest - 1)*sizeof(Coords));
+        n = n - 1;
+    }
+    return n;
+}
+
+// Returns the area of a counter-clockwise polygon and stores its centroid.
+double
+polygonCentroid(Coords *coords, int n, Coords *centroid){
+    double area = 0.0, cx = 0.0, cy = 0.0;
+    
+    for(int i = 0; i < n; i++){
+        Coords *a = &coords[i];
+        Coords *b = &coords[(i+1)%n];
+        double cross = a->x*b->y - b->x*a->y;
+        area = area + cross;
+        cx = cx + (a->x + b->x)*cross;
+        cy = cy + (a->y + b->y)*cross;
+    }
+    area = 0.5*area;
+    
+    if(area > 0){
+        centroid->x = cx/(6.0*area);
+        centroid->y = cy/(6.0*area);
+    }else{
+        centroid->x = 0.0;
+        centroid->y = 0.0;
+        area = 0.0;
+    }
+    return area;
+}
+
+// Hands out vertices from the fracture arena, which is emptied at the start of every tick.
+Coords *
+fractureAlloc(int n){
+    Coords *coords;
+    
+    if(fractureArenaUsed + n > FRACTURE_ARENA_SIZE){
+        return NULL;
+    }
+    coords = &fractureArena[fractureArenaUsed];
+    fractureArenaUsed = fractureArenaUsed + n;
+    countEvent(COUNT_ALLOCATIONS, 1);
+    return coords;
+}
+
+/* -- entities -------------------------------------------------------------- */
+
+/* Finds the archetype with exactly these components, setting it up the first time. Its rows
+ * are as many as fit in a chunk with every column starting on a cache line.
+ */
+int
+findArchetype(unsigned int mask){
+    Archetype *arch;
+    int rowBytes = sizeof(Entity), columns = 1, offset;
+    
+    for(int a = 0; a < nArchetypes; a++){
+        if(archetypes[a].mask == mask){
+            return a;
+        }
+    }
+    if(nArchetypes == ECS_ARCHETYPES){
+        return -1;
+    }
+    arch = &archetypes[nArchetypes];
+    memset(arch, 0, sizeof(Archetype));
+    arch->mask = mask;
+    for(int c = 0; c < COMPONENTS; c++){
+        if((mask & HAS(c)) && componentSize[c] > 0){
+            rowBytes = rowBytes + componentSize[c];
+            columns++;
+        }
+    }
+    arch->rows = (ECS_CHUNK_BYTES - columns*ECS_ALIGN)/rowBytes;
+    
+    // The entity handles come first, then one column for each component with any data.
+    offset = ECS_ALIGN_UP(arch->rows*(int)sizeof(Entity));
+    for(int c = 0; c < COMPONENTS; c++){
+        arch->offset[c] = -1;
+        if((mask & HAS(c)) && componentSize[c] > 0){
+            arch->offset[c] = offset;
+            offset = ECS_ALIGN_UP(offset + arch->rows*componentSize[c]);
+        }
+    }
+    
+    arch->limit = ECS_ENTITIES;
+    for(int l = 0; l < (int)(sizeof(archetypeLimits)/sizeof(archetypeLimits[0])); l++){
+        if(archetypeLimits[l][0] == mask){
+            arch->limit = archetypeLimits[l][1];
+        }
+    }
+    return nArchetypes++;
+}
+
+/* Adds an entity with these components at the end of its archetype and clears them. Returns
+ * NO_ENTITY when there are already as many of its kind as there can be.
+ */
+Entity
+spawnEntity(unsigned int mask){
+    int a = findArchetype(mask), index, chunk;
+    Archetype *arch;
+    EntityRecord *record;
+    unsigned char *data;
+    
+    if(a < 0){
+        return NO_ENTITY;
+    }
+    arch = &archetypes[a];
+    if(arch->count == arch->limit || (nFreeEntities == 0 && entitiesUsed == ECS_ENTITIES)){
+        return NO_ENTITY;
+    }
+    if(arch->count == arch->nChunks*arch->rows){
+        if(nFreeChunks > 0){
+            chunk = freeChunks[--nFreeChunks];
+        }else if(chunksUsed < ECS_CHUNKS){
+            chunk = chunksUsed++;
+        }else{
+            return NO_ENTITY;
+        }
+        arch->chunks[arch->nChunks++] = chunk;
+    }
+    index = (nFreeEntities > 0) ? freeEntities[--nFreeEntities] : entitiesUsed++;
+    countEvent(COUNT_ALLOCATIONS, 1);
+    
+    record = &entityTable[index];
+    record->archetype = a;
+    record->chunk = arch->count/arch->rows;
+    record->row = arch->count%arch->rows;
+    arch->count++;
+    
+    data = chunkPool[arch->chunks[record->chunk]].data;
+    ((Entity *)data)[record->row] = ENTITY_HANDLE(index, record->generation);
+    for(int c = 0; c < COMPONENTS; c++){
+        if(arch->offset[c] >= 0){
+            memset(data + arch->offset[c] + record->row*componentSize[c], 0, componentSize[c]);
+        }
+    }
+    return ENTITY_HANDLE(index, record->generation);
+}
+
+/* Removes an entity by moving the last one of its archetype into its row, so the chunks stay
+ * packed. A handle of an entity that is already gone is ignored.
+ */
+void
+destroyEntity(Entity e){
+    EntityRecord *record, *moved;
+    Archetype *arch;
+    unsigned char *to, *from;
+    int last, lastChunk, lastRow;
+    
+    if(!entityAlive(e)){
+        return;
+    }
+    record = &entityTable[ENTITY_INDEX(e)];
+    arch = &archetypes[record->archetype];
+    last = arch->count - 1;
+    lastChunk = last/arch->rows, lastRow = last%arch->rows;
+    
+    if(record->chunk != lastChunk || record->row != lastRow){
+        to = chunkPool[arch->chunks[record->chunk]].data;
+        from = chunkPool[arch->chunks[lastChunk]].data;
+        ((Entity *)to)[record->row] = ((Entity *)from)[lastRow];
+        for(int c = 0; c < COMPONENTS; c++){
+            if(arch->offset[c] >= 0){
+                memcpy(to + arch->offset[c] + record->row*componentSize[c],
+                       from + arch->offset[c] + lastRow*componentSize[c], componentSize[c]);
+            }
+        }
+        moved = &entityTable[ENTITY_INDEX(((Entity *)to)[record->row])];
+        moved->chunk = record->chunk, moved->row = record->row;
+    }
+    
+    arch->count = last;
+    if(arch->count == (arch->nChunks - 1)*arch->rows){
+        freeChunks[nFreeChunks++] = arch->chunks[--arch->nChunks];
+    }
+    record->generation = (record->generation + 1) & ENTITY_GENERATION_MASK;
+    freeEntities[nFreeEntities++] = ENTITY_INDEX(e);
+}
+
+// Removes every entity that has all of these components.
+void
+clearEntities(unsigned int need){
+    for(int a = 0; a < nArchetypes; a++){
+        Archetype *arch = &archetypes[a];
+        if((arch->mask & need) != need){
+            continue;
+        }
+        for(int i = 0; i < arch->count; i++){
+            Entity e = ((Entity *)chunkPool[arch->chunks[i/arch->rows]].data)[i%arch->rows];
+            EntityRecord *record = &entityTable[ENTITY_INDEX(e)];
+            record->generation = (record->generation + 1) & ENTITY_GENERATION_MASK;
+            freeEntities[nFreeEntities++] = ENTITY_INDEX(e);
+        }
+        while(arch->nChunks > 0){
+            freeChunks[nFreeChunks++] = arch->chunks[--arch->nChunks];
+        }
+        arch->count = 0;
+    }
+}
+
+// Counts the entities that have all of these components.
+int
+countEntities(unsigned int need){
+    int count = 0;
+    
+    for(int a = 0; a < nArchetypes; a++){
+        if((archetypes[a].mask & need) == need){
+            count = count + archetypes[a].count;
+        }
+    }
+    return count;
+}
+
+int
+entityAlive(Entity e){
+    return ENTITY_INDEX(e) < entitiesUsed &&
+           entityTable[ENTITY_INDEX(e)].generation == ENTITY_GENERATION(e);
+}
+
+// Finds one component of a live entity, NULL if it doesn't have it.
+void *
+entityComponent(Entity e, int component){
+    EntityRecord *record = &entityTable[ENTITY_INDEX(e)];
+    Archetype *arch = &archetypes[record->archetype];
+    
+    if(arch->offset[component] < 0){
+        return NULL;
+    }
+    return chunkPool[arch->chunks[record->chunk]].data + arch->offset[component] +
+           record->row*componentSize[component];
+}
+
+/* Lists every chunk holding entities with all of these components. Systems walk the columns
+ * of these directly and never look entities up one by one.
+ */
+int
+queryChunks(unsigned int need, ChunkView *views){
+    int n = 0;
+    
+    for(int a = 0; a < nArchetypes; a++){
+        Archetype *arch = &archetypes[a];
+        if((arch->mask & need) != need){
+            continue;
+        }
+        for(int c = 0; c < arch->nChunks; c++){
+            int left = arch->count - c*arch->rows;
+            views[n].archetype = arch;
+            views[n].data = chunkPool[arch->chunks[c]].data;
+            views[n].count = (left < arch->rows) ? left : arch->rows;
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Spawning and removing entities, and breaking asteroids, is only ever queued up while the
+ * systems run. Nothing moves underneath a loop that way, and the queue is applied in order
+ * once the loops are done, so the random numbers are drawn just as if it had happened
+ * right away.
+ */
+void
+queueCommand(int type, Entity e, unsigned int mask, int slot, double x, double y, double dx, double dy){
+    Command *command;
+    
+    // A full queue loses the command, which is counted and reported the first time it happens.
+    if(nCommands == ECS_COMMANDS){
+        if(counters->value[COUNT_COMMANDS_DROPPED] == 0){
+            fprintf(stderr, "entities: the command queue of %d is full, commands are being dropped\n", ECS_COMMANDS);
+        }
+        countEvent(COUNT_COMMANDS_DROPPED, 1);
+        return;
+    }
+    command = &commands[nCommands++];
+    command->type = type, command->entity = e, command->mask = mask, command->slot = slot;
+    command->x = x, command->y = y, command->dx = dx, command->dy = dy;
+}
+
+// Whether a break of this asteroid slot is already waiting in the queue.
+int
+fracturePending(int slot){
+    for(int i = 0; i < nCommands; i++){
+        if(commands[i].type == COMMAND_FRACTURE && commands[i].slot == slot){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void
+flushCommands(){
+    for(int i = 0; i < nCommands; i++){
+        Command *command = &commands[i];
+        if(command->type == COMMAND_SPAWN){
+            Entity e = spawnEntity(command->mask);
+            if(e != NO_ENTITY){
+                initEntity(e, command->x, command->y, command->dx, command->dy);
+            }
+        }else if(command->type == COMMAND_DESTROY){
+            destroyEntity(command->entity);
+        }else if(asteroids[command->slot].active == 1){
+            fractureAsteroid(&asteroids[command->slot], command->x, command->y, command->dx, command->dy);
+            playSound(SOUND_BREAK);
+        }
+    }
+    nCommands = 0;
+}
+
+// Fills in a new photon or dust cloud, whichever components it has.
+void
+initEntity(Entity e, double x, double y, double dx, double dy){
+    Position *position = entityComponent(e, COMP_POSITION);
+    Velocity *velocity = entityComponent(e, COMP_VELOCITY);
+    Cloud *cloud = entityComponent(e, COMP_CLOUD);
+    int *lifetime = entityComponent(e, COMP_LIFETIME), *flicker = entityComponent(e, COMP_FLICKER);
+    
+    if(position != NULL){
+        position->x = x, position->y = y;
+    }
+    if(velocity != NULL){
+        velocity->dx = dx, velocity->dy = dy;
+    }
+    if(cloud != NULL){
+        for(int j = 0; j < DUST_PARTICLES; j++){
+            cloud->coords[j].x = myRandom(x-7.5, x+7.5);
+            cloud->coords[j].y = myRandom(y-7.5, y+7.5);
+        }
+    }
+    if(lifetime != NULL){
+        *lifetime = DUST_TICKS;
+    }
+    if(flicker != NULL){
+        *flicker = 1;
+    }
+}
+
+// Everything with a velocity moves along it.
+void
+movementSystem(){
+    ChunkView views[ECS_CHUNKS];
+    int n = queryChunks(HAS(COMP_POSITION) | HAS(COMP_VELOCITY), views);
+    
+    for(int c = 0; c < n; c++){
+        Position *position = chunkColumn(&views[c], Position, COMP_POSITION);
+        Velocity *velocity = chunkColumn(&views[c], Velocity, COMP_VELOCITY);
+        for(int i = 0; i < views[c].count; i++){
+            position[i].x = position[i].x + velocity[i].dx;
+            position[i].y = position[i].y + velocity[i].dy;
+        }
+    }
+}
+
+/* Bounded entities, the photons, are gone once they leave the screen. Wrapped ones come back
+ * on the far side of the playfield like the asteroids do. A photon is only dropped once the
+ * whole step it just took is off the screen, so the step that carried it over the edge is
+ * still tested against the asteroids, including the parts of them across the edge.
+ */
+void
+boundsSystem(){
+    ChunkView views[ECS_CHUNKS];
+    int n = queryChunks(HAS(COMP_POSITION), views);
+    
+    for(int c = 0; c < n; c++){
+        Position *position = chunkColumn(&views[c], Position, COMP_POSITION);
+        Entity *entity = (Entity *)views[c].data;
+        if(views[c].archetype->mask & HAS(COMP_BOUNDED)){
+            Velocity *velocity = chunkColumn(&views[c], Velocity, COMP_VELOCITY);
+            for(int i = 0; i < views[c].count; i++){
+                double x0 = position[i].x - velocity[i].dx, y0 = position[i].y - velocity[i].dy;
+                if(x0 > cameraX + xMax || x0 < cameraX || y0 < cameraY || y0 > cameraY + yMax){
+                    recordEvent(TELEMETRY_MISS, position[i].x, position[i].y);
+                    queueCommand(COMMAND_DESTROY, entity[i], 0, 0, 0, 0, 0, 0);
+                }
+            }
+        }else if(views[c].archetype->mask & HAS(COMP_WRAPPED)){
+            for(int i = 0; i < views[c].count; i++){
+                wrapPosition(&position[i].x, &position[i].y);
+            }
+        }
+    }
+}
+
+// Dust flickers every other tick until its time is up.
+void
+lifetimeSystem(){
+    ChunkView views[ECS_CHUNKS];
+    int n = queryChunks(HAS(COMP_LIFETIME), views);
+    
+    for(int c = 0; c < n; c++){
+        int *lifetime = chunkColumn(&views[c], int, COMP_LIFETIME);
+        Entity *entity = (Entity *)views[c].data;
+        for(int i = 0; i < views[c].count; i++){
+            lifetime[i] = lifetime[i] - 1;
+            if(lifetime[i] <= 0){
+                queueCommand(COMMAND_DESTROY, entity[i], 0, 0, 0, 0, 0, 0);
+            }
+        }
+        if(views[c].archetype->mask & HAS(COMP_FLICKER)){
+            int *flicker = chunkColumn(&views[c], int, COMP_FLICKER);
+            for(int i = 0; i < views[c].count; i++){
+                flicker[i] = !flicker[i];
+            }
+        }
+    }
+}
+
+/* Photons against the asteroid copies. A photon that hits is removed, leaves dust and breaks
+ * the asteroid, all of it queued, so the copies and their outlines stay as they were for the
+ * rest of the loop. Once an asteroid is due to break no other photon can hit it this tick.
+ */
+void
+collisionSystem(){
+    ChunkView views[ECS_CHUNKS];
+    int n = queryChunks(HAS(COMP_POSITION) | HAS(COMP_VELOCITY) | HAS(COMP_BREAKS), views);
+    
+    for(int c = 0; c < n; c++){
+        Position *position = chunkColumn(&views[c], Position, COMP_POSITION);
+        Velocity *velocity = chunkColumn(&views[c], Velocity, COMP_VELOCITY);
+        Entity *entity = (Entity *)views[c].data;
+        for(int i = 0; i < views[c].count; i++){
+            for(int j = 0; j < nAsteroidInstances; j++){
+                AsteroidInstance *inst = &asteroidInstances[j];
+                Asteroid *a = &asteroids[inst->index];
+                Coords hit;
+                if(a->active == 1 && !fracturePending(inst->index) &&
+                   PhotonCollision(&position[i], &velocity[i], &inst->body, &hit)){
+                    double size = asteroidShape(&inst->body)->size;
+                    score = score + ((size >= LARGE_SIZE) ? SCORE_LARGE : (size >= MEDIUM_SIZE) ? SCORE_MEDIUM : SCORE_SMALL);
+                    recordEvent(TELEMETRY_HIT, hit.x, hit.y);
+                    queueCommand(COMMAND_SPAWN, NO_ENTITY, ARCH_DUST, 0, hit.x, hit.y, 0, 0);
+                    queueCommand(COMMAND_DESTROY, entity[i], 0, 0, 0, 0, 0, 0);
+                    // Break the asteroid along the photon's path.
+                    queueCommand(COMMAND_FRACTURE, NO_ENTITY, 0, inst->index,
+                                 hit.x - inst->body.x + a->x, hit.y - inst->body.y + a->y,
+                                 velocity[i].dx, velocity[i].dy);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Copies the photons and the dust that shows this tick into the frame for drawing.
+void
+renderSystem(FrameState *f){
+    ChunkView views[ECS_CHUNKS];
+    int n;
+    
+    f->nPhotons = 0;
+    n = queryChunks(HAS(COMP_POSITION) | HAS(COMP_BOUNDED), views);
+    for(int c = 0; c < n; c++){
+        Position *position = chunkColumn(&views[c], Position, COMP_POSITION);
+        for(int i = 0; i < views[c].count && f->nPhotons < MAX_PHOTONS; i++){
+            f->photons[f->nPhotons++] = position[i];
+        }
+    }
+    
+    f->nDust = 0;
+    n = queryChunks(HAS(COMP_CLOUD) | HAS(COMP_FLICKER), views);
+    for(int c = 0; c < n; c++){
+        Cloud *cloud = chunkColumn(&views[c], Cloud, COMP_CLOUD);
+        int *flicker = chunkColumn(&views[c], int, COMP_FLICKER);
+        for(int i = 0; i < views[c].count && f->nDust < MAX_DUST; i++){
+            if(flicker[i]){
+                f->dust[f->nDust++] = cloud[i];
+            }
+        }
+    }
+    
+    f->nEnemies = 0;
+    n = queryChunks(HAS(COMP_POSITION) | HAS(COMP_HEADING), views);
+    for(int c = 0; c < n; c++){
+        Position *position = chunkColumn(&views[c], Position, COMP_POSITION);
+        Heading *heading = chunkColumn(&views[c], Heading, COMP_HEADING);
+        for(int i = 0; i < views[c].count && f->nEnemies < MAX_ENEMIES; i++){
+            EnemyFrame *e = &f->enemies[f->nEnemies++];
+            e->x = (float)position[i].x, e->y = (float)position[i].y;
+            e->hx = (float)heading[i].hx, e->hy = (float)heading[i].hy;
+        }
+    }
+}
+
+/* -- swarm ----------------------------------------------------------------- */
+
+/* Fills the playfield with the enemy ships of a level in the swarm mode, anywhere far enough
+ * from the player's ship, standing still and facing every which way.
+ */
+void
+spawnSwarm(int n){
+    clearEntities(ARCH_ENEMY);
+    addEnemies(n);
+}
+
+// Adds enemy ships to the swarm the same way a level starts them.
+void
+addEnemies(int n){
+    for(int i = 0; i < n; i++){
+        Entity e = spawnEntity(ARCH_ENEMY);
+        Position *position;
+        Heading *heading;
+        double angle;
+        if(e == NO_ENTITY){
+            break;
+        }
+        position = entityComponent(e, COMP_POSITION);
+        heading = entityComponent(e, COMP_HEADING);
+        do{
+            position->x = (Scalar)myRandom(0.0, xMax);
+            position->y = (Scalar)myRandom(0.0, yMax);
+        }while(hypot(spatialWrapDelta(position->x - ship.x, xMax), spatialWrapDelta(position->y - ship.y, yMax)) <
+               SWARM_SAFE_DISTANCE);
+        angle = myRandom(0.0, 2.0*M_PI);
+        heading->hx = (Scalar)cos(angle), heading->hy = (Scalar)sin(angle);
+    }
+}
+
+/* Runs the swarm for one tick: sorts the ships into the grid, steers each of them and then
+ * sees what they ran into. Steering only reads the grid and writes the ship's own row, so
+ * with OpenMP the chunks are shared out between the threads.
+ */
+void
+swarmSystem(){
+    ChunkView views[ECS_CHUNKS];
+    int n = queryChunks(ARCH_ENEMY, views);
+    double turnCos = cos(DEG2RAD*ENEMY_TURN), turnSin = sin(DEG2RAD*ENEMY_TURN);
+    
+    buildSwarmGrid(views, n);
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for(int c = 0; c < n; c++){
+        Position *position = chunkColumn(&views[c], Position, COMP_POSITION);
+        Velocity *velocity = chunkColumn(&views[c], Velocity, COMP_VELOCITY);
+        Velocity *desire = chunkColumn(&views[c], Velocity, COMP_DESIRE);
+        Heading *heading = chunkColumn(&views[c], Heading, COMP_HEADING);
+    
+        for(int i = 0; i < views[c].count; i++){
+            steerEnemy(&position[i], &velocity[i], &desire[i]);
+        }
+        steerShips(velocity, heading, desire, views[c].count, ENEMY_THRUST, ENEMY_VELOCITY_MAX, turnCos, turnSin);
+    }
+    swarmCollisions();
+}
+
+/* Sorts the ships into a grid over the playfield by counting how many fall in each cell,
+ * then copying their positions and velocities out in cell order. The neighbours of a ship
+ * are then a few runs of these arrays instead of rows scattered over the chunks. The
+ * asteroids go into the same grid, each in every cell it comes close to.
+ */
+void
+buildSwarmGrid(ChunkView *views, int n){
+    static int cellOf[MAX_ENEMIES];
+    int k = 0, entries = 0;
+    
+    swarmColumns = (int)fmin(SWARM_GRID, fmax(3.0, floor(xMax/SWARM_RADIUS)));
+    swarmRows = (int)fmin(SWARM_GRID, fmax(3.0, floor(yMax/SWARM_RADIUS)));
+    swarmCellW = xMax/swarmColumns, swarmCellH = yMax/swarmRows;
+    
+    memset(swarmCellStart, 0, sizeof(swarmCellStart));
+    for(int c = 0; c < n; c++){
+        Position *position = chunkColumn(&views[c], Position, COMP_POSITION);
+        for(int i = 0; i < views[c].count; i++, k++){
+            cellOf[k] = swarmCell(position[i].x, position[i].y);
+            swarmCellStart[cellOf[k] + 1] = swarmCellStart[cellOf[k] + 1] + 1;
+        }
+    }
+    for(int cell = 0; cell < swarmColumns*swarmRows; cell++){
+        swarmCellStart[cell + 1] = swarmCellStart[cell + 1] + swarmCellStart[cell];
+    }
+    k = 0;
+    for(int c = 0; c < n; c++){
+        Position *position = chunkColumn(&views[c], Position, COMP_POSITION);
+        Velocity *velocity = chunkColumn(&views[c], Velocity, COMP_VELOCITY);
+        Entity *entity = (Entity *)views[c].data;
+        for(int i = 0; i < views[c].count; i++, k++){
+            int at = swarmCellStart[cellOf[k]]++;
+            swarmX[at] = position[i].x, swarmY[at] = position[i].y;
+            swarmDX[at] = velocity[i].dx, swarmDY[at] = velocity[i].dy;
+            swarmEntity[at] = entity[i];
+        }
+    }
+    // Placing them moved every start along to the next cell's, so shift them back.
+    for(int cell = swarmColumns*swarmRows; cell > 0; cell--){
+        swarmCellStart[cell] = swarmCellStart[cell - 1];
+    }
+    swarmCellStart[0] = 0;
+    
+    // The asteroid copies already cover the edges, so their cells don't wrap.
+    // Both passes stop at the same entry when there are too many, so they stay in step.
+    memset(swarmRockStart, 0, sizeof(swarmRockStart));
+    for(int pass = 0; pass < 2; pass++){
+        entries = 0;
+        for(int j = 0; j < nAsteroidInstances; j++){
+            Asteroid *a = &asteroidInstances[j].body;
+            double reach = asteroidShape(a)->radius + SWARM_AVOID;
+            int x0 = (int)fmax(0, floor((a->x - reach)/swarmCellW)), x1 = (int)fmin(swarmColumns - 1, floor((a->x + reach)/swarmCellW));
+            int y0 = (int)fmax(0, floor((a->y - reach)/swarmCellH)), y1 = (int)fmin(swarmRows - 1, floor((a->y + reach)/swarmCellH));
+            for(int cy = y0; cy <= y1; cy++){
+                for(int cx = x0; cx <= x1 && entries < SWARM_ROCK_ENTRIES; cx++, entries++){
+                    int cell = cy*swarmColumns + cx;
+                    if(pass == 0){
+                        swarmRockStart[cell + 1] = swarmRockStart[cell + 1] + 1;
+                    }else{
+                        swarmRocks[swarmRockStart[cell]++] = j;
+                    }
+                }
+            }
+        }
+        if(pass == 0){
+            for(int cell = 0; cell < swarmColumns*swarmRows; cell++){
+                swarmRockStart[cell + 1] = swarmRockStart[cell + 1] + swarmRockStart[cell];
+            }
+        }else{
+            for(int cell = swarmColumns*swarmRows; cell > 0; cell--){
+                swarmRockStart[cell] = swarmRockStart[cell - 1];
+            }
+            swarmRockStart[0] = 0;
+        }
+    }
+}
+
+int
+swarmCell(double x, double y){
+    int cx = (int)(x/swarmCellW), cy = (int)(y/swarmCellH);
+    
+    cx = (cx < 0) ? 0 : ((cx >= swarmColumns) ? swarmColumns - 1 : cx);
+    cy = (cy < 0) ? 0 : ((cy >= swarmRows) ? swarmRows - 1 : cy);
+    return cy*swarmColumns + cx;
+}
+
+/* Works out where one ship wants to go. It heads for where the player is about to be,
+ * keeps off the ships right next to it, flies the way those around it fly and towards the
+ * middle of them, and turns away from any asteroid it is getting close to.
+ */
+void
+steerEnemy(Position *p, Velocity *v, Velocity *desire){
+    int cell = swarmCell(p->x, p->y), cx = cell%swarmColumns, cy = cell/swarmColumns, count = 0;
+    double sepX = 0.0, sepY = 0.0, aliX = 0.0, aliY = 0.0, cohX = 0.0, cohY = 0.0;
+    double toX = spatialWrapDelta(ship.x + ENEMY_LEAD*ship.dx - p->x, xMax);
+    double toY = spatialWrapDelta(ship.y + ENEMY_LEAD*ship.dy - p->y, yMax);
+    double to = hypot(toX, toY) + 1e-9, wantX, wantY;
+    
+    for(int oy = -1; oy <= 1; oy++){
+        int row = (cy + oy + swarmRows)%swarmRows;
+        for(int ox = -1; ox <= 1; ox++){
+            int other = row*swarmColumns + (cx + ox + swarmColumns)%swarmColumns;
+            for(int j = swarmCellStart[other]; j < swarmCellStart[other + 1]; j++){
+                double dx = swarmX[j] - p->x, dy = swarmY[j] - p->y, d2;
+                dx = (dx > xMax/2) ? dx - xMax : ((dx < -xMax/2) ? dx + xMax : dx);
+                dy = (dy > yMax/2) ? dy - yMax : ((dy < -yMax/2) ? dy + yMax : dy);
+                d2 = dx*dx + dy*dy;
+                if(d2 < SWARM_RADIUS*SWARM_RADIUS && d2 > 1e-6){
+                    sepX = sepX - dx/d2, sepY = sepY - dy/d2;
+                    aliX = aliX + swarmDX[j], aliY = aliY + swarmDY[j];
+                    cohX = cohX + dx, cohY = cohY + dy;
+                    count = count + 1;
+                }
+            }
+        }
+    }
+    
+    wantX = SWARM_PURSUE*toX/to + SWARM_SEPARATE*sepX;
+    wantY = SWARM_PURSUE*toY/to + SWARM_SEPARATE*sepY;
+    if(count > 0){
+        wantX = wantX + SWARM_ALIGN*(aliX/count - v->dx) + SWARM_COHERE*cohX/(count*SWARM_RADIUS);
+        wantY = wantY + SWARM_ALIGN*(aliY/count - v->dy) + SWARM_COHERE*cohY/(count*SWARM_RADIUS);
+    }
+    for(int j = swarmRockStart[cell]; j < swarmRockStart[cell + 1]; j++){
+        Asteroid *a = &asteroidInstances[swarmRocks[j]].body;
+        double dx = p->x - a->x, dy = p->y - a->y, d = hypot(dx, dy) + 1e-9;
+        double reach = asteroidShape(a)->radius + SWARM_AVOID;
+        if(d < reach){
+            wantX = wantX + SWARM_AVOIDANCE*(reach - d)/SWARM_AVOID*dx/d;
+            wantY = wantY + SWARM_AVOIDANCE*(reach - d)/SWARM_AVOID*dy/d;
+        }
+    }
+    desire->dx = (Scalar)wantX, desire->dy = (Scalar)wantY;
+}
+
+/* The ship physics of updateVelocity for a whole run of ships at once. Each turns towards
+ * where it wants to go by at most the turn a player gets in a tick, thrusts when that is
+ * roughly ahead of it, and is held to the top speed. Turning is a rotation by the cosine and
+ * sine of that turn rather than an angle, and nothing in the loop branches, so the compiler
+ * turns it into vector code (given -fno-math-errno -fno-trapping-math, which let it take the
+ * square roots and the comparisons a lane at a time).
+ */
+void
+steerShips(Velocity *velocity, Heading *heading, const Velocity *desire, int n, double thrust, double maxSpeed,
+           double turnCos, double turnSin){
+#pragma GCC ivdep
+    for(int i = 0; i < n; i++){
+        double hx = heading[i].hx, hy = heading[i].hy, sx = desire[i].dx, sy = desire[i].dy;
+        double length = sqrt(sx*sx + sy*sy) + 1e-9, inverse = 1.0/length;
+        double dot = hx*sx + hy*sy, side = (hx*sy - hy*sx >= 0) ? turnSin : -turnSin;
+        int close = dot >= turnCos*length;
+        double nx = close ? sx*inverse : hx*turnCos - hy*side;
+        double ny = close ? sy*inverse : hx*side + hy*turnCos;
+        double push = (dot > ENEMY_THRUST_COS*length) ? thrust : 0.0;
+        double dx = velocity[i].dx + push*nx, dy = velocity[i].dy + push*ny;
+        double scale = maxSpeed/sqrt(dx*dx + dy*dy + 1e-12);
+    
+        scale = (scale < 1.0) ? scale : 1.0;
+        heading[i].hx = (Scalar)nx, heading[i].hy = (Scalar)ny;
+        velocity[i].dx = (Scalar)(dx*scale), velocity[i].dy = (Scalar)(dy*scale);
+    }
+}
+
+/* What the swarm ran into this tick, found by looking up the few cells around each of the
+ * things a ship can hit rather than testing every ship. A ship that hits the player costs a
+ * life, one hit by a photon takes the photon with it, and one that flies into an asteroid is
+ * lost. A ship is only marked as lost while the grid is looked through, however many things
+ * it hit, and the lost ones are removed once it is done, so thousands of them going at once
+ * never crowd the photons' commands out of the queue.
+ */
+void
+swarmCollisions(){
+    ChunkView views[ECS_CHUNKS];
+    int n, hit, ships = swarmCellStart[swarmColumns*swarmRows];
+    
+    memset(swarmLost, 0, ships);
+    if(shipExplosion.active == 0 && gameState > 0){
+        hit = nearestEnemy(ship.x, ship.y, ship.x, ship.y, SHIP_RADIUS + ENEMY_RADIUS);
+        if(hit >= 0){
+            recordEvent(TELEMETRY_DEATH, ship.x, ship.y);
+            swarmLost[hit] = 1;
+            activateExplosion(0, 0);
+            lives = lives - 1;
+        }
+    }
+    
+    n = queryChunks(ARCH_PHOTON, views);
+    for(int c = 0; c < n; c++){
+        Position *position = chunkColumn(&views[c], Position, COMP_POSITION);
+        Velocity *velocity = chunkColumn(&views[c], Velocity, COMP_VELOCITY);
+        Entity *entity = (Entity *)views[c].data;
+        for(int i = 0; i < views[c].count; i++){
+            hit = nearestEnemy(position[i].x - velocity[i].dx, position[i].y - velocity[i].dy,
+                               position[i].x, position[i].y, ENEMY_RADIUS);
+            if(hit >= 0){
+                swarmLost[hit] = 1;
+                queueCommand(COMMAND_DESTROY, entity[i], 0, 0, 0, 0, 0, 0);
+                queueCommand(COMMAND_SPAWN, NO_ENTITY, ARCH_DUST, 0, swarmX[hit], swarmY[hit], 0, 0);
+                score = score + SCORE_ENEMY;
+            }
+        }
+    }
+    
+    for(int j = 0; j < nAsteroidInstances; j++){
+        Asteroid *a = &asteroidInstances[j].body;
+        double reach = ENEMY_CRASH*asteroidShape(a)->radius;
+        int x0 = (int)floor((a->x - reach)/swarmCellW), x1 = (int)floor((a->x + reach)/swarmCellW);
+        int y0 = (int)floor((a->y - reach)/swarmCellH), y1 = (int)floor((a->y + reach)/swarmCellH);
+        for(int cy = (y0 < 0) ? 0 : y0; cy <= y1 && cy < swarmRows; cy++){
+            for(int cx = (x0 < 0) ? 0 : x0; cx <= x1 && cx < swarmColumns; cx++){
+                int cell = cy*swarmColumns + cx;
+                for(int k = swarmCellStart[cell]; k < swarmCellStart[cell + 1]; k++){
+                    if(hypot(swarmX[k] - a->x, swarmY[k] - a->y) < reach){
+                        swarmLost[k] = 1;
+                    }
+                }
+            }
+        }
+    }
+    
+    for(int k = 0; k < ships; k++){
+        if(swarmLost[k]){
+            destroyEntity(swarmEntity[k]);
+        }
+    }
+}
+
+/* Draws every enemy ship of the frame as a small orange ship in one batch, each turned by
+ * its heading directly instead of a matrix of its own.
+ */
+void
+drawEnemies(){
+    glColor3f(1.0, 0.5, 0.0);
+    glBegin(GL_TRIANGLES);
+        for(int i = 0; i < view->nEnemies; i++){
+            EnemyFrame *e = &view->enemies[i];
+            glVertex2d(e->x + 2.0*e->hx, e->y + 2.0*e->hy);
+            glVertex2d(e->x - e->hx - e->hy, e->y - e->hy + e->hx);
+            glVertex2d(e->x - e->hx + e->hy, e->y - e->hy - e->hx);
+        }
+    glEnd();
+}
+
+/* Finds the ship that comes closest to a segment, if any comes within the given distance,
+ * and returns where it is in the grid, or -1. Ships already lost this tick are passed over.
+ * The ships wrap around the playfield, so near an edge the segment is also looked for on the
+ * far side of it, moved over by the size of the playfield.
+ */
+int
+nearestEnemy(double x0, double y0, double x1, double y1, double within){
+    double ex = x1 - x0, ey = y1 - y0, length2 = ex*ex + ey*ey, best = within*within;
+    int nearest = -1;
+    
+    for(int sy = -1; sy <= 1; sy++){
+        for(int sx = -1; sx <= 1; sx++){
+            double ox = x0 + sx*xMax, oy = y0 + sy*yMax;
+            double left = fmin(ox, ox + ex) - within, right = fmax(ox, ox + ex) + within;
+            double bottom = fmin(oy, oy + ey) - within, top = fmax(oy, oy + ey) + within;
+            int a, b;
+            if(right < 0 || left > xMax || top < 0 || bottom > yMax){
+                continue;
+            }
+            a = swarmCell(left, bottom), b = swarmCell(right, top);
+            for(int cy = a/swarmColumns; cy <= b/swarmColumns; cy++){
+                for(int cx = a%swarmColumns; cx <= b%swarmColumns; cx++){
+                    int cell = cy*swarmColumns + cx;
+                    for(int k = swarmCellStart[cell]; k < swarmCellStart[cell + 1]; k++){
+                        double t = (length2 > 0) ? ((swarmX[k] - ox)*ex + (swarmY[k] - oy)*ey)/length2 : 0.0;
+                        double dx, dy;
+                        t = (t < 0) ? 0 : ((t > 1) ? 1 : t);
+                        dx = ox + t*ex - swarmX[k], dy = oy + t*ey - swarmY[k];
+                        if(!swarmLost[k] && dx*dx + dy*dy < best){
+                            best = dx*dx + dy*dy;
+                            nearest = k;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return nearest;
+}
+
+/* -- boss asteroids -------------------------------------------------------- */
+
+/* Puts the boss asteroids of a level on the playfield, each with an outline of its own made
+ * up from the level's seed. They come in along the top, well away from the ship in the
+ * middle, and drift and turn slowly.
+ */
+void
+spawnBosses(Level *level){
+    for(int i = 0; i < MAX_BOSSES; i++){
+        Boss *b = &bosses[i];
+        unsigned int state = levelSeed ^ ((unsigned int)(level->number*MAX_BOSSES + i)*2246822519u);
+        double heading;
+    
+        b->active = i < level->nBosses;
+        if(!b->active){
+            continue;
+        }
+        makeBossShape(&b->shape, level->bossVertices[i], BOSS_RADIUS, &state);
+        b->startArea = b->shape.area;
+        b->x = (Scalar)(xMax*(i + 1)/(level->nBosses + 1));
+        b->y = (Scalar)(0.85*yMax);
+        heading = worldRange(&state, 0.0, 2.0*M_PI);
+        b->dx = (Scalar)(BOSS_SPEED*cos(heading));
+        b->dy = (Scalar)(BOSS_SPEED*sin(heading));
+        b->phi = (Scalar)worldRange(&state, 0.0, 360.0);
+        b->dphi = (Scalar)worldRange(&state, -BOSS_SPIN, BOSS_SPIN);
+    }
+}
+
+/* Makes up a boss outline of n vertices spread evenly around the center, at a radius made of
+ * a few waves of random phase with some roughness on top. The roughness is kept to less than
+ * the spacing of the vertices, so that a finer outline is smoother rather than a saw blade.
+ * The troughs between the waves make it concave, but every vertex keeps its own direction
+ * from the center, so the outline never crosses itself and can be filled as a fan from there.
+ */
+void
+makeBossShape(BossShape *shape, int n, double radius, unsigned int *state){
+    double phase[3], rough = fmin(0.02, 1.0/n);
+    
+    for(int k = 0; k < 3; k++){
+        phase[k] = worldRange(state, 0.0, 2.0*M_PI);
+    }
+    shape->nVertices = n;
+    for(int v = 0; v < n; v++){
+        double theta = 2.0*M_PI*v/n;
+        double r = radius*(0.8 + 0.15*sin(3*theta + phase[0]) + 0.08*sin(7*theta + phase[1]) +
+                           0.04*sin(17*theta + phase[2]) + worldRange(state, -rough, rough));
+        shape->coords[v].x = (Scalar)(-r*sin(theta));
+        shape->coords[v].y = (Scalar)(r*cos(theta));
+    }
+    buildBossTree(shape);
+}
+
+/* Works out the bounding radius and area of a boss outline and builds its edge tree. Each
+ * leaf gets the box of its run of edges and every node above it the box around its two
+ * children. Leaves past the end of the outline get a box with nothing in it, which every
+ * test rejects. Building is linear in the vertices and only happens when the outline changes.
+ */
+void
+buildBossTree(BossShape *shape){
+    int n = shape->nVertices, leaves = 1;
+    
+    while(leaves*BOSS_LEAF_EDGES < n){
+        leaves = 2*leaves;
+    }
+    shape->nLeaves = leaves;
+    shape->radius = 0.0;
+    shape->area = 0.0;
+    shape->version = shape->version + 1;
+    
+    for(int k = 0; k < leaves; k++){
+        int node = leaves + k;
+        shape->minX[node] = shape->minY[node] = (Scalar)HUGE_VAL;
+        shape->maxX[node] = shape->maxY[node] = (Scalar)-HUGE_VAL;
+        for(int i = k*BOSS_LEAF_EDGES; i < (k + 1)*BOSS_LEAF_EDGES && i < n; i++){
+            Coords *a = &shape->coords[i], *b = &shape->coords[(i + 1)%n];
+            shape->minX[node] = fmin(shape->minX[node], fmin(a->x, b->x));
+            shape->minY[node] = fmin(shape->minY[node], fmin(a->y, b->y));
+            shape->maxX[node] = fmax(shape->maxX[node], fmax(a->x, b->x));
+            shape->maxY[node] = fmax(shape->maxY[node], fmax(a->y, b->y));
+            shape->radius = fmax(shape->radius, sqrt(a->x*a->x + a->y*a->y));
+            shape->area = shape->area + 0.5*(a->x*b->y - b->x*a->y);
+        }
+    }
+    for(int node = leaves - 1; node >= 1; node--){
+        shape->minX[node] = fmin(shape->minX[2*node], shape->minX[2*node + 1]);
+        shape->minY[node] = fmin(shape->minY[2*node], shape->minY[2*node + 1]);
+        shape->maxX[node] = fmax(shape->maxX[2*node], shape->maxX[2*node + 1]);
+        shape->maxY[node] = fmax(shape->maxY[2*node], shape->maxY[2*node + 1]);
+    }
+}
+
+/* Checks if a point in shape coordinates lies inside a boss outline, by the same crossing
+ * count as pointInPolygon but only over the leaves whose boxes the ray in the positive x
+ * direction goes through. The ray only meets the few places where the outline crosses its
+ * line, so however many vertices there are, the count takes a handful of leaves and the
+ * paths down to them.
+ */
+int
+pointInBoss(BossShape *shape, double x, double y){
+    int stack[BOSS_STACK], top = 0, inside = 0, n = shape->nVertices;
+    
+    if(x*x + y*y > shape->radius*shape->radius){
+        return 0;
+    }
+    stack[top++] = 1;
+    while(top > 0){
+        int node = stack[--top];
+        if(shape->minY[node] > y || shape->maxY[node] < y || shape->maxX[node] < x){
+            continue;
+        }
+        if(node < shape->nLeaves){
+            stack[top++] = 2*node;
+            stack[top++] = 2*node + 1;
+            continue;
+        }
+        for(int i = (node - shape->nLeaves)*BOSS_LEAF_EDGES, k = 0; k < BOSS_LEAF_EDGES && i < n; i++, k++){
+            Coords *a = &shape->coords[i], *b = &shape->coords[(i + 1)%n];
+            if((a->y > y) != (b->y > y) && x < (b->x - a->x)*(y - a->y)/(b->y - a->y) + a->x){
+                inside = !inside;
+            }
+        }
+    }
+    return inside;
+}
+
+/* Returns the fraction along the line from (x0, y0) to (x1, y1) in shape coordinates where
+ * it first crosses a boss outline, or -1. A node is passed over when the line misses its box,
+ * or only gets to it past the first crossing found so far, so a photon's step only looks at
+ * the few leaves along its way.
+ */
+double
+segmentBoss(BossShape *shape, double x0, double y0, double x1, double y1){
+    double rx = x1 - x0, ry = y1 - y0, first = 2.0;
+    double lowX = fmin(x0, x1), highX = fmax(x0, x1), lowY = fmin(y0, y1), highY = fmax(y0, y1);
+    int stack[BOSS_STACK], top = 0, n = shape->nVertices;
+    
+    stack[top++] = 1;
+    while(top > 0){
+        int node = stack[--top];
+        double near = 0.0, far = fmin(first, 1.0);
+    
+        // The boxes overlapping first, which is all the slab test would say along an axis the
+        // line doesn't move in.
+        if(shape->minX[node] > highX || shape->maxX[node] < lowX ||
+           shape->minY[node] > highY || shape->maxY[node] < lowY){
+            continue;
+        }
+        if(rx != 0){
+            double t0 = (shape->minX[node] - x0)/rx, t1 = (shape->maxX[node] - x0)/rx;
+            near = fmax(near, fmin(t0, t1)), far = fmin(far, fmax(t0, t1));
+        }
+        if(ry != 0){
+            double t0 = (shape->minY[node] - y0)/ry, t1 = (shape->maxY[node] - y0)/ry;
+            near = fmax(near, fmin(t0, t1)), far = fmin(far, fmax(t0, t1));
+        }
+        if(near > far){
+            continue;
+        }
+        if(node < shape->nLeaves){
+            stack[top++] = 2*node;
+            stack[top++] = 2*node + 1;
+            continue;
+        }
+        for(int i = (node - shape->nLeaves)*BOSS_LEAF_EDGES, k = 0; k < BOSS_LEAF_EDGES && i < n; i++, k++){
+            Coords *a = &shape->coords[i], *b = &shape->coords[(i + 1)%n];
+            double sx = b->x - a->x, sy = b->y - a->y;
+            double denom = rx*sy - ry*sx;
+            double qx = a->x - x0, qy = a->y - y0;
+            double t, u;
+            if(denom == 0){
+                continue;
+            }
+            t = (qx*sy - qy*sx)/denom;
+            u = (qx*ry - qy*rx)/denom;
+            if(t >= 0 && t <= 1 && u >= 0 && u <= 1 && t < first){
+                first = t;
+            }
+        }
+    }
+    return (first <= 1) ? first : -1;
+}
+
+/* Finds where the line from (x0, y0) to (x1, y1) first touches a boss, the way
+ * segmentAsteroid does for an asteroid: the fraction along the line, 0 if it starts inside,
+ * or -1 if it misses. A boss is big enough to sit across an edge of the playfield much of
+ * the time, so the line is taken the short way round to it rather than testing copies.
+ */
+double
+segmentBossAsteroid(Boss *b, double x0, double y0, double x1, double y1){
+    BossShape *shape = &b->shape;
+    double c = cos(DEG2RAD*b->phi), s = sin(DEG2RAD*b->phi);
+    double ox = spatialWrapDelta(x0 - b->x, xMax), oy = spatialWrapDelta(y0 - b->y, yMax);
+    double ex = x1 - x0, ey = y1 - y0, len = ex*ex + ey*ey, t, closestX, closestY;
+    double lx0, ly0;
+    
+    // Reject on the closest point of the line to the center.
+    t = (len > 0) ? -(ox*ex + oy*ey)/len : 0.0;
+    t = (t < 0) ? 0.0 : ((t > 1) ? 1.0 : t);
+    closestX = ox + ex*t;
+    closestY = oy + ey*t;
+    if(closestX*closestX + closestY*closestY > shape->radius*shape->radius){
+        return -1;
+    }
+    
+    lx0 = c*ox + s*oy, ly0 = -s*ox + c*oy;
+    if(pointInBoss(shape, lx0, ly0)){
+        return 0.0;
+    }
+    return segmentBoss(shape, lx0, ly0, lx0 + c*ex + s*ey, ly0 - s*ex + c*ey);
+}
+
+/* Moves the bosses and finds out what hit them this tick. A photon that hits one is used up
+ * and blasts a crater where it went in, and the ship touching one is lost the same as on any
+ * other asteroid. The ship is only a triangle, so it touches a boss when one of its edges
+ * starts inside it or crosses its outline.
+ */
+void
+bossSystem(){
+    ChunkView views[ECS_CHUNKS];
+    Coords corners[SHIP_VERTICES];
+    int n = queryChunks(HAS(COMP_POSITION) | HAS(COMP_VELOCITY) | HAS(COMP_BREAKS), views);
+    
+    for(int j = 0; j < MAX_BOSSES; j++){
+        Boss *b = &bosses[j];
+        if(!b->active){
+            continue;
+        }
+        b->x = b->x + b->dx;
+        b->y = b->y + b->dy;
+        b->phi = b->phi + b->dphi;
+        wrapPosition(&b->x, &b->y);
+    
+        for(int c = 0; c < n && b->active; c++){
+            Position *position = chunkColumn(&views[c], Position, COMP_POSITION);
+            Velocity *velocity = chunkColumn(&views[c], Velocity, COMP_VELOCITY);
+            Entity *entity = (Entity *)views[c].data;
+            for(int i = 0; i < views[c].count && b->active; i++){
+                double x0 = position[i].x - velocity[i].dx + b->dx, y0 = position[i].y - velocity[i].dy + b->dy;
+                double t = segmentBossAsteroid(b, x0, y0, position[i].x, position[i].y);
+                countEvent(COUNT_PAIRS_TESTED, 1);
+                if(t >= 0){
+                    double x = x0 + (position[i].x - x0)*t, y = y0 + (position[i].y - y0)*t;
+                    countEvent(COUNT_PAIRS_HIT, 1);
+                    queueCommand(COMMAND_SPAWN, NO_ENTITY, ARCH_DUST, 0, x, y, 0, 0);
+                    queueCommand(COMMAND_DESTROY, entity[i], 0, 0, 0, 0, 0, 0);
+                    score = score + SCORE_CRATER;
+                    carveBoss(b, x, y);
+                }
+            }
+        }
+    
+        if(b->active && shipExplosion.active == 0){
+            shipVertices(&ship, corners);
+            for(int k = 0; k < SHIP_VERTICES; k++){
+                Coords *from = &corners[k], *to = &corners[(k + 1)%SHIP_VERTICES];
+                if(segmentBossAsteroid(b, from->x, from->y, to->x, to->y) >= 0){
+                    recordEvent(TELEMETRY_DEATH, ship.x, ship.y);
+                    activateExplosion(0, 0);
+                    lives = lives - 1;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/* Blasts a crater into a boss where a photon went in, given in world coordinates. Vertices
+ * within BOSS_CRATER of it are pulled in towards the center, the closer the further, but
+ * never past BOSS_CORE of the boss's size, so the outline keeps its fan and its tree only has
+ * to be built again. A boss breaks up once it has lost BOSS_SHATTER of its area, or when a
+ * photon gets in as far as its core.
+ */
+void
+carveBoss(Boss *b, double x, double y){
+    BossShape *shape = &b->shape;
+    double c = cos(DEG2RAD*b->phi), s = sin(DEG2RAD*b->phi);
+    double ox = spatialWrapDelta(x - b->x, xMax), oy = spatialWrapDelta(y - b->y, yMax);
+    double hx = c*ox + s*oy, hy = -s*ox + c*oy;
+    
+    for(int v = 0; v < shape->nVertices; v++){
+        Coords *p = &shape->coords[v];
+        double d = hypot(p->x - hx, p->y - hy), r = hypot(p->x, p->y), depth;
+        if(d >= BOSS_CRATER || r == 0){
+            continue;
+        }
+        depth = fmin(BOSS_CRATER - d, r - BOSS_CORE*BOSS_RADIUS);
+        if(depth > 0){
+            p->x = (Scalar)(p->x*(r - depth)/r);
+            p->y = (Scalar)(p->y*(r - depth)/r);
+        }
+    }
+    buildBossTree(shape);
+    playSound(SOUND_BREAK);
+    if(shape->area < (1.0 - BOSS_SHATTER)*b->startArea || hypot(hx, hy) < BOSS_CORE*BOSS_RADIUS + 0.5){
+        shatterBoss(b);
+    }
+}
+
+// Breaks a boss up into large asteroids flying out from where it was, as many as there is room for.
+void
+shatterBoss(Boss *b){
+    for(int k = 0; k < BOSS_PIECES; k++){
+        int slot = findInactiveAsteroid();
+        double angle = 2.0*M_PI*k/BOSS_PIECES;
+        Asteroid *a;
+        if(slot < 0){
+            break;
+        }
+        a = &asteroids[slot];
+        initAsteroid(a, b->x + 0.5*BOSS_RADIUS*cos(angle), b->y + 0.5*BOSS_RADIUS*sin(angle), LARGE_SIZE);
+        a->dx = (Scalar)(b->dx + 0.6*cos(angle));
+        a->dy = (Scalar)(b->dy + 0.6*sin(angle));
+        wrapPosition(&a->x, &a->y);
+    }
+    queueCommand(COMMAND_SPAWN, NO_ENTITY, ARCH_DUST, 0, b->x, b->y, 0, 0);
+    score = score + SCORE_BOSS;
+    b->active = 0;
+}
+
+// The number of bosses still on the playfield.
+int
+bossesLeft(){
+    int left = 0;
+    
+    for(int i = 0; i < MAX_BOSSES; i++){
+        left = left + bosses[i].active;
+    }
+    return left;
+}
+
+/* Draws the bosses of the frame, with copies where they cross an edge of the playfield. An
+ * outline goes into a display list whenever it changes: filled as a fan from the center,
+ * since GL_POLYGON only fills convex outlines, then edged like the other asteroids.
+ */
+void
+drawBosses(){
+    static GLuint lists[MAX_BOSSES];
+    static int listVersion[MAX_BOSSES];
+    
+    for(int i = 0; i < MAX_BOSSES; i++){
+        Boss *b = &view->bosses[i];
+        BossShape *shape = &b->shape;
+        if(!b->active){
+            continue;
+        }
+        if(lists[i] == 0){
+            lists[i] = glGenLists(1);
+        }
+        if(listVersion[i] != shape->version){
+            glNewList(lists[i], GL_COMPILE);
+                glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+                glColor3f(0.6, 0.6, 0.6);
+                glBegin(GL_TRIANGLE_FAN);
+                    glVertex2d(0.0, 0.0);
+                    for(int v = 0; v <= shape->nVertices; v++){
+                        glVertex2d(shape->coords[v%shape->nVertices].x, shape->coords[v%shape->nVertices].y);
+                    }
+                glEnd();
+                glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+                glColor3f(0.0, 0.0, 0.0);
+                glBegin(GL_LINE_LOOP);
+                    for(int v = 0; v < shape->nVertices; v++){
+                        glVertex2d(shape->coords[v].x, shape->coords[v].y);
+                    }
+                glEnd();
+            glEndList();
+            listVersion[i] = shape->version;
+        }
+        for(int ox = -1; ox <= 1; ox++){
+            for(int oy = -1; oy <= 1; oy++){
+                double x = b->x + ox*view->xMax, y = b->y + oy*view->yMax;
+                if(x + shape->radius < 0 || x - shape->radius > view->xMax ||
+                   y + shape->radius < 0 || y - shape->radius > view->yMax){
+                    continue;
+                }
+                loadWorldMatrix();
+                myTranslate2D(x, y);
+                myRotate2D(DEG2RAD*b->phi);
+                glCallList(lists[i]);
+            }
+        }
+    }
+}
+
+/* -- levels ---------------------------------------------------------------- */
+
+/* Reads the levels from a file, or the built in ones without one. A file that can't be read
+ * or doesn't make sense is reported and the built in levels are played instead. Every level
+ * is turned into its spawn table here, so starting one later is only a copy.
+ */
+void
+loadLevels(const char *path){
+    static char text[LEVEL_FILE_BYTES];
+    
+    if(path != NULL){
+        FILE *file = fopen(path, "r");
+        size_t length = 0;
+        if(file == NULL){
+            fprintf(stderr, "levels: can't read %s, playing the built in levels instead\n", path);
+        }else{
+            length = fread(text, 1, sizeof(text) - 1, file);
+            fclose(file);
+            text[length] = '\0';
+            if(parseLevels(text, path)){
+                return;
+            }
+            fprintf(stderr, "levels: playing the built in levels instead\n");
+        }
+    }
+    snprintf(text, sizeof(text), "%s", builtinLevels);
+    parseLevels(text, "built in levels");
+}
+
+/* Each line of a level file is a level or a setting, anything after a # is a comment:
+ *
+ *     level large 2 medium 1 small 0 speed 0.2 1.0 spin 0.4 pattern ring time 60 boss 1024
+ *     endless
+ *     seed 1234
+ *
+ * A level lists how many asteroids of each size it starts with, the range of their speeds,
+ * how fast they may spin, where they come in (edges, ring, corners or scatter), how many
+ * seconds the player has to clear it, with no limit when time is left out, and the number of
+ * vertices of each of its boss asteroids. Once the levels
+ * in the file are beaten the game is won, unless endless says to carry on with levels made
+ * up from the seed, each a little harder than the one before. A seed in the file keeps the
+ * layouts the same for every game; without one each game works them out from its own seed.
+ */
+int
+parseLevels(char *text, const char *name){
+    char *line = text;
+    
+    levelCount = 0, levelsEndless = 0, levelSeed = LEVEL_SEED, levelSeedFixed = 0;
+    for(int lineNumber = 1; line != NULL && *line != '\0'; lineNumber++){
+        char *end = strchr(line, '\n'), *word;
+        Level *level = NULL;
+    
+        if(end != NULL){
+            *end = '\0';
+        }
+        if(strchr(line, '#') != NULL){
+            *strchr(line, '#') = '\0';
+        }
+        for(word = strtok(line, " \t\r"); word != NULL; word = strtok(NULL, " \t\r")){
+            char *a = NULL, *b = NULL;
+            if(level == NULL && strcmp(word, "level") == 0){
+                if(levelCount == MAX_LEVELS){
+                    fprintf(stderr, "levels: %s line %d: no more than %d levels\n", name, lineNumber, MAX_LEVELS);
+                    return 0;
+                }
+                level = &levels[levelCount];
+                memset(level, 0, sizeof(Level));
+                level->number = ++levelCount;
+                level->minSpeed = 0.1, level->maxSpeed = 1.1, level->spin = 0.4;
+                level->pattern = PATTERN_EDGES;
+                continue;
+            }else if(level == NULL && strcmp(word, "endless") == 0){
+                levelsEndless = 1;
+                continue;
+            }else if(level == NULL && strcmp(word, "seed") == 0 && (a = strtok(NULL, " \t\r")) != NULL){
+                levelSeed = (unsigned int)strtoul(a, NULL, 0);
+                levelSeedFixed = 1;
+                continue;
+            }
+            if(level != NULL && (a = strtok(NULL, " \t\r")) != NULL){
+                if(strcmp(word, "large") == 0){
+                    level->large = atoi(a);
+                    continue;
+                }else if(strcmp(word, "medium") == 0){
+                    level->medium = atoi(a);
+                    continue;
+                }else if(strcmp(word, "small") == 0){
+                    level->small = atoi(a);
+                    continue;
+                }else if(strcmp(word, "spin") == 0){
+                    level->spin = atof(a);
+                    continue;
+                }else if(strcmp(word, "boss") == 0){
+                    if(level->nBosses == MAX_BOSSES){
+                        fprintf(stderr, "levels: %s line %d: no more than %d bosses a level\n", name, lineNumber, MAX_BOSSES);
+                        return 0;
+                    }
+                    level->bossVertices[level->nBosses++] = atoi(a);
+                    continue;
+                }else if(strcmp(word, "time") == 0){
+                    level->timeLimit = (int)(atof(a)*1000/TICK_MS);
+                    continue;
+                }else if(strcmp(word, "speed") == 0 && (b = strtok(NULL, " \t\r")) != NULL){
+                    level->minSpeed = atof(a), level->maxSpeed = atof(b);
+                    continue;
+                }else if(strcmp(word, "pattern") == 0){
+                    for(level->pattern = 0; level->pattern < PATTERNS; level->pattern++){
+                        if(strcmp(a, patternNames[level->pattern]) == 0){
+                            break;
+                        }
+                    }
+                    if(level->pattern < PATTERNS){
+                        continue;
+                    }
+                }
+            }
+            fprintf(stderr, "levels: %s line %d: don't know what to do with '%s'\n", name, lineNumber, word);
+            return 0;
+        }
+    
+        if(level != NULL){
+            int mass = 4*level->large + 2*level->medium + level->small;
+            if(level->large < 0 || level->medium < 0 || level->small < 0 || (mass == 0 && level->nBosses == 0) ||
+               mass > LEVEL_MAX_MASS){
+                fprintf(stderr, "levels: %s line %d: a level needs some asteroids, and no more than %d small ones' worth\n",
+                        name, lineNumber, LEVEL_MAX_MASS);
+                return 0;
+            }
+            for(int i = 0; i < level->nBosses; i++){
+                if(level->bossVertices[i] < MIN_BOSS_VERTICES || level->bossVertices[i] > MAX_BOSS_VERTICES){
+                    fprintf(stderr, "levels: %s line %d: a boss has from %d to %d vertices\n",
+                            name, lineNumber, MIN_BOSS_VERTICES, MAX_BOSS_VERTICES);
+                    return 0;
+                }
+            }
+            compileLevel(level);
+        }
+        line = (end != NULL) ? end + 1 : NULL;
+    }
+    if(levelCount == 0 && !levelsEndless){
+        fprintf(stderr, "levels: %s has no levels\n", name);
+        return 0;
+    }
+    // The first made up level is ready before any game starts, the rest one level ahead.
+    if(levelsEndless){
+        generateLevel(levelCount + 1);
+    }
+    return 1;
+}
+
+/* Works out the spawn table of a level: where every asteroid comes in, its shape, and how
+ * it moves and spins. The random numbers come from the level's own sequence, so the same
+ * level always starts the same way.
+ */
+void
+compileLevel(Level *level){
+    unsigned int state = levelSeed ^ ((unsigned int)level->number*2654435761u);
+    int counts[SIZE_CLASSES] = {level->small, level->medium, level->large};
+    int n = 0, total = level->large + level->medium + level->small;
+    
+    for(int c = SIZE_CLASSES - 1; c >= 0; c--){
+        for(int k = 0; k < counts[c]; k++, n++){
+            LevelSpawn *spawn = &level->spawns[n];
+            double heading = worldRange(&state, 0.0, 2.0*M_PI);
+            double speed = worldRange(&state, level->minSpeed, level->maxSpeed);
+    
+            spawn->ox = spawn->oy = 0.0;
+            switch(level->pattern){
+                case PATTERN_EDGES:
+                    // Half come in from the left edge and half from the bottom, like the classic game.
+                    if(worldRandom(&state)%2 == 0){
+                        spawn->u = 0.0, spawn->v = worldRange(&state, 0.0, 1.0);
+                    }else{
+                        spawn->u = worldRange(&state, 0.0, 1.0), spawn->v = 0.0;
+                    }
+                    break;
+                case PATTERN_RING:
+                    {
+                        // Spread around the middle and moving around it, all the same way.
+                        double angle = 2.0*M_PI*n/total + worldRange(&state, -0.2, 0.2);
+                        spawn->u = spawn->v = 0.5;
+                        spawn->ox = (Scalar)(LEVEL_RING_RADIUS*cos(angle));
+                        spawn->oy = (Scalar)(LEVEL_RING_RADIUS*sin(angle));
+                        heading = angle + M_PI/2 + worldRange(&state, -0.5, 0.5);
+                    }
+                    break;
+                case PATTERN_CORNERS:
+                    spawn->u = (Scalar)(n%2), spawn->v = (Scalar)((n/2)%2);
+                    spawn->ox = (Scalar)worldRange(&state, -5.0, 5.0);
+                    spawn->oy = (Scalar)worldRange(&state, -5.0, 5.0);
+                    break;
+                default:
+                    // Anywhere but on top of the ship in the middle.
+                    do{
+                        spawn->u = (Scalar)worldRange(&state, 0.0, 1.0);
+                        spawn->v = (Scalar)worldRange(&state, 0.0, 1.0);
+                    }while(fabs(spawn->u - 0.5) < 0.25 && fabs(spawn->v - 0.5) < 0.25);
+                    break;
+            }
+            spawn->dx = (Scalar)(speed*cos(heading));
+            spawn->dy = (Scalar)(speed*sin(heading));
+            spawn->phi = (Scalar)worldRange(&state, 0.0, 360.0);
+            spawn->dphi = (Scalar)worldRange(&state, -level->spin, level->spin);
+            spawn->shape = c*SHAPES_PER_SIZE + worldRandom(&state)%SHAPES_PER_SIZE;
+        }
+    }
+    level->nSpawns = n;
+}
+
+/* Gives the levels the seed of a new game and works out their spawn tables again, unless the
+ * level file picked a seed of its own. A game played again with -seed gets the same layouts.
+ */
+void
+seedLevels(unsigned int seed){
+    if(levelSeedFixed){
+        return;
+    }
+    levelSeed = LEVEL_SEED ^ seed;
+    for(int i = 0; i < levelCount; i++){
+        compileLevel(&levels[i]);
+    }
+    // The made up levels are made again from the new seed too.
+    levels[MAX_LEVELS].number = levels[MAX_LEVELS + 1].number = 0;
+    if(levelsEndless){
+        generateLevel(levelCount + 1);
+    }
+}
+
+/* Makes up a level past the ones that were loaded. The asteroids grow by one large one's
+ * worth a level until the playfield can't take more, and from then on it is speed, spin and
+ * a shorter time limit that make it harder. The mix of sizes and where they come in is left
+ * to the seed. Every fifth level from the tenth on has a boss, with twice the vertices of the
+ * one before up to the most a boss can have.
+ */
+void
+generateLevel(int number){
+    Level *level = &levels[MAX_LEVELS + number%2];
+    unsigned int state = levelSeed ^ ((unsigned int)number*40503u);
+    int mass = (4*number < LEVEL_MAX_MASS) ? 4*number : LEVEL_MAX_MASS;
+    
+    if(level->number == number){
+        return;
+    }
+    memset(level, 0, sizeof(Level));
+    level->number = number;
+    while(mass > 0){
+        double pick = worldRange(&state, 0.0, 1.0);
+        if(mass >= 4 && pick < 0.6){
+            level->large = level->large + 1, mass = mass - 4;
+        }else if(mass >= 2 && pick < 0.9){
+            level->medium = level->medium + 1, mass = mass - 2;
+        }else{
+            level->small = level->small + 1, mass = mass - 1;
+        }
+    }
+    level->maxSpeed = fmin(0.8 + 0.05*number, 2.0);
+    level->minSpeed = 0.25*level->maxSpeed;
+    level->spin = fmin(0.3 + 0.03*number, 1.5);
+    level->pattern = worldRandom(&state)%PATTERNS;
+    if(number >= 12){
+        level->timeLimit = (int)(fmax(30.0, 120.0 - 3.0*(number - 12))*1000/TICK_MS);
+    }
+    if(number >= 10 && number%5 == 0){
+        level->nBosses = 1;
+        level->bossVertices[0] = (number < 30) ? 256 << (number - 10)/5 : MAX_BOSS_VERTICES;
+    }
+    compileLevel(level);
+}
+
+// The spawn table of a level, loaded or made up.
+Level *
+levelFor(int number){
+    if(number <= levelCount){
+        return &levels[number - 1];
+    }
+    generateLevel(number);
+    return &levels[MAX_LEVELS + number%2];
+}
+
+/* Puts the asteroids of a level on the playfield straight from its spawn table, and gets
+ * the next level ready while this one is played.
+ */
+void
+spawnLevel(int number){
+    Level *level;
+    
+    // There is no level 0, the benchmarks set up a game without one.
+    levelTicks = 0;
+    if(number < 1){
+        return;
+    }
+    level = levelFor(number);
+    for(int i = 0; i < level->nSpawns; i++){
+        LevelSpawn *spawn = &level->spawns[i];
+        Asteroid *a = &asteroids[i];
+        a->x = (Scalar)(spawn->u*xMax + spawn->ox);
+        a->y = (Scalar)(spawn->v*yMax + spawn->oy);
+        a->dx = spawn->dx, a->dy = spawn->dy;
+        a->phi = spawn->phi, a->dphi = spawn->dphi;
+        a->shape = spawn->shape;
+        a->active = 1;
+        wrapPosition(&a->x, &a->y);
+    }
+    spawnBosses(level);
+    if(levelsEndless && number + 1 > levelCount){
+        generateLevel(number + 1);
+    }
+}
+
+// Returns if a game that got to this level has won, by beating the last of the levels.
+int
+gameWon(int level){
+    return !levelsEndless && level > levelCount;
+}
+
+// The seconds left to clear the level being played, or -1 when it has no time limit.
+int
+levelTimeLeft(){
+    int limit;
+    
+    if(gameMode == MODE_WORLD || gameState < 1 || gameWon(gameState)){
+        return -1;
+    }
+    limit = levelFor(gameState)->timeLimit;
+    if(limit == 0){
+        return -1;
+    }
+    return (limit > levelTicks) ? (limit - levelTicks)*TICK_MS/1000 : 0;
+}
+
+/* -- scores ---------------------------------------------------------------- */
+
+/* Opens the score log, making it when there isn't one, and maps it into memory. The header
+ * slot with the highest sequence that checks out says how many records are on disk and holds
+ * the leaderboard, so that is all a start up has to read. Records written after it, by a game
+ * that quit or crashed before its commit, are taken back as far as the first one that doesn't
+ * check out. Anything past that, as far as two groups of commits could have reached, is
+ * cleared so that an old record left there can't be taken for a new one later on.
+ */
+int
+openScores(const char *path){
+    struct stat status;
+    ScoreHeader *slots[2];
+    long committed, capacity;
+    
+    scoreFd = open(path, O_RDWR | O_CREAT, 0644);
+    if(scoreFd < 0 || fstat(scoreFd, &status) != 0){
+        fprintf(stderr, "scores: can't open %s, scores won't be kept\n", path);
+        dropScores();
+        return 0;
+    }
+    scorePath = path;
+    scoreCapacity = 0, scoreCount = 0;
+    capacity = (status.st_size > SCORE_HEADER_BYTES) ? (long)((status.st_size - SCORE_HEADER_BYTES)/sizeof(RunRecord)) : 0;
+    if(!growScores((capacity > 0) ? capacity : SCORE_GROW)){
+        return 0;
+    }
+    
+    slots[0] = (ScoreHeader *)scoreMap, slots[1] = (ScoreHeader *)(scoreMap + SCORE_SLOT_BYTES);
+    memset(&scoreBoard, 0, sizeof(scoreBoard));
+    for(int k = 0; k < 2; k++){
+        if(validHeader(slots[k]) && slots[k]->sequence >= scoreBoard.sequence){
+            scoreBoard = *slots[k];
+        }
+    }
+    if(scoreBoard.committed > (unsigned long long)scoreCapacity){
+        memset(&scoreBoard, 0, sizeof(scoreBoard));
+    }
+    committed = (long)scoreBoard.committed;
+    
+    // Take back what was written after the last commit, up to the first torn record.
+    for(scoreCount = committed; scoreCount < scoreCapacity; scoreCount++){
+        RunRecord *run = scoreRecord(scoreCount);
+        if(run->magic != SCORE_MAGIC || run->number != (unsigned int)scoreCount ||
+           run->checksum != scoreChecksum(run, offsetof(RunRecord, checksum))){
+            break;
+        }
+        insertTop(&scoreBoard, run);
+    }
+    for(long i = scoreCount; i < scoreCapacity && i <= committed + 2*SCORE_GROUP; i++){
+        if(scoreRecord(i)->magic != 0){
+            memset(scoreRecord(i), 0, sizeof(RunRecord));
+        }
+    }
+    scoreCommitTime = monotonicSeconds();
+    if(scoreCount > committed){
+        commitScores();
+    }
+    return 1;
+}
+
+// Commits what is left and lets go of the log.
+void
+closeScores(){
+    if(scoreFd >= 0){
+        commitScores();
+    }
+    dropScores();
+}
+
+// Lets go of the log without committing anything, which is all a crash would do.
+void
+dropScores(){
+    if(scoreMap != NULL){
+        munmap(scoreMap, SCORE_HEADER_BYTES + scoreCapacity*sizeof(RunRecord));
+    }
+    if(scoreFd >= 0){
+        close(scoreFd);
+    }
+    scoreMap = NULL, scoreFd = -1;
+    scoreCapacity = 0, scoreCount = 0;
+}
+
+/* Makes the log big enough for this many records and maps it again. The file only grows,
+ * and what is already in it stays where it is.
+ */
+int
+growScores(long capacity){
+    size_t size = SCORE_HEADER_BYTES + capacity*sizeof(RunRecord);
+    void *map;
+    
+    if(scoreMap != NULL){
+        munmap(scoreMap, SCORE_HEADER_BYTES + scoreCapacity*sizeof(RunRecord));
+        scoreMap = NULL;
+    }
+    if(ftruncate(scoreFd, (off_t)size) != 0 ||
+       (map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, scoreFd, 0)) == MAP_FAILED){
+        fprintf(stderr, "scores: can't map %s, scores won't be kept\n", scorePath);
+        dropScores();
+        return 0;
+    }
+    scoreMap = map;
+    scoreCapacity = capacity;
+    return 1;
+}
+
+RunRecord *
+scoreRecord(long number){
+    return (RunRecord *)(scoreMap + SCORE_HEADER_BYTES) + number;
+}
+
+/* Adds a run to the end of the log and to the leaderboard. The record goes straight into the
+ * mapping, so it is in the file as soon as the call returns, but only known to be on disk
+ * once it has been committed. Runs are committed in groups, after SCORE_GROUP of them or
+ * the first run scoreGroupSeconds after the last commit, so a batch of games doesn't wait on
+ * the disk for every one of them.
+ */
+int
+recordRun(RunRecord *run){
+    if(scoreFd < 0){
+        return 0;
+    }
+    if(scoreCount == scoreCapacity && !growScores(2*scoreCapacity)){
+        return 0;
+    }
+    run->magic = SCORE_MAGIC;
+    run->number = (unsigned int)scoreCount;
+    run->checksum = scoreChecksum(run, offsetof(RunRecord, checksum));
+    *scoreRecord(scoreCount) = *run;
+    scoreCount = scoreCount + 1;
+    insertTop(&scoreBoard, run);
+    
+    if(scoreCount - (long)scoreBoard.committed >= SCORE_GROUP ||
+       monotonicSeconds() - scoreCommitTime >= scoreGroupSeconds){
+        commitScores();
+    }
+    return 1;
+}
+
+/* Makes the records since the last commit durable, then the header that counts them. The
+ * header goes into the slot that doesn't hold the newest one, so a header torn on its way to
+ * disk still leaves the one before it, and the records it is missing are taken back when the
+ * log is opened.
+ */
+void
+commitScores(){
+    long page = sysconf(_SC_PAGESIZE);
+    size_t from = SCORE_HEADER_BYTES + scoreBoard.committed*sizeof(RunRecord);
+    size_t to = SCORE_HEADER_BYTES + scoreCount*sizeof(RunRecord);
+    ScoreHeader *slot;
+    
+    if(scoreFd < 0 || scoreCount == (long)scoreBoard.committed){
+        return;
+    }
+    from = from/page*page;
+    msync(scoreMap + from, to - from, MS_SYNC);
+    scoreBoard.magic = SCORE_MAGIC;
+    scoreBoard.version = SCORE_VERSION;
+    scoreBoard.recordSize = sizeof(RunRecord);
+    scoreBoard.committed = (unsigned long long)scoreCount;
+    scoreBoard.sequence = scoreBoard.sequence + 1;
+    scoreBoard.checksum = scoreChecksum(&scoreBoard, offsetof(ScoreHeader, checksum));
+    slot = (ScoreHeader *)(scoreMap + (scoreBoard.sequence%2)*SCORE_SLOT_BYTES);
+    *slot = scoreBoard;
+    msync(scoreMap, SCORE_HEADER_BYTES, MS_SYNC);
+    scoreCommits = scoreCommits + 1;
+    scoreCommitTime = monotonicSeconds();
+}
+
+// Puts a run into its place on the leaderboard, if it scored enough and wasn't the autopilot's.
+void
+insertTop(ScoreHeader *header, RunRecord *run){
+    int i = (header->nTop < SCORE_TOP) ? (int)header->nTop : SCORE_TOP - 1;
+    
+    if(run->autopilot || (header->nTop == SCORE_TOP && run->score <= header->top[i].score)){
+        return;
+    }
+    for(; i > 0 && header->top[i - 1].score < run->score; i--){
+        header->top[i] = header->top[i - 1];
+    }
+    header->top[i].score = run->score;
+    header->top[i].level = run->level;
+    header->top[i].ticks = run->ticks;
+    header->top[i].seed = run->seed;
+    header->top[i].number = run->number;
+    if(header->nTop < SCORE_TOP){
+        header->nTop = header->nTop + 1;
+    }
+}
+
+int
+validHeader(ScoreHeader *header){
+    return header->magic == SCORE_MAGIC && header->version == SCORE_VERSION &&
+           header->recordSize == sizeof(RunRecord) && header->nTop <= SCORE_TOP &&
+           header->checksum == scoreChecksum(header, offsetof(ScoreHeader, checksum));
+}
+
+// FNV-1a over the bytes, enough to catch a record or header that only got partly written.
+unsigned int
+scoreChecksum(const void *data, size_t size){
+    const unsigned char *bytes = data;
+    unsigned int hash = 2166136261u;
+    
+    for(size_t i = 0; i < size; i++){
+        hash = (hash ^ bytes[i])*16777619u;
+    }
+    return hash;
+}
+
+/* Keeps the game that just ended. A game played in real time is committed straight away,
+ * since there is only one every so often; the games of a batch run are left to be grouped.
+ */
+void
+endRun(){
+    RunRecord run;
+    int won = gameWon(gameState);
+    
+    memset(&run, 0, sizeof(run));
+    run.score = score;
+    run.level = won ? levelCount : gameState;
+    run.won = won;
+    run.ticks = runTicks;
+    run.mode = gameMode;
+    run.seed = runSeed;
+    run.levelSeed = levelSeed;
+    run.autopilot = (unsigned int)runAutopilot;
+    run.time = (long long)time(NULL);
+    if(recordRun(&run) && !batchRun){
+        commitScores();
+    }
+}
+
+/* -- telemetry ------------------------------------------------------------- */
+
+/* Bins an event of a game into the calling thread's block: where on the screen it happened
+ * and how long into the level, under the level being played. Nothing is recorded on the
+ * menu. The block belongs to this thread alone, so these are plain increments, and the
+ * blocks are only added up when the run is over.
+ */
+void
+recordEvent(int kind, double x, double y){
+    TelemetryBlock *t = telemetry;
+    int level, column, row, second;
+    
+    if(gameState < 1){
+        return;
+    }
+    level = (gameState < TELEMETRY_LEVELS) ? gameState - 1 : TELEMETRY_LEVELS - 1;
+    column = (int)((x - cameraX)*TELEMETRY_COLUMNS/xMax);
+    row = (int)((y - cameraY)*TELEMETRY_ROWS/yMax);
+    column = (column < 0) ? 0 : (column >= TELEMETRY_COLUMNS) ? TELEMETRY_COLUMNS - 1 : column;
+    row = (row < 0) ? 0 : (row >= TELEMETRY_ROWS) ? TELEMETRY_ROWS - 1 : row;
+    second = levelTicks*TICK_MS/1000;
+    second = (second < TELEMETRY_SECONDS) ? second : TELEMETRY_SECONDS;
+    
+    t->heat[kind][level][row][column] = t->heat[kind][level][row][column] + 1;
+    t->times[kind][level][second] = t->times[kind][level][second] + 1;
+    t->total[kind] = t->total[kind] + 1;
+}
+
+// Adds up the blocks of every thread that recorded anything.
+void
+mergeTelemetry(TelemetryBlock *blocks, int n, TelemetryBlock *into){
+    size_t cells = sizeof(into->heat)/sizeof(unsigned int), bins = sizeof(into->times)/sizeof(unsigned int);
+    unsigned int *sum, *from;
+    
+    memset(into, 0, sizeof(TelemetryBlock));
+    for(int b = 0; b < n; b++){
+        sum = &into->heat[0][0][0][0], from = &blocks[b].heat[0][0][0][0];
+        for(size_t i = 0; i < cells; i++){
+            sum[i] = sum[i] + from[i];
+        }
+        sum = &into->times[0][0][0], from = &blocks[b].times[0][0][0];
+        for(size_t i = 0; i < bins; i++){
+            sum[i] = sum[i] + from[i];
+        }
+        for(int k = 0; k < TELEMETRY_KINDS; k++){
+            into->total[k] = into->total[k] + blocks[b].total[k];
+        }
+    }
+}
+
+/* Writes what was recorded into the -telemetry directory once the run is over: a heatmap
+ * of every kind of event over all the levels and one for each level it happened in, as
+ * plain PGM images a pixel to a cell with the top of the screen at the top, and times.csv
+ * with how many of each happened in every second into each level, the last second counting
+ * everything after it.
+ */
+void
+exportTelemetry(){
+    static TelemetryBlock merged;
+    static unsigned int all[TELEMETRY_ROWS][TELEMETRY_COLUMNS];
+    char path[4096];
+    FILE *file;
+    
+    if(telemetryPath == NULL){
+        return;
+    }
+    // The game's thread records into telemetryBlocks[1] until it has stopped.
+    stopSimulation();
+    mergeTelemetry(telemetryBlocks, COUNTER_BLOCKS, &merged);
+    if(mkdir(telemetryPath, 0755) != 0 && errno != EEXIST){
+        fprintf(stderr, "telemetry: can't make %s, nothing written\n", telemetryPath);
+        return;
+    }
+    
+    for(int k = 0; k < TELEMETRY_KINDS; k++){
+        memset(all, 0, sizeof(all));
+        for(int l = 0; l < TELEMETRY_LEVELS; l++){
+            int any = 0;
+            for(int r = 0; r < TELEMETRY_ROWS; r++){
+                for(int c = 0; c < TELEMETRY_COLUMNS; c++){
+                    all[r][c] = all[r][c] + merged.heat[k][l][r][c];
+                    any = any || merged.heat[k][l][r][c] > 0;
+                }
+            }
+            if(any){
+                snprintf(path, sizeof(path), "%s/%s-level%d%s.pgm", telemetryPath, telemetryNames[k], l + 1,
+                         (l == TELEMETRY_LEVELS - 1) ? "-up" : "");
+                writeHeatmap(path, merged.heat[k][l]);
+            }
+        }
+        snprintf(path, sizeof(path), "%s/%s.pgm", telemetryPath, telemetryNames[k]);
+        writeHeatmap(path, all);
+    }
+    
+    snprintf(path, sizeof(path), "%s/times.csv", telemetryPath);
+    file = fopen(path, "w");
+    if(file == NULL){
+        fprintf(stderr, "telemetry: can't write %s\n", path);
+        return;
+    }
+    fprintf(file, "event,level,second,count\n");
+    for(int k = 0; k < TELEMETRY_KINDS; k++){
+        for(int l = 0; l < TELEMETRY_LEVELS; l++){
+            for(int s = 0; s <= TELEMETRY_SECONDS; s++){
+                if(merged.times[k][l][s] > 0){
+                    fprintf(file, "%s,%d%s,%d%s,%u\n", telemetryNames[k], l + 1, (l == TELEMETRY_LEVELS - 1) ? "+" : "",
+                            s, (s == TELEMETRY_SECONDS) ? "+" : "", merged.times[k][l][s]);
+                }
+            }
+        }
+    }
+    fclose(file);
+    printf("telemetry: %ld deaths, %ld hits and %ld misses written to %s\n",
+           merged.total[TELEMETRY_DEATH], merged.total[TELEMETRY_HIT], merged.total[TELEMETRY_MISS], telemetryPath);
+}
+
+/* Writes one heatmap as a plain PGM. The grey levels are the counts themselves, unless some
+ * cell has more than a PGM can hold, when they are scaled down to fit.
+ */
+void
+writeHeatmap(const char *path, unsigned int heat[TELEMETRY_ROWS][TELEMETRY_COLUMNS]){
+    unsigned int most = 1;
+    FILE *file = fopen(path, "w");
+    
+    if(file == NULL){
+        fprintf(stderr, "telemetry: can't write %s\n", path);
+        return;
+    }
+    for(int r = 0; r < TELEMETRY_ROWS; r++){
+        for(int c = 0; c < TELEMETRY_COLUMNS; c++){
+            most = (heat[r][c] > most) ? heat[r][c] : most;
+        }
+    }
+    fprintf(file, "P2\n%d %d\n%u\n", TELEMETRY_COLUMNS, TELEMETRY_ROWS, (most < 65535) ? most : 65535);
+    for(int r = TELEMETRY_ROWS - 1; r >= 0; r--){
+        for(int c = 0; c < TELEMETRY_COLUMNS; c++){
+            unsigned int value = (most < 65535) ? heat[r][c] : (unsigned int)((double)heat[r][c]*65535/most);
+            fprintf(file, (c + 1 < TELEMETRY_COLUMNS) ? "%u " : "%u\n", value);
+        }
+    }
+    fclose(file);
+}
+
+/* -- audio ----------------------------------------------------------------- */
+
+/* Starts the mixer on its own thread, writing to ALSA, to a WAV file or to nothing at all.
+ * The sounds are all made up front so neither side ever allocates once it is running. A
+ * batch run has no thread for it, the game mixes a tick's worth of sound after every tick.
+ */
+void
+startAudio(const char *sink){
+    audioSink = SINK_NULL;
+    if(strcmp(sink, "alsa") == 0){
+#ifdef HAVE_ALSA
+        if(snd_pcm_open(&alsaPcm, "default", SND_PCM_STREAM_PLAYBACK, 0) == 0 &&
+           snd_pcm_set_params(alsaPcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED, 1,
+                              AUDIO_RATE, 1, AUDIO_DEVICE_US) == 0){
+            audioSink = SINK_ALSA;
+        }
+#endif
+        if(audioSink != SINK_ALSA){
+            fprintf(stderr, "audio: no ALSA device, mixing to nothing instead\n");
+        }
+    }else if(strcmp(sink, "null") != 0){
+        audioFile = fopen(sink, "wb");
+        if(audioFile == NULL){
+            fprintf(stderr, "audio: can't write %s, mixing to nothing instead\n", sink);
+        }else{
+            audioSink = SINK_WAV;
+            writeWavHeader(audioFile, 0);
+        }
+    }
+    
+    buildSounds();
+    audioRunning = 1;
+    if(!batchRun){
+        pthread_create(&audioThreadId, NULL, audioThread, NULL);
+    }
+    atexit(stopAudio);
+}
+
+// Stops the mixer, finishes the WAV file and reports how the mixer kept up.
+void
+stopAudio(){
+    if(!audioRunning){
+        return;
+    }
+    __atomic_store_n(&audioRunning, 0, __ATOMIC_RELEASE);
+    if(!batchRun){
+        pthread_join(audioThreadId, NULL);
+    }
+#ifdef HAVE_ALSA
+    if(audioSink == SINK_ALSA){
+        snd_pcm_drain(alsaPcm);
+        snd_pcm_close(alsaPcm);
+    }
+#endif
+    if(audioSink == SINK_WAV){
+        writeWavHeader(audioFile, audioFrames);
+        fclose(audioFile);
+    }
+    if(showStats || audioSink != SINK_ALSA){
+        printf("audio: %.1f s mixed, %ld overruns, %ld of %ld sound events dropped, event to sample %.0f ms p50, %.0f ms p99, %.1f us to mix a %d sample block\n",
+               (double)audioFrames/AUDIO_RATE, audioOverruns, audioDropped, audioDropped + audioLatencyCount,
+               latencyPercentile(audioLatency, audioLatencyCount, 0.5),
+               latencyPercentile(audioLatency, audioLatencyCount, 0.99),
+               1e6*audioMixTime/(audioFrames/AUDIO_BLOCK + 1), AUDIO_BLOCK);
+    }
+}
+
+/* Asks for a sound from the game. The queue has one producer, whichever thread runs the
+ * game, and one consumer, the mixer, so posting is a single store that never waits; with
+ * the queue full the sound is simply left out. The menu plays behind its own silence.
+ */
+int
+playSound(int sound){
+    unsigned int head = audioHead;
+    
+    if(!audioRunning || (gameState == 0 && sound != SOUND_ENGINE_OFF)){
+        return 0;
+    }
+    if(head - __atomic_load_n(&audioTail, __ATOMIC_ACQUIRE) == AUDIO_QUEUE_SIZE){
+        audioDropped = audioDropped + 1;
+        return 0;
+    }
+    audioQueue[head%AUDIO_QUEUE_SIZE].sound = sound;
+    audioQueue[head%AUDIO_QUEUE_SIZE].time = batchRun ? audioGameTime : monotonicSeconds();
+    __atomic_store_n(&audioHead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Only changes of the engine are sent, it loops for as long as it is on.
+void
+engineSound(int on){
+    static int engineOn = 0;
+    
+    if(on != engineOn && playSound(on ? SOUND_ENGINE : SOUND_ENGINE_OFF)){
+        engineOn = on;
+    }
+}
+
+/* The mixer thread. ALSA sets the pace by blocking on a full buffer; the file and null sinks
+ * are paced by the clock instead, so that they keep the same timing as a sound card would. A
+ * block that isn't ready by the time the one before it has played out is an overrun, which on
+ * a sound card would be heard as a gap.
+ */
+void *
+audioThread(void *arg){
+    double next = monotonicSeconds(), played;
+    
+    (void)arg;
+    while(__atomic_load_n(&audioRunning, __ATOMIC_ACQUIRE)){
+        // When the start of this block will be heard.
+        played = next;
+#ifdef HAVE_ALSA
+        if(audioSink == SINK_ALSA){
+            snd_pcm_sframes_t delay = 0;
+            if(snd_pcm_delay(alsaPcm, &delay) < 0){
+                delay = 0;
+            }
+            played = monotonicSeconds() + (double)delay/AUDIO_RATE;
+        }
+#endif
+        mixNext(played);
+        if(audioSink == SINK_ALSA){
+            continue;
+        }
+        next = next + (double)AUDIO_BLOCK/AUDIO_RATE;
+        if(monotonicSeconds() > next){
+            audioOverruns = audioOverruns + 1;
+            next = monotonicSeconds();
+        }else{
+            struct timespec until;
+            until.tv_sec = (time_t)next;
+            until.tv_nsec = (long)((next - (double)until.tv_sec)*1e9);
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* Mixes the next block and hands it to the sink. It takes the sounds asked for since the
+ * last one, heard from the given time, and mixes every playing voice.
+ */
+void
+mixNext(double played){
+    short out[AUDIO_BLOCK];
+    double start = monotonicSeconds();
+    SoundEvent event;
+    
+    while(popSound(&event)){
+        startVoice(event.sound);
+        recordLatency(audioLatency, &audioLatencyCount, played - event.time);
+    }
+    mixBlock(out);
+    audioMixTime = audioMixTime + (monotonicSeconds() - start);
+    audioFrames = audioFrames + AUDIO_BLOCK;
+    
+    if(audioSink == SINK_ALSA){
+#ifdef HAVE_ALSA
+        snd_pcm_sframes_t written = snd_pcm_writei(alsaPcm, out, AUDIO_BLOCK);
+        if(written == -EPIPE){
+            audioOverruns = audioOverruns + 1;
+            snd_pcm_prepare(alsaPcm);
+        }else if(written < 0){
+            snd_pcm_recover(alsaPcm, (int)written, 1);
+        }
+#endif
+    }else if(audioSink == SINK_WAV){
+        fwrite(out, sizeof(short), AUDIO_BLOCK, audioFile);
+    }
+}
+
+/* Mixes blocks until the sound has caught up with the game, in a batch run where the game
+ * sets the pace. The latencies come out in the time of the game, like the sound does.
+ */
+void
+catchUpAudio(double now){
+    while(audioRunning && (double)audioFrames/AUDIO_RATE < now){
+        mixNext((double)audioFrames/AUDIO_RATE);
+    }
+}
+
+int
+popSound(SoundEvent *event){
+    unsigned int tail = audioTail;
+    
+    if(tail == __atomic_load_n(&audioHead, __ATOMIC_ACQUIRE)){
+        return 0;
+    }
+    *event = audioQueue[tail%AUDIO_QUEUE_SIZE];
+    __atomic_store_n(&audioTail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Gives a sound a voice. The engine has a voice of its own that fades in and out; anything
+ * else takes a free voice, or the one that has played the longest when none are free.
+ */
+void
+startVoice(int sound){
+    Voice *voice = &voices[0];
+    
+    if(sound == SOUND_ENGINE || sound == SOUND_ENGINE_OFF){
+        voice->sound = SOUND_ENGINE;
+        voice->target = (sound == SOUND_ENGINE) ? sounds[SOUND_ENGINE].gain : 0.0f;
+        return;
+    }
+    for(int v = 1; v < AUDIO_VOICES; v++){
+        if(voices[v].target == 0.0f && voices[v].gain == 0.0f){
+            voice = &voices[v];
+            break;
+        }
+        if(voice == &voices[0] || voices[v].position > voice->position){
+            voice = &voices[v];
+        }
+    }
+    voice->sound = sound;
+    voice->position = 0;
+    voice->gain = voice->target = sounds[sound].gain;
+}
+
+/* Mixes one block of every playing voice. The sounds are padded out to whole blocks, so the
+ * inner loops are the same fixed length with nothing to check and the compiler turns them
+ * into vector code. Gain changes are ramped over the block so they never click.
+ */
+void
+mixBlock(short *out){
+    float mix[AUDIO_BLOCK];
+    
+    memset(mix, 0, sizeof(mix));
+    for(int v = 0; v < AUDIO_VOICES; v++){
+        Voice *voice = &voices[v];
+        Sound *sound = &sounds[voice->sound];
+        const float *pcm = sound->pcm + voice->position;
+        float gain = voice->gain, step = (voice->target - voice->gain)/AUDIO_BLOCK;
+    
+        if(gain == 0.0f && voice->target == 0.0f){
+            continue;
+        }
+#pragma GCC ivdep
+        for(int i = 0; i < AUDIO_BLOCK; i++){
+            mix[i] = mix[i] + (gain + step*i)*pcm[i];
+        }
+        voice->gain = voice->target;
+        voice->position = voice->position + AUDIO_BLOCK;
+        if(voice->position >= sound->length){
+            voice->position = 0;
+            if(!sound->loop){
+                voice->gain = voice->target = 0.0f;
+            }
+        }
+    }
+    for(int i = 0; i < AUDIO_BLOCK; i++){
+        float sample = 32767.0f*mix[i];
+        sample = (sample > 32767.0f) ? 32767.0f : sample;
+        sample = (sample < -32767.0f) ? -32767.0f : sample;
+        out[i] = (short)sample;
+    }
+}
+
+/* Makes the sounds: a falling chirp for a photon, a burst of noise for an asteroid breaking
+ * and a longer, deeper one for the ship, and a low rumble for the engine. Each is padded
+ * with silence to a whole number of blocks; the engine is a whole number of periods long
+ * so that it loops without a seam.
+ */
+void
+buildSounds(){
+    static float pool[AUDIO_POOL];
+    int used = 0;
+    unsigned int noise = 12345;
+    double seconds[SOUNDS] = {0.12, 0.35, 1.2, 0.26};
+    
+    for(int s = 0; s < SOUNDS; s++){
+        Sound *sound = &sounds[s];
+        int n = (int)(seconds[s]*AUDIO_RATE);
+        double phase = 0.0, low = 0.0;
+    
+        sound->length = (n + AUDIO_BLOCK - 1)/AUDIO_BLOCK*AUDIO_BLOCK;
+        sound->pcm = &pool[used];
+        sound->loop = (s == SOUND_ENGINE);
+        used = used + sound->length;
+        for(int i = 0; i < sound->length; i++){
+            double t = (double)i/AUDIO_RATE, fade = (i < n) ? 1.0 - (double)i/n : 0.0;
+            double white, value;
+            noise = noise*1664525u + 1013904223u;
+            white = noise/2147483648.0 - 1.0;
+            if(s == SOUND_FIRE){
+                phase = phase + 2.0*M_PI*(1800.0 - 9000.0*t)/AUDIO_RATE;
+                value = sin(phase)*fade;
+            }else if(s == SOUND_ENGINE){
+                // Whole numbers of cycles over the loop, with a little noise on top.
+                value = 0.6*sin(2.0*M_PI*15*i/sound->length) + 0.3*sin(2.0*M_PI*22*i/sound->length) +
+                        0.1*white;
+            }else{
+                // Smoothed noise, lower for the bigger explosion.
+                low = low + ((s == SOUND_EXPLOSION) ? 0.05 : 0.2)*(white - low);
+                value = 3.0*low*fade*fade;
+            }
+            sound->pcm[i] = (float)value;
+        }
+    }
+    sounds[SOUND_FIRE].gain = 0.25f;
+    sounds[SOUND_BREAK].gain = 0.35f;
+    sounds[SOUND_EXPLOSION].gain = 0.6f;
+    sounds[SOUND_ENGINE].gain = 0.15f;
+}
+
+// A mono 16 bit WAV header for the given number of samples.
+void
+writeWavHeader(FILE *file, long frames){
+    unsigned char header[44];
+    long data = frames*2;
+    
+    memcpy(header, "RIFF\0\0\0\0WAVEfmt ", 16);
+    writeLittle(header + 4, 36 + data, 4);
+    writeLittle(header + 16, 16, 4);
+    writeLittle(header + 20, 1, 2);
+    writeLittle(header + 22, 1, 2);
+    writeLittle(header + 24, AUDIO_RATE, 4);
+    writeLittle(header + 28, AUDIO_RATE*2, 4);
+    writeLittle(header + 32, 2, 2);
+    writeLittle(header + 34, 16, 2);
+    memcpy(header + 36, "data", 4);
+    writeLittle(header + 40, data, 4);
+    fseek(file, 0, SEEK_SET);
+    fwrite(header, 1, sizeof(header), file);
+    fseek(file, 0, SEEK_END);
+}
+
+void
+writeLittle(unsigned char *at, long value, int bytes){
+    for(int i = 0; i < bytes; i++){
+        at[i] = (unsigned char)(value >> (8*i));
+    }
+}
+
+/* -- terminal -------------------------------------------------------------- */
+
+/* Plays the game in the terminal it was started from, for a machine with no display. The
+ * game steps its own ticks like the simulation thread does, reads the keys from the
+ * terminal and draws every frame it would have drawn in a window as characters.
+ */
+void
+runTerminal(){
+    struct sigaction quit;
+    double next;
+    
+    headless = 1;
+    termTrueColor = getenv("COLORTERM") != NULL &&
+                    (strstr(getenv("COLORTERM"), "truecolor") != NULL || strstr(getenv("COLORTERM"), "24bit") != NULL);
+    if(tcgetattr(STDIN_FILENO, &termSaved) == 0){
+        struct termios raw = termSaved;
+        raw.c_lflag = raw.c_lflag & ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+        termRaw = 1;
+    }
+    memset(&quit, 0, sizeof(quit));
+    quit.sa_handler = terminalSignal;
+    sigaction(SIGINT, &quit, NULL);
+    sigaction(SIGTERM, &quit, NULL);
+    atexit(restoreTerminal);
+    termWrite("\x1b[?1049h\x1b[?25l", 14);
+    
+    terminalSize();
+    resizePlayfield(termWidth, termHeight);
+    buildShapeLibrary();
+    menuInit();
+    showScreen(myMenuDisplay);
+    scheduleTimer(menuMyTimer, 0);
+    
+    next = monotonicSeconds();
+    while(!termQuit && pendingTimer != NULL){
+        double wait = next - monotonicSeconds();
+        if(wait > 0){
+            struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+            // Half an escape sequence is only waited on for so long before it counts as keys.
+            if(termHeldCount > 0){
+                wait = fmin(wait, fmax(0.0, termHeldSince + TERM_ESCAPE_WAIT - monotonicSeconds()));
+            }
+            if(poll(&input, 1, (int)ceil(wait*1e3)) > 0){
+                readTerminal(0);
+            }else if(termHeldCount > 0 && monotonicSeconds() >= termHeldSince + TERM_ESCAPE_WAIT){
+                readTerminal(1);
+            }
+            if(pendingTicks > 1 && inputHead != inputTail){
+                wakeIdle();
+            }else if(monotonicSeconds() < next){
+                continue;
+            }
+        }else{
+            runTick(pendingValue);
+            next = fmax(next + pendingTicks*TICK_MS*1e-3, monotonicSeconds() - 0.1);
+        }
+    
+        // A resized terminal reaches the game like a reshaped window, and is drawn afresh.
+        if(terminalSize()){
+            queueInput(INPUT_RESHAPE, 0, 0, termWidth, termHeight);
+            redrawWanted = 1;
+        }
+        if(redrawWanted){
+            redrawWanted = 0;
+            publishFrame();
+            acquireFrame();
+            drawTerminal();
+        }
+    }
+}
+
+// Puts the terminal back the way it was found and says how much the frames took.
+void
+restoreTerminal(){
+    if(termRaw){
+        termWrite("\x1b[0m\x1b[?25h\x1b[?1049l", 18);
+        tcsetattr(STDIN_FILENO, TCSANOW, &termSaved);
+        termRaw = 0;
+        if(termFrames > 0){
+            printf("terminal: %ld frames at %dx%d cells, %.0f bytes per frame, %ld the most, %.1f KB/s at 60 fps, %.0f us to draw a frame\n",
+                   termFrames, termColumns, termRows, (double)termBytes/termFrames, termMaxBytes,
+                   60.0*termBytes/termFrames/1024, 1e6*termTime/termFrames);
+        }
+    }
+}
+
+void
+terminalSignal(int signal){
+    (void)signal;
+    termQuit = 1;
+}
+
+/* Turns the keys waiting on the terminal into input events. A terminal only sends presses,
+ * and repeats while a key is held, so every cursor key press steers for one tick. Enter
+ * starts a game from the menu and q quits. A cursor key is an escape sequence that can be
+ * split between two reads, so an unfinished one is held over to the next, and only taken
+ * as plain keys once TERM_ESCAPE_WAIT has gone by without the rest of it.
+ */
+void
+readTerminal(int timedOut){
+    unsigned char keys[64 + TERM_ESCAPE_BYTES];
+    int n = termHeldCount, held = termHeldCount;
+    
+    memcpy(keys, termHeld, termHeldCount);
+    termHeldCount = 0;
+    if(!timedOut){
+        int got = (int)read(STDIN_FILENO, keys + n, sizeof(keys) - n);
+        n = n + ((got > 0) ? got : 0);
+    }
+    
+    for(int i = 0; i < n; i++){
+        if(keys[i] == 27){
+            // ESC [ takes any number of parameter bytes before the one that says which key it is.
+            int end = i + 1;
+            if(end < n && keys[end] == '['){
+                for(end = end + 1; end < n && keys[end] >= 0x30 && keys[end] <= 0x3f; end++){
+                }
+            }else if(end < n && keys[end] == 'O'){
+                end = end + 1;
+            }
+            if(end >= n && !timedOut && n - i <= TERM_ESCAPE_BYTES){
+                // The rest of it is still on its way, so it waits for the next read.
+                memcpy(termHeld, keys + i, n - i);
+                termHeldCount = n - i;
+                termHeldSince = (i == 0 && held > 0) ? termHeldSince : monotonicSeconds();
+                return;
+            }
+            if(end > i + 1 && end < n){
+                int special = -1;
+                switch(keys[end]){
+                    case 'A':
+                        special = GLUT_KEY_UP;
+                        break;
+                    case 'B':
+                        special = GLUT_KEY_DOWN;
+                        break;
+                    case 'C':
+                        special = GLUT_KEY_RIGHT;
+                        break;
+                    case 'D':
+                        special = GLUT_KEY_LEFT;
+                        break;
+                }
+                if(special >= 0){
+                    queueInput(INPUT_SPECIAL_DOWN, special, 0, 0, 0);
+                    queueInput(INPUT_SPECIAL_UP, special, 0, 0, 0);
+                }
+                i = end;
+            }
+            // A lone ESC, or one whose sequence never finished, leaves what follows it as keys.
+        }else if(keys[i] == 'q' || keys[i] == 'Q'){
+            termQuit = 1;
+        }else if(keys[i] == '\r' || keys[i] == '\n'){
+            queueInput(INPUT_KEY, 13, 0, 0, 0);
+        }else if(keys[i] >= 32 && keys[i] < 127){
+            queueInput(INPUT_KEY, keys[i], 0, 0, 0);
+        }
+    }
+}
+
+/* Reads the size of the terminal and returns if it changed. The bottom row is kept for the
+ * status line, every other cell is two pixels of the playfield, one above the other.
+ */
+int
+terminalSize(){
+    struct winsize size;
+    int columns = 80, rows = 24;
+    
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 && size.ws_row > 1){
+        columns = size.ws_col, rows = size.ws_row;
+    }
+    columns = (columns > TERM_MAX_COLUMNS) ? TERM_MAX_COLUMNS : columns;
+    rows = (rows > TERM_MAX_ROWS) ? TERM_MAX_ROWS : rows;
+    if(columns == termColumns && rows == termRows){
+        return 0;
+    }
+    termColumns = columns, termRows = rows;
+    termWidth = columns, termHeight = 2*(rows - 1);
+    termCleared = 0;
+    return 1;
+}
+
+/* Draws the frame being shown and sends only the cells that changed since the last one.
+ * Once a second the status line is updated with how many bytes the frames take.
+ */
+void
+drawTerminal(){
+    static double statusTime = 0.0;
+    static long statusFrames = 0, statusBytes = 0;
+    double start = monotonicSeconds();
+    int bytes;
+    
+    rasterTerminal();
+    if(start - statusTime >= 1.0){
+        char status[TERM_MAX_COLUMNS + 1];
+        snprintf(status, sizeof(status), " %dx%d  %.0f fps  %.0f bytes/frame  %.1f KB/s  %s",
+                 termColumns, termRows, statusFrames/(start - statusTime),
+                 statusFrames ? (double)statusBytes/statusFrames : 0.0,
+                 statusBytes/(start - statusTime)/1024, termTrueColor ? "truecolor" : "256 colors");
+        statusTime = start, statusFrames = statusBytes = 0;
+        snprintf(termStatus, sizeof(termStatus), "%s", status);
+    }
+    terminalText(termStatus, termRows - 1, 0, 0x808080);
+    
+    bytes = diffTerminal(termOut);
+    termWrite(termOut, bytes);
+    
+    termFrames = termFrames + 1;
+    termBytes = termBytes + bytes;
+    termMaxBytes = (bytes > termMaxBytes) ? bytes : termMaxBytes;
+    termTime = termTime + (monotonicSeconds() - start);
+    statusFrames = statusFrames + 1, statusBytes = statusBytes + bytes;
+    countEvent(COUNT_FRAMES, 1);
+    setGauge(GAUGE_FRAME_US, 1e6*(monotonicSeconds() - start));
+    sampleCounters(monotonicSeconds());
+}
+
+/* Draws the screen the frame was made for into the pixels, and its text into the cells on
+ * top of them, the way its display callback would have.
+ */
+void
+rasterTerminal(){
+    char mode[TEXT_MAX];
+    
+    memset(termPixels, 0, sizeof(termPixels));
+    memset(termOverlay, 0, sizeof(termOverlay));
+    terminalStars();
+    
+    if(view->display == myGameDisplay || view->display == myMenuDisplay){
+        terminalPlayfield();
+    }
+    if(view->display == myGameDisplay){
+        terminalWorldText(getLevelNumber(), 10, view->yMax-6, 0xffffff);
+        terminalWorldText("LIVES - ", view->xMax-30, view->yMax-6, 0xffffff);
+        snprintf(mode, sizeof(mode), "SCORE %d", view->score);
+        terminalWorldText(mode, 30, view->yMax-6, 0xffffff);
+        if(view->timeLeft >= 0){
+            snprintf(mode, sizeof(mode), "TIME %d", view->timeLeft);
+            terminalWorldText(mode, view->xMax/2 - 6, view->yMax-6, (view->timeLeft > 10) ? 0xffffff : 0xff4c4c);
+        }
+        for(int i = 0; i < view->lives; i++){
+            int column = (int)((view->xMax-(5*i)-5)*termWidth/view->xMax);
+            int row = (int)(5*termHeight/view->yMax)/2;
+            if(column >= 0 && column < termColumns){
+                termOverlay[row][column].glyph = TERM_GLYPH_SHIP;
+                termOverlay[row][column].fg = 0xffffff;
+            }
+        }
+        if(view->showCounters){
+            char lines[COUNTER_LINES][TEXT_MAX];
+            formatCounters(lines);
+            for(int i = 0; i < COUNTER_LINES; i++){
+                terminalWorldText(lines[i], 10, view->yMax - 10 - 3*i, 0x99ff99);
+            }
+        }
+    }else if(view->display == myMenuDisplay){
+        terminalWorldText("ASTEROIDS ", 50, 50, 0xffffff);
+        terminalWorldText("START", 105, 50, 0xff0000);
+        for(int i = 0; i < 4; i++){
+            Coords *a = &startbox.coords[i], *b = &startbox.coords[(i + 1)%4];
+            terminalLine(a->x, a->y, b->x, b->y, 0xff0000);
+        }
+        snprintf(mode, sizeof(mode), "MODE - %s", modeNames[view->gameMode]);
+        terminalWorldText(mode, 50, 44, 0xffffff);
+        terminalWorldText("ENTER - START  Q - QUIT", 50, 38, 0x808080);
+        if(view->nBest > 0){
+            terminalWorldText("HIGH SCORES", 50, 32, 0xffffff);
+        }
+        for(int i = 0; i < view->nBest; i++){
+            snprintf(mode, sizeof(mode), "%d %7d LEVEL %d", i + 1, view->best[i].score, view->best[i].level);
+            terminalWorldText(mode, 50, 28 - 3*i, 0xffffff);
+        }
+    }else if(view->display == myLevelDisplay){
+        terminalWorldText(getLevelNumber(), 77, 50, 0xffffff);
+    }else if(view->display == gameOverDisplay){
+        terminalWorldText("GAME OVER!!", 77, 50, 0xffffff);
+        snprintf(mode, sizeof(mode), "SCORE %d", view->score);
+        terminalWorldText(mode, 77, 44, 0xffffff);
+    }
+}
+
+/* The starfield has no positions kept for it, its layers are display lists, so each layer is
+ * scattered again from the same seed every frame, as many stars as it has per pixel of the
+ * window it was made for.
+ */
+void
+terminalStars(){
+    for(int l = 0; l < STAR_LAYERS; l++){
+        StarLayer *layer = &starLayers[l];
+        unsigned int state = 7919u*(l + 1);
+        int n = (int)((double)layer->nStars*termWidth*termHeight/(1000.0*600.0));
+        int grey = (int)(255*layer->brightness);
+    
+        for(int i = 0; i < n; i++){
+            double x = view->xMax*(worldRandom(&state)%0x7fff)/32767.0 - view->starOffsetX[l];
+            double y = view->yMax*(worldRandom(&state)%0x7fff)/32767.0 - view->starOffsetY[l];
+            x = (x < 0) ? x + view->xMax : x;
+            y = (y < 0) ? y + view->yMax : y;
+            terminalPixel((int)(x*termWidth/view->xMax), (int)((view->yMax - y)*termHeight/view->yMax),
+                          (grey << 16) | (grey << 8) | grey);
+        }
+    }
+}
+
+// The ship, photons, asteroids and dust of the frame, as drawPlayfield draws them.
+void
+terminalPlayfield(){
+    Coords corners[MAX_VERTICES];
+    unsigned int noise = termNoise;
+    
+    if(view->shipExplosion.active == 1){
+        terminalDust(view->shipExplosion.coords, view->ship.x, view->ship.y, view->ship.phi, &noise);
+    }else{
+        for(int i = 0; i < view->nShipInstances; i++){
+            Ship *s = &view->shipInstances[i];
+            if(s->engine == 1){
+                corners[0].x = s->coords[0].x, corners[0].y = -(s->coords[0].y)-1.0;
+                corners[1].x = s->coords[1].x+0.3, corners[1].y = s->coords[1].y;
+                corners[2].x = s->coords[2].x-0.3, corners[2].y = s->coords[2].y;
+                terminalPolygon(corners, 3, s->x, s->y, s->phi, 0xff0000);
+            }
+            if(terminalPolygon(s->coords, SHIP_VERTICES, s->x, s->y, s->phi, 0xffffff) == 0){
+                terminalWorldPixel(s->x, s->y, 0xffffff);
+            }
+        }
+    }
+    
+    for(int i = 0; i < view->nPhotons; i++){
+        terminalWorldPixel(view->photons[i].x, view->photons[i].y, 0xffffff);
+    }
+    
+    for(int i = 0; i < view->nAsteroidInstances; i++){
+        Asteroid *a = &view->asteroidInstances[i].body;
+        int n;
+        Coords *coords;
+        if(a->shape >= MAX_SHAPES){
+            FrameOutline *outline = &view->outlines[a->shape - MAX_SHAPES];
+            n = outline->nVertices, coords = outline->coords;
+        }else{
+            n = shapeLibrary[a->shape].nVertices, coords = shapeLibrary[a->shape].coords;
+        }
+        if(terminalPolygon(coords, n, a->x, a->y, a->phi, 0x999999) == 0){
+            terminalWorldPixel(a->x, a->y, 0x999999);
+        }
+    }
+    for(int i = 0; i < MAX_BOSSES; i++){
+        if(view->bosses[i].active){
+            terminalBoss(&view->bosses[i], 0x999999);
+        }
+    }
+    
+    if(view->gameMode == MODE_GRAVITY){
+        for(int w = 0; w < GRAVITY_WELLS; w++){
+            for(int i = 0; i < 16; i++){
+                corners[i].x = 2.0*cos(2.0*M_PI*i/16), corners[i].y = 2.0*sin(2.0*M_PI*i/16);
+            }
+            terminalPolygon(corners, 16, view->xMax*(w + 1)/(GRAVITY_WELLS + 1), view->yMax/2, 0.0, 0x8033cc);
+        }
+    }
+    
+    for(int i = 0; i < view->nEnemies; i++){
+        terminalWorldPixel(view->enemies[i].x, view->enemies[i].y, 0xff8000);
+    }
+    
+    for(int i = 0; i < view->nDust; i++){
+        terminalDust(view->dust[i].coords, 0.0, 0.0, 0.0, &noise);
+    }
+    termNoise = noise;
+}
+
+// A dust cloud in random colours, its particles placed around (x, y) turned by phi.
+void
+terminalDust(Coords *coords, double x, double y, double phi, unsigned int *noise){
+    double c = cos(DEG2RAD*phi), s = sin(DEG2RAD*phi);
+    
+    for(int i = 0; i < DUST_PARTICLES; i++){
+        *noise = *noise*1664525u + 1013904223u;
+        terminalWorldPixel(x + c*coords[i].x - s*coords[i].y, y + s*coords[i].x + c*coords[i].y,
+                           (*noise >> 8) | 0x404040);
+    }
+}
+
+/* Fills an outline given around (x, y) and turned by phi degrees, lighting the pixels whose
+ * centers are inside it by the even-odd rule. Returns how many it lit, as small bodies can
+ * fall between pixel centers.
+ */
+int
+terminalPolygon(Coords *coords, int n, double x, double y, double phi, unsigned int color){
+    double px[MAX_VERTICES], py[MAX_VERTICES], crossings[MAX_VERTICES];
+    double c = cos(DEG2RAD*phi), s = sin(DEG2RAD*phi), top = HUGE_VAL, bottom = -HUGE_VAL;
+    double scaleX = termWidth/view->xMax, scaleY = termHeight/view->yMax;
+    int lit = 0;
+    
+    for(int i = 0; i < n; i++){
+        px[i] = (x + c*coords[i].x - s*coords[i].y - view->cameraX)*scaleX;
+        py[i] = (view->yMax - (y + s*coords[i].x + c*coords[i].y - view->cameraY))*scaleY;
+        top = fmin(top, py[i]), bottom = fmax(bottom, py[i]);
+    }
+    for(int row = (int)fmax(floor(top), 0); row <= (int)fmin(bottom, termHeight - 1); row++){
+        double center = row + 0.5;
+        int count = 0;
+        for(int i = 0, j = n - 1; i < n; j = i++){
+            if((py[i] > center) != (py[j] > center)){
+                crossings[count++] = px[j] + (center - py[j])*(px[i] - px[j])/(py[i] - py[j]);
+            }
+        }
+        // A handful of crossings, sorted in place.
+        for(int i = 1; i < count; i++){
+            for(int k = i; k > 0 && crossings[k - 1] > crossings[k]; k--){
+                double swap = crossings[k];
+                crossings[k] = crossings[k - 1], crossings[k - 1] = swap;
+            }
+        }
+        for(int i = 0; i + 1 < count; i += 2){
+            for(int column = (int)ceil(crossings[i] - 0.5); column + 0.5 < crossings[i + 1]; column++){
+                lit = lit + terminalPixel(column, row, color);
+            }
+        }
+    }
+    return lit;
+}
+
+/* A boss has far more vertices than terminalPolygon takes, so instead every pixel asks the
+ * boss's edge tree whether its center is inside, the way a photon would. Most of them are
+ * turned away by the bounding circle before they get that far.
+ */
+void
+terminalBoss(Boss *b, unsigned int color){
+    double scaleX = termWidth/view->xMax, scaleY = termHeight/view->yMax;
+    double c = cos(DEG2RAD*b->phi), s = sin(DEG2RAD*b->phi);
+    
+    for(int row = 0; row < termHeight; row++){
+        double y = view->yMax - (row + 0.5)/scaleY + view->cameraY;
+        double oy = spatialWrapDelta(y - b->y, view->yMax);
+        if(fabs(oy) > b->shape.radius){
+            continue;
+        }
+        for(int column = 0; column < termWidth; column++){
+            double x = (column + 0.5)/scaleX + view->cameraX;
+            double ox = spatialWrapDelta(x - b->x, view->xMax);
+            if(pointInBoss(&b->shape, c*ox + s*oy, -s*ox + c*oy)){
+                terminalPixel(column, row, color);
+            }
+        }
+    }
+}
+
+// A line between two points of the screen, stepping along whichever way it is longer.
+void
+terminalLine(double x0, double y0, double x1, double y1, unsigned int color){
+    double scaleX = termWidth/view->xMax, scaleY = termHeight/view->yMax;
+    double ax = x0*scaleX, ay = (view->yMax - y0)*scaleY, bx = x1*scaleX, by = (view->yMax - y1)*scaleY;
+    int steps = (int)ceil(fmax(fabs(bx - ax), fabs(by - ay))) + 1;
+    
+    for(int i = 0; i <= steps; i++){
+        terminalPixel((int)(ax + (bx - ax)*i/steps), (int)(ay + (by - ay)*i/steps), color);
+    }
+}
+
+void
+terminalWorldPixel(double x, double y, unsigned int color){
+    double px = (x - view->cameraX)*termWidth/view->xMax;
+    double py = (view->yMax - (y - view->cameraY))*termHeight/view->yMax;
+    
+    terminalPixel((int)floor(px), (int)floor(py), color);
+}
+
+int
+terminalPixel(int x, int y, unsigned int color){
+    if(x < 0 || y < 0 || x >= termWidth || y >= termHeight){
+        return 0;
+    }
+    termPixels[y][x] = color;
+    return 1;
+}
+
+// Text placed like drawString places it, with its baseline at (x, y) on the screen.
+void
+terminalWorldText(const char *text, double x, double y, unsigned int color){
+    int column = (int)(x*termWidth/view->xMax);
+    int row = (int)((view->yMax - y - FONT_HEIGHT*TEXT_PIXEL/2)*termHeight/view->yMax)/2;
+    
+    if(row >= 0 && row < termRows - 1){
+        terminalText(text, row, column, color);
+    }
+}
+
+void
+terminalText(const char *text, int row, int column, unsigned int color){
+    for(int i = 0; text[i] != '\0' && column + i < termColumns; i++){
+        if(column + i >= 0){
+            termOverlay[row][column + i].glyph = (unsigned char)text[i];
+            termOverlay[row][column + i].fg = color;
+        }
+    }
+}
+
+/* Turns the pixels and text into cells and writes the escape sequences for the cells that
+ * differ from what the terminal already shows. A cell of two pixels of the same colour is a
+ * space on that background, anything else is an upper half block with the top pixel as
+ * foreground. Colours are only sent when they change, and the cursor is only moved when the
+ * next changed cell isn't the one it is already on. Returns the number of bytes.
+ */
+int
+diffTerminal(char *out){
+    int length = 0, cursorRow = -1, cursorColumn = -1;
+    unsigned int fg = TERM_UNKNOWN, bg = TERM_UNKNOWN;
+    
+    if(!termCleared){
+        length = length + sprintf(out + length, "\x1b[0m\x1b[2J");
+        for(int r = 0; r < TERM_MAX_ROWS; r++){
+            for(int c = 0; c < TERM_MAX_COLUMNS; c++){
+                termShown[r][c].glyph = TERM_GLYPH_UNKNOWN;
+            }
+        }
+        termCleared = 1;
+    }
+    
+    for(int r = 0; r < termRows; r++){
+        for(int c = 0; c < termColumns; c++){
+            TermCell cell = termOverlay[r][c], *shown = &termShown[r][c];
+            int sendFg, sendBg;
+    
+            if(cell.glyph == 0 && r < termRows - 1){
+                unsigned int upper = terminalColor(termPixels[2*r][c]);
+                unsigned int lower = terminalColor(termPixels[2*r + 1][c]);
+                cell.glyph = (upper == lower) ? ' ' : TERM_GLYPH_HALF;
+                cell.fg = (upper == lower) ? 0 : upper;
+                cell.bg = lower;
+            }else if(cell.glyph == 0){
+                cell.glyph = ' ';
+                cell.fg = 0, cell.bg = 0;
+            }else{
+                cell.fg = (cell.glyph == ' ') ? 0 : terminalColor(cell.fg);
+                cell.bg = 0;
+            }
+            if(cell.glyph == shown->glyph && cell.fg == shown->fg && cell.bg == shown->bg){
+                continue;
+            }
+            *shown = cell;
+    
+            if(r != cursorRow || c != cursorColumn){
+                if(r == cursorRow && c > cursorColumn){
+                    length = length + sprintf(out + length, "\x1b[%dC", c - cursorColumn);
+                }else{
+                    length = length + sprintf(out + length, "\x1b[%d;%dH", r + 1, c + 1);
+                }
+            }
+            sendFg = cell.glyph != ' ' && cell.fg != fg;
+            sendBg = cell.bg != bg;
+            if(sendFg || sendBg){
+                length = length + sprintf(out + length, "\x1b[");
+                if(sendFg){
+                    length = length + terminalSgr(out + length, 38, cell.fg);
+                    fg = cell.fg;
+                }
+                if(sendFg && sendBg){
+                    out[length++] = ';';
+                }
+                if(sendBg){
+                    length = length + terminalSgr(out + length, 48, cell.bg);
+                    bg = cell.bg;
+                }
+                out[length++] = 'm';
+            }
+            if(cell.glyph == TERM_GLYPH_HALF){
+                length = length + sprintf(out + length, "\xe2\x96\x80");
+            }else if(cell.glyph == TERM_GLYPH_SHIP){
+                length = length + sprintf(out + length, "\xe2\x96\xb2");
+            }else{
+                out[length++] = (char)cell.glyph;
+            }
+            // Past the last column the terminal may be waiting to wrap, so start over.
+            cursorRow = r, cursorColumn = (c + 1 < termColumns) ? c + 1 : -1;
+        }
+    }
+    return length;
+}
+
+// The colour as it will be sent, a 256 colour cube index on terminals without truecolor.
+unsigned int
+terminalColor(unsigned int rgb){
+    if(termTrueColor){
+        return rgb;
+    }
+    return 16 + 36*((((rgb >> 16) & 255)*5 + 127)/255) + 6*((((rgb >> 8) & 255)*5 + 127)/255) +
+           ((rgb & 255)*5 + 127)/255;
+}
+
+int
+terminalSgr(char *out, int layer, unsigned int color){
+    if(termTrueColor){
+        return sprintf(out, "%d;2;%u;%u;%u", layer, (color >> 16) & 255, (color >> 8) & 255, color & 255);
+    }
+    return sprintf(out, "%d;5;%u", layer, color);
+}
+
+void
+termWrite(const char *bytes, int length){
+    while(length > 0){
+        ssize_t written = write(STDOUT_FILENO, bytes, length);
+        if(written <= 0){
+            return;
+        }
+        bytes = bytes + written, length = length - (int)written;
+    }
+}
+
+/* -- benchmarks ------------------------------------------------------------ */
+
+/* Runs the micro benchmarks and prints one line of results for each. These use the same
+ * code as the game but never open a window.
+ */
+void
+runBenchmarks(){
+    xMax = 166.0;
+    yMax = 100.0;
+    buildShapeLibrary();
+    
+    benchShipCollision();
+    benchWrapInstances();
+    benchGravity();
+    benchSpatialQueries();
+    benchSegmentKernels();
+    benchWorldSize();
+    benchEntities();
+    benchSwarm();
+    benchBossCollision();
+    benchScores();
+    benchTelemetry();
+    benchTerminal();
+}
+
+/* Has OpenMP share loops out to n threads, or to all of them for 0, and returns how many
+ * that is. Without OpenMP there is only ever the one.
+ */
+int
+benchThreads(int n){
+#ifdef _OPENMP
+    static int all = 0;
+    
+    if(all == 0){
+        all = omp_get_max_threads();
+    }
+    n = (n > 0) ? n : all;
+    omp_set_num_threads(n);
+    return n;
+#else
+    return 1;
+#endif
+}
+
+/* The ship test as it used to be done: one call per corner of the unrotated ship, each
+ * counting the edges of the unrotated asteroid crossed by a ray.
+ */
+static int
+benchShipCorner(Coords *c, Ship *s, Asteroid *a){
+    AsteroidShape *shape = asteroidShape(a);
+    int lines = shape->nVertices;
+    int number_intersections = 0;
+    double px1 = c->x + s->x, py1 = c->y + s->y;
+    
+    for(int i = 0; i < lines; i++){
+        double ax1 = a->x + shape->coords[i%(lines)].x;
+        double ay1 = a->y + shape->coords[i%(lines)].y;
+        double ax2 = a->x + shape->coords[(i+1)%(lines)].x;
+        double ay2 = a->y + shape->coords[(i+1)%(lines)].y;
+        if( (py1 <= ay1 && py1 >= ay2) || (py1 >= ay1 && py1 <= ay2)){
+            double x_intersect = (((py1 - ay1)/(ay2-ay1))*ax2) + (((ay2 - py1)/(ay2-ay1))*ax1);
+            if((x_intersect >= px1) && (((x_intersect <= ax1) && (x_intersect >= ax2)) || ((x_intersect >= ax1) && (x_intersect <= ax2)))){
+                number_intersections = number_intersections + 1;
+            }
+        }
+    }
+    return number_intersections % 2;
+}
+
+/* Times the separating axis ship test against the old three corner calls on random ships and
+ * asteroids placed close enough that most pairs get past the bounding circles. The pairs are
+ * then turned to random headings and the new test is checked against the plain polygon test.
+ */
+void
+benchShipCollision(){
+    enum { PAIRS = 4096, ROUNDS = 200 };
+    static Ship ships[PAIRS];
+    static Asteroid rocks[PAIRS];
+    static Coords corners[PAIRS][SHIP_VERTICES];
+    double sizes[SIZE_CLASSES] = {SMALL_SIZE, MEDIUM_SIZE, LARGE_SIZE};
+    int oldHits = 0, newHits = 0, checked = 0, mismatches = 0;
+    clock_t start;
+    double oldTime, newTime;
+    
+    gameInit();
+    for(int i = 0; i < PAIRS; i++){
+        ships[i] = ship;
+        ships[i].phi = 0.0;
+        initAsteroid(&rocks[i], ship.x + myRandom(-12, 12), ship.y + myRandom(-12, 12), sizes[i%SIZE_CLASSES]);
+        rocks[i].phi = 0.0;
+        shipVertices(&ships[i], corners[i]);
+    }
+    
+    start = clock();
+    for(int r = 0; r < ROUNDS; r++){
+        for(int i = 0; i < PAIRS; i++){
+            for(int j = 0; j < SHIP_VERTICES; j++){
+                if(benchShipCorner(&ships[i].coords[j], &ships[i], &rocks[i])){
+                    oldHits++;
+                    break;
+                }
+            }
+        }
+    }
+    oldTime = (double)(clock() - start)/CLOCKS_PER_SEC;
+    
+    start = clock();
+    for(int r = 0; r < ROUNDS; r++){
+        for(int i = 0; i < PAIRS; i++){
+            newHits = newHits + shipAsteroidOverlap(corners[i], &rocks[i]);
+        }
+    }
+    newTime = (double)(clock() - start)/CLOCKS_PER_SEC;
+    
+    for(int r = 0; r < 16; r++){
+        for(int i = 0; i < PAIRS; i++){
+            Ship turned = ships[i];
+            Asteroid rock = rocks[i];
+            AsteroidShape *shape = asteroidShape(&rock);
+            Coords world[SHIP_VERTICES], tri[SHIP_VERTICES];
+            double c, s;
+            
+            turned.phi = myRandom(0, 360);
+            rock.phi = myRandom(0, 360);
+            shipVertices(&turned, world);
+            // The ship in the frame of the asteroid's shape, where the polygon test works.
+            c = cos(DEG2RAD*rock.phi);
+            s = sin(DEG2RAD*rock.phi);
+            for(int k = 0; k < SHIP_VERTICES; k++){
+                double x = world[k].x - rock.x;
+                double y = world[k].y - rock.y;
+                tri[k].x = c*x + s*y;
+                tri[k].y = -s*x + c*y;
+            }
+            if(shipAsteroidOverlap(world, &rock) != polygonsOverlap(tri, SHIP_VERTICES, shape->coords, shape->nVertices)){
+                mismatches++;
+            }
+            checked++;
+        }
+    }
+    
+    printf("ship collision: three corner calls %.1f ns/pair (%d hits), separating axis %.1f ns/pair (%d hits), %d of %d turned pairs disagree with the polygon test (%s)\n",
+           1e9*oldTime/(PAIRS*ROUNDS), oldHits/ROUNDS, 1e9*newTime/(PAIRS*ROUNDS), newHits/ROUNDS,
+           mismatches, checked, mismatches ? "WRONG" : "right");
+}
+
+// Checks if a point lies inside an asteroid, turned and placed where it is.
+static int
+benchPointInAsteroid(Asteroid *a, double x, double y){
+    AsteroidShape *shape = asteroidShape(a);
+    double c = cos(DEG2RAD*a->phi), s = sin(DEG2RAD*a->phi);
+    double dx = x - a->x, dy = y - a->y;
+    
+    return pointInPolygon(shape->coords, shape->nVertices, c*dx + s*dy, -s*dx + c*dy);
+}
+
+/* Times rebuilding the wrap copies for a full field of asteroids spread over the playfield,
+ * and how many copies that adds on average. Then one large asteroid is put across each edge
+ * and into each corner in turn, and points around it are wrapped onto the playfield: a point
+ * has to hit one of the copies exactly when it is inside the asteroid before wrapping.
+ */
+void
+benchWrapInstances(){
+    enum { ROUNDS = 200000, POINTS = 4096 };
+    double sizes[SIZE_CLASSES] = {SMALL_SIZE, MEDIUM_SIZE, LARGE_SIZE};
+    long copies = 0;
+    clock_t start;
+    double elapsed;
+    int across = 0, mismatches = 0;
+    
+    for(int i = 0; i < MAX_ASTEROIDS; i++){
+        initAsteroid(&asteroids[i], myRandom(0, xMax), myRandom(0, yMax), sizes[i%SIZE_CLASSES]);
+    }
+    
+    start = clock();
+    for(int r = 0; r < ROUNDS; r++){
+        for(int i = 0; i < MAX_ASTEROIDS; i++){
+            asteroids[i].x = asteroids[i].x + asteroids[i].dx;
+            asteroids[i].y = asteroids[i].y + asteroids[i].dy;
+            wrapPosition(&asteroids[i].x, &asteroids[i].y);
+        }
+        buildInstances();
+        copies = copies + nAsteroidInstances - MAX_ASTEROIDS;
+    }
+    elapsed = (double)(clock() - start)/CLOCKS_PER_SEC;
+    
+    // Left, middle and right against bottom, middle and top, skipping the middle of the field.
+    for(int place = 0; place < 9; place++){
+        Asteroid *a = &asteroids[0];
+        Scalar px, py;
+        double r;
+        
+        if(place == 4){
+            continue;
+        }
+        for(int i = 1; i < MAX_ASTEROIDS; i++){
+            asteroids[i].active = 0;
+        }
+        initAsteroid(a, 0, 0, LARGE_SIZE);
+        r = asteroidShape(a)->radius;
+        a->x = (place%3 == 0) ? r/2 : (place%3 == 1) ? xMax/2 : xMax - r/2;
+        a->y = (place/3 == 0) ? r/2 : (place/3 == 1) ? yMax/2 : yMax - r/2;
+        a->phi = myRandom(0, 360);
+        buildInstances();
+        
+        for(int k = 0; k < POINTS; k++){
+            int inside, hit = 0;
+            px = a->x + myRandom(-r, r);
+            py = a->y + myRandom(-r, r);
+            inside = benchPointInAsteroid(a, px, py);
+            if(px < 0 || px > xMax || py < 0 || py > yMax){
+                across = across + inside;
+                wrapPosition(&px, &py);
+            }
+            for(int j = 0; j < nAsteroidInstances; j++){
+                hit = hit || benchPointInAsteroid(&asteroidInstances[j].body, px, py);
+            }
+            mismatches = mismatches + (hit != inside);
+        }
+    }
+    
+    printf("wrap copies: %.1f ns per tick for %d asteroids, %.2f extra copies per tick, %d hits across the edges and corners with %d mismatches (%s)\n",
+           1e9*elapsed/ROUNDS, MAX_ASTEROIDS, (double)copies/ROUNDS, across, mismatches, mismatches ? "WRONG" : "right");
+}
+
+/* Times one tick of Barnes-Hut gravity, building the tree and finding the pull on every
+ * body, for a field of 50000 bodies. The tick is timed on the wall clock, which is what
+ * counts for keeping up at 60 Hz, on one thread and on all of them. The direct sum over all
+ * pairs is timed on a sample of the bodies and scaled up, which is also used to measure how
+ * far off the tree is.
+ */
+void
+benchGravity(){
+    enum { BODIES = 50000, SAMPLE = 500, ROUNDS = 10 };
+    static double treeX[BODIES], treeY[BODIES];
+    double error = 0.0, directTime, buildTime = 0.0, treeTime[2], start, built;
+    int threads[2] = {1, benchThreads(0)}, root = 0;
+    long overflow = counters->value[COUNT_GRAVITY_OVERFLOW];
+    
+    for(int i = 0; i < BODIES; i++){
+        gravityBodies[i].x = myRandom(0, 1000);
+        gravityBodies[i].y = myRandom(0, 1000);
+        gravityBodies[i].mass = myRandom(1, 50);
+    }
+    
+    // Only the force calculation is spread over the threads, the build is the same both times.
+    for(int run = 0; run < 2; run++){
+        benchThreads(threads[run]);
+        start = monotonicSeconds();
+        for(int r = 0; r < ROUNDS; r++){
+            built = monotonicSeconds();
+            root = buildGravityTree(gravityBodies, BODIES);
+            buildTime = buildTime + (monotonicSeconds() - built);
+            gravityAll(root, treeX, treeY);
+        }
+        treeTime[run] = (monotonicSeconds() - start)/ROUNDS;
+    }
+    benchThreads(0);
+    overflow = counters->value[COUNT_GRAVITY_OVERFLOW] - overflow;
+    
+    start = monotonicSeconds();
+    for(int s = 0; s < SAMPLE; s++){
+        int i = s*(BODIES/SAMPLE);
+        double ax = 0.0, ay = 0.0, fx, fy;
+        for(int j = 0; j < BODIES; j++){
+            double dx = gravityBodies[j].x - gravityBodies[i].x;
+            double dy = gravityBodies[j].y - gravityBodies[i].y;
+            double r2 = dx*dx + dy*dy + GRAVITY_SOFTENING*GRAVITY_SOFTENING;
+            double f = GRAVITY_CONSTANT*gravityBodies[j].mass/(r2*sqrt(r2));
+            ax = ax + f*dx;
+            ay = ay + f*dy;
+        }
+        fx = treeX[i] - ax;
+        fy = treeY[i] - ay;
+        error = error + sqrt((fx*fx + fy*fy)/(ax*ax + ay*ay));
+    }
+    directTime = (monotonicSeconds() - start)*BODIES/SAMPLE;
+    
+    printf("gravity: %d bodies, Barnes-Hut (theta %.1f) %.1f ms a tick on 1 thread (%s), %.1f ms on %d (%s), %.1f ms of each building %d nodes (%ld left as leaves when the pool ran out), direct sum %.0f ms a tick on 1 thread, mean force error %.2f%%\n",
+           BODIES, gravityTheta, 1e3*treeTime[0], (treeTime[0] > 1.0/60) ? "OVER a 60 Hz tick" : "within a 60 Hz tick",
+           1e3*treeTime[1], threads[1], (treeTime[1] > 1.0/60) ? "OVER a 60 Hz tick" : "within a 60 Hz tick",
+           1e3*buildTime/(2*ROUNDS), gravityNodesUsed, overflow/(2*ROUNDS), 1e3*directTime, 100*error/SAMPLE);
+}
+
+/* Times the spatial queries on the wrapping playfield with the slots of a classic game, and
+ * in the open world with all of them, where raycasts walk the tree.
+ */
+void
+benchSpatialQueries(){
+    benchSpatialField();
+    gameMode = MODE_WORLD, gameState = 1;
+    benchSpatialField();
+    gameMode = MODE_CLASSIC, gameState = 0;
+    for(int i = MAX_ASTEROIDS; i < MAX_WORLD_ASTEROIDS; i++){
+        asteroids[i].active = 0;
+    }
+}
+
+/* Times the spatial queries against scanning every asteroid, and checks they agree. The
+ * asteroids move a tick between batches of queries so the tree is refit as it would be in
+ * a game, and a ray is only compared when it stays on the playfield, as the scan doesn't wrap.
+ */
+void
+benchSpatialField(){
+    enum { TICKS = 200, QUERIES = 100, K = 4 };
+    double sizes[SIZE_CLASSES] = {SMALL_SIZE, MEDIUM_SIZE, LARGE_SIZE};
+    static double rayX[QUERIES], rayY[QUERIES], rayDX[QUERIES], rayDY[QUERIES];
+    static SpatialHit treeHits[QUERIES], near[QUERIES][K];
+    static int treeFound[QUERIES], scanIndex[QUERIES], nearFound[QUERIES];
+    static double scanBest[QUERIES], scanNear[QUERIES][K];
+    double treeTime = 0.0, scanTime = 0.0, nearTreeTime = 0.0, nearScanTime = 0.0, refitTime;
+    int mismatches = 0, hits = 0;
+    // The copies of asteroids over the edges are stored rounded to a Scalar, which shows in the hits.
+    double tolerance = (sizeof(Scalar) < sizeof(double)) ? 1e-4 : 1e-6;
+    clock_t start;
+    
+    for(int i = 0; i < ASTEROID_SLOTS; i++){
+        initAsteroid(&asteroids[i], myRandom(0, xMax), myRandom(0, yMax), sizes[i%SIZE_CLASSES]);
+    }
+    spatialBuilt = 0;
+    
+    // Moving everything and refitting, including building again whenever the boxes get loose.
+    start = clock();
+    for(int r = 0; r < 100*TICKS; r++){
+        for(int i = 0; i < ASTEROID_SLOTS; i++){
+            asteroids[i].x = asteroids[i].x + asteroids[i].dx;
+            asteroids[i].y = asteroids[i].y + asteroids[i].dy;
+            wrapPosition(&asteroids[i].x, &asteroids[i].y);
+        }
+        refitSpatialTree();
+    }
+    refitTime = (double)(clock() - start)/CLOCKS_PER_SEC/(100*TICKS);
+    
+    // The open world doesn't wrap, so that has carried them all off the field.
+    for(int i = 0; i < ASTEROID_SLOTS; i++){
+        asteroids[i].x = myRandom(0, xMax), asteroids[i].y = myRandom(0, yMax);
+    }
+    spatialBuilt = 0;
+    
+    for(int r = 0; r < TICKS; r++){
+        for(int i = 0; i < ASTEROID_SLOTS; i++){
+            asteroids[i].x = asteroids[i].x + asteroids[i].dx;
+            asteroids[i].y = asteroids[i].y + asteroids[i].dy;
+            wrapPosition(&asteroids[i].x, &asteroids[i].y);
+        }
+        refitSpatialTree();
+        buildInstances();
+        for(int q = 0; q < QUERIES; q++){
+            double phi = myRandom(0, 2*M_PI);
+            rayX[q] = myRandom(0, xMax), rayY[q] = myRandom(0, yMax);
+            rayDX[q] = 60.0*cos(phi), rayDY[q] = 60.0*sin(phi);
+        }
+        
+        start = clock();
+        for(int q = 0; q < QUERIES; q++){
+            treeFound[q] = raycastAsteroids(rayX[q], rayY[q], rayDX[q], rayDY[q], 60.0, &treeHits[q]);
+        }
+        treeTime = treeTime + (double)(clock() - start)/CLOCKS_PER_SEC;
+        
+        // The old way: every copy of every asteroid against the whole segment.
+        start = clock();
+        for(int q = 0; q < QUERIES; q++){
+            scanBest[q] = -1, scanIndex[q] = -1;
+            for(int j = 0; j < nAsteroidInstances; j++){
+                double t = segmentAsteroid(&asteroidInstances[j].body, rayX[q], rayY[q],
+                                           rayX[q] + rayDX[q], rayY[q] + rayDY[q]);
+                if(t >= 0 && (scanBest[q] < 0 || t < scanBest[q])){
+                    scanBest[q] = t;
+                    scanIndex[q] = asteroidInstances[j].index;
+                }
+            }
+        }
+        scanTime = scanTime + (double)(clock() - start)/CLOCKS_PER_SEC;
+        
+        start = clock();
+        for(int q = 0; q < QUERIES; q++){
+            nearFound[q] = nearestAsteroids(rayX[q], rayY[q], K, near[q]);
+        }
+        nearTreeTime = nearTreeTime + (double)(clock() - start)/CLOCKS_PER_SEC;
+        
+        start = clock();
+        for(int q = 0; q < QUERIES; q++){
+            for(int k = 0; k < K; k++){
+                scanNear[q][k] = HUGE_VAL;
+            }
+            for(int i = 0; i < ASTEROID_SLOTS; i++){
+                double dx = spatialWrapDelta(asteroids[i].x - rayX[q], xMax);
+                double dy = spatialWrapDelta(asteroids[i].y - rayY[q], yMax);
+                double d = sqrt(dx*dx + dy*dy);
+                int j = K - 1;
+                if(d >= scanNear[q][j]){
+                    continue;
+                }
+                while(j > 0 && scanNear[q][j-1] > d){
+                    scanNear[q][j] = scanNear[q][j-1];
+                    j--;
+                }
+                scanNear[q][j] = d;
+            }
+        }
+        nearScanTime = nearScanTime + (double)(clock() - start)/CLOCKS_PER_SEC;
+        
+        for(int q = 0; q < QUERIES; q++){
+            double endX = rayX[q] + rayDX[q], endY = rayY[q] + rayDY[q];
+            hits = hits + treeFound[q];
+            if(endX >= 0 && endX <= xMax && endY >= 0 && endY <= yMax &&
+               (treeFound[q] != (scanIndex[q] >= 0) ||
+                (treeFound[q] && fabs(treeHits[q].distance - 60.0*scanBest[q]) > tolerance))){
+                mismatches++;
+            }
+            for(int k = 0; k < nearFound[q]; k++){
+                if(fabs(near[q][k].distance - scanNear[q][k]) > 1e-9){
+                    mismatches++;
+                    break;
+                }
+            }
+        }
+        
+        // Everything the radius query finds is also somewhere in the nearest list.
+        for(int q = 0; q < QUERIES; q++){
+            SpatialHit inRadius[MAX_WORLD_ASTEROIDS];
+            int count = asteroidsInRadius(rayX[q], rayY[q], 0.0, inRadius, MAX_WORLD_ASTEROIDS);
+            for(int k = 0; k < count; k++){
+                if(nearFound[q] == K && inRadius[k].distance - asteroidShape(&asteroids[inRadius[k].index])->radius > scanNear[q][K-1]){
+                    mismatches++;
+                }
+            }
+        }
+    }
+    
+    printf("spatial queries: %d asteroids, raycast %.0f ns (scan %.0f ns), %d nearest %.0f ns (scan %.0f ns), move and refit %.0f ns/tick, %d hits, %d mismatches\n",
+           ASTEROID_SLOTS, 1e9*treeTime/(TICKS*QUERIES), 1e9*scanTime/(TICKS*QUERIES), K,
+           1e9*nearTreeTime/(TICKS*QUERIES), 1e9*nearScanTime/(TICKS*QUERIES), 1e9*refitTime, hits, mismatches);
+}
+
+/* Times the segment test against shapes of every vertex count the library makes: the loop
+ * over the edges as it was, the branch free loop with the count only known when it runs, and
+ * the unrolled copy for that count. Then it times a mix of
+ * all of them, once in random order and once grouped by vertex count so that each copy runs
+ * back to back.
+ */
+void
+benchSegmentKernels(){
+    enum { SHAPES = 8, SEGMENTS = 4096, ROUNDS = 100, COUNTS = MAX_VERTICES - 6 };
+    static AsteroidShape shapes[COUNTS][SHAPES];
+    static double segments[SEGMENTS][4];
+    static AsteroidShape *mixed[COUNTS*SHAPES], *grouped[COUNTS*SHAPES];
+    Coords coords[MAX_VERTICES];
+    double generic[COUNTS], branchless[COUNTS], unrolled[COUNTS], loopTime, mixedTime, groupedTime, sum = 0.0;
+    volatile double sink;
+    int mismatches = 0;
+    clock_t start;
+    
+    for(int c = 0; c < COUNTS; c++){
+        int n = c + 6;
+        for(int k = 0; k < SHAPES; k++){
+            for(int v = 0; v < n; v++){
+                double theta = 2.0*M_PI*v/n;
+                double r = MEDIUM_SIZE*myRandom(2.0, 3.0);
+                coords[v].x = -r*sin(theta);
+                coords[v].y = r*cos(theta);
+            }
+            buildShape(&shapes[c][k], MEDIUM_SIZE, n, coords);
+            mixed[c*SHAPES + k] = grouped[c*SHAPES + k] = &shapes[c][k];
+        }
+    }
+    // Photon sized steps that start somewhere around the shapes.
+    for(int i = 0; i < SEGMENTS; i++){
+        double phi = myRandom(0, 2*M_PI);
+        segments[i][0] = myRandom(-9, 9), segments[i][1] = myRandom(-9, 9);
+        segments[i][2] = segments[i][0] + 5*cos(phi), segments[i][3] = segments[i][1] + 5*sin(phi);
+    }
+    for(int i = COUNTS*SHAPES - 1; i > 0; i--){
+        int j = rand()%(i + 1);
+        AsteroidShape *swap = mixed[i];
+        mixed[i] = mixed[j], mixed[j] = swap;
+    }
+    
+    for(int c = 0; c < COUNTS; c++){
+        start = clock();
+        for(int r = 0; r < ROUNDS; r++){
+            for(int i = 0; i < SEGMENTS; i++){
+                double *g = segments[i];
+                sum = sum + segmentPolygon(shapes[c][i%SHAPES].coords, c + 6, g[0], g[1], g[2], g[3]);
+            }
+        }
+        generic[c] = (double)(clock() - start)/CLOCKS_PER_SEC;
+        
+        start = clock();
+        for(int r = 0; r < ROUNDS; r++){
+            for(int i = 0; i < SEGMENTS; i++){
+                double *g = segments[i];
+                sum = sum + segmentShape(&shapes[c][i%SHAPES], g[0], g[1], g[2], g[3]);
+            }
+        }
+        branchless[c] = (double)(clock() - start)/CLOCKS_PER_SEC;
+        
+        start = clock();
+        for(int r = 0; r < ROUNDS; r++){
+            for(int i = 0; i < SEGMENTS; i++){
+                AsteroidShape *shape = &shapes[c][i%SHAPES];
+                double *g = segments[i];
+                sum = sum + shape->segment(shape, g[0], g[1], g[2], g[3]);
+            }
+        }
+        unrolled[c] = (double)(clock() - start)/CLOCKS_PER_SEC;
+        
+        for(int i = 0; i < SEGMENTS; i++){
+            AsteroidShape *shape = &shapes[c][i%SHAPES];
+            double *g = segments[i];
+            if(segmentPolygon(shape->coords, c + 6, g[0], g[1], g[2], g[3]) != shape->segment(shape, g[0], g[1], g[2], g[3])){
+                mismatches++;
+            }
+        }
+    }
+    
+    start = clock();
+    for(int r = 0; r < ROUNDS; r++){
+        for(int i = 0; i < SEGMENTS; i++){
+            AsteroidShape *shape = mixed[i%(COUNTS*SHAPES)];
+            double *g = segments[i];
+            sum = sum + segmentPolygon(shape->coords, shape->nVertices, g[0], g[1], g[2], g[3]);
+        }
+    }
+    loopTime = (double)(clock() - start)/CLOCKS_PER_SEC;
+    start = clock();
+    for(int r = 0; r < ROUNDS; r++){
+        for(int i = 0; i < SEGMENTS; i++){
+            AsteroidShape *shape = mixed[i%(COUNTS*SHAPES)];
+            double *g = segments[i];
+            sum = sum + shape->segment(shape, g[0], g[1], g[2], g[3]);
+        }
+    }
+    mixedTime = (double)(clock() - start)/CLOCKS_PER_SEC;
+    start = clock();
+    for(int r = 0; r < ROUNDS; r++){
+        for(int i = 0; i < SEGMENTS; i++){
+            AsteroidShape *shape = grouped[i%(COUNTS*SHAPES)];
+            double *g = segments[i];
+            sum = sum + shape->segment(shape, g[0], g[1], g[2], g[3]);
+        }
+    }
+    groupedTime = (double)(clock() - start)/CLOCKS_PER_SEC;
+    sink = sum;
+    (void)sink;
+    
+    printf("segment kernels: ns/call by vertex count, old loop/branch free loop/unrolled:");
+    for(int c = 0; c < COUNTS; c++){
+        printf(" %d: %.0f/%.0f/%.0f", c + 6, 1e9*generic[c]/(SEGMENTS*ROUNDS),
+               1e9*branchless[c]/(SEGMENTS*ROUNDS), 1e9*unrolled[c]/(SEGMENTS*ROUNDS));
+    }
+    printf("\nsegment kernels: mixed shapes %.1f ns/call with the loop, unrolled %.1f ns/call in random order and %.1f ns/call grouped by vertex count, %d mismatches\n",
+           1e9*loopTime/(SEGMENTS*ROUNDS), 1e9*mixedTime/(SEGMENTS*ROUNDS), 1e9*groupedTime/(SEGMENTS*ROUNDS), mismatches);
+}
+
+/* Adds up the memory one world of the game takes: everything a tick reads and writes, but
+ * not the shape library, which never changes and could be shared between any number of
+ * worlds. The open world adds its sector table on top. Also works out how many worlds fit in
+ * the L2 cache of this machine, taken to be 1 MB if it can't be found out.
+ */
+void
+benchWorldSize(){
+    size_t bytes = sizeof(asteroids) + MAX_PHOTONS*(sizeof(Position) + sizeof(Velocity) + sizeof(Entity)) +
+                   sizeof(ship) + MAX_DUST*(sizeof(Cloud) + 2*sizeof(int) + sizeof(Entity)) +
+                   sizeof(shipExplosion) + MAX_WORLD_ASTEROIDS*sizeof(AsteroidShape) +
+                   sizeof(fractureArena) + sizeof(asteroidInstances) + sizeof(shipInstances) +
+                   sizeof(spatialNodes);
+    long cache = 1 << 20;
+    
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    if(sysconf(_SC_LEVEL2_CACHE_SIZE) > 0){
+        cache = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+#endif
+    printf("world size: %s layout, %zu bytes per world (asteroids %zu, fracture shapes %zu, copies %zu, spatial tree %zu), %.1f worlds per %ld KB of L2, open world adds %zu bytes of sectors\n",
+           (sizeof(Scalar) < sizeof(double)) ? "compact" : "double", bytes, sizeof(asteroids),
+           MAX_WORLD_ASTEROIDS*sizeof(AsteroidShape), sizeof(asteroidInstances), sizeof(spatialNodes),
+           (double)cache/bytes, cache/1024, sizeof(sectorTable));
+}
+
+/* Moving entities through the systems against the same loop written by hand over plain
+ * arrays, once with one array per coordinate and once with the same position and velocity
+ * structs the chunks hold. Also times spawning and removing them through the command queue.
+ */
+void
+benchEntities(){
+    enum { ENTITIES = 8192, ROUNDS = 2000 };
+    static Scalar x[ENTITIES], y[ENTITIES], dx[ENTITIES], dy[ENTITIES];
+    static Position positions[ENTITIES];
+    static Velocity velocities[ENTITIES];
+    static Entity spawned[ENTITIES];
+    double arraysTime, structsTime, systemTime, spawnTime, destroyTime, sum = 0.0;
+    ChunkView views[ECS_CHUNKS];
+    volatile double sink;
+    int n;
+    clock_t start;
+    
+    for(int i = 0; i < ENTITIES; i++){
+        x[i] = positions[i].x = myRandom(0, xMax);
+        y[i] = positions[i].y = myRandom(0, yMax);
+        dx[i] = velocities[i].dx = myRandom(-1, 1);
+        dy[i] = velocities[i].dy = myRandom(-1, 1);
+    }
+    
+    start = clock();
+    for(int i = 0; i < ENTITIES; i++){
+        spawned[i] = spawnEntity(HAS(COMP_POSITION) | HAS(COMP_VELOCITY));
+        initEntity(spawned[i], x[i], y[i], dx[i], dy[i]);
+    }
+    spawnTime = (double)(clock() - start)/CLOCKS_PER_SEC;
+    
+    start = clock();
+    for(int r = 0; r < ROUNDS; r++){
+        for(int i = 0; i < ENTITIES; i++){
+            x[i] = x[i] + dx[i];
+            y[i] = y[i] + dy[i];
+        }
+    }
+    arraysTime = (double)(clock() - start)/CLOCKS_PER_SEC;
+    
+    start = clock();
+    for(int r = 0; r < ROUNDS; r++){
+        for(int i = 0; i < ENTITIES; i++){
+            positions[i].x = positions[i].x + velocities[i].dx;
+            positions[i].y = positions[i].y + velocities[i].dy;
+        }
+    }
+    structsTime = (double)(clock() - start)/CLOCKS_PER_SEC;
+    
+    start = clock();
+    for(int r = 0; r < ROUNDS; r++){
+        movementSystem();
+    }
+    systemTime = (double)(clock() - start)/CLOCKS_PER_SEC;
+    
+    n = queryChunks(HAS(COMP_POSITION) | HAS(COMP_VELOCITY), views);
+    for(int c = 0; c < n; c++){
+        Position *position = chunkColumn(&views[c], Position, COMP_POSITION);
+        for(int i = 0; i < views[c].count; i++){
+            sum = sum + position[i].x + position[i].y;
+        }
+    }
+    for(int i = 0; i < ENTITIES; i++){
+        sum = sum - x[i] - y[i] + positions[i].x + positions[i].y;
+    }
+    sink = sum;
+    (void)sink;
+    
+    // Remove them in random order, queued up like the systems do, then flushed.
+    for(int i = ENTITIES - 1; i > 0; i--){
+        int j = rand()%(i + 1);
+        Entity swap = spawned[i];
+        spawned[i] = spawned[j], spawned[j] = swap;
+    }
+    start = clock();
+    for(int i = 0; i < ENTITIES; i += ECS_COMMANDS){
+        for(int k = i; k < i + ECS_COMMANDS && k < ENTITIES; k++){
+            queueCommand(COMMAND_DESTROY, spawned[k], 0, 0, 0, 0, 0, 0);
+        }
+        flushCommands();
+    }
+    destroyTime = (double)(clock() - start)/CLOCKS_PER_SEC;
+    
+    printf("entities: moving %d, %.2f ns/entity with separate arrays, %.2f with position and velocity arrays, %.2f through the movement system in %d chunks; spawn %.1f ns, queued removal %.1f ns, %d left\n",
+           ENTITIES, 1e9*arraysTime/((double)ENTITIES*ROUNDS), 1e9*structsTime/((double)ENTITIES*ROUNDS),
+           1e9*systemTime/((double)ENTITIES*ROUNDS), n, 1e9*spawnTime/ENTITIES, 1e9*destroyTime/ENTITIES,
+           countEntities(HAS(COMP_POSITION)));
+}
+
+/* A game of the autopilot drawn into a 120 by 40 terminal every frame, counting the bytes
+ * of the changed cells against those of drawing every cell again, and the time both take.
+ */
+void
+benchTerminal(){
+    enum { TICKS = 3000 };
+    long diffBytes = 0, fullBytes = 0, worst = 0;
+    double rasterTime = 0.0, diffTime = 0.0;
+    int frames = 0;
+    clock_t start;
+    
+    headless = 1;
+    termTrueColor = 1;
+    termColumns = 120, termRows = 40;
+    termWidth = termColumns, termHeight = 2*(termRows - 1);
+    resizePlayfield(termWidth, termHeight);
+    menuInit();
+    gameState = 1;
+    worldSeed = (unsigned int)rand();
+    startGame();
+    autopilot = 1;
+    
+    for(int t = 0; t < TICKS && pendingTimer != NULL && gameState > 0; t = t + pendingTicks){
+        int bytes;
+        runTick(pendingValue);
+        if(!redrawWanted){
+            continue;
+        }
+        redrawWanted = 0;
+        publishFrame();
+        acquireFrame();
+    
+        start = clock();
+        rasterTerminal();
+        rasterTime = rasterTime + (double)(clock() - start)/CLOCKS_PER_SEC;
+        start = clock();
+        bytes = diffTerminal(termOut);
+        diffTime = diffTime + (double)(clock() - start)/CLOCKS_PER_SEC;
+        diffBytes = diffBytes + bytes;
+        worst = (bytes > worst) ? bytes : worst;
+    
+        // The same frame again from a cleared screen, as a terminal without the diff would get it.
+        termCleared = 0;
+        fullBytes = fullBytes + diffTerminal(termOut);
+        frames = frames + 1;
+    }
+    pendingTimer = NULL;
+    
+    printf("terminal: %d frames at %dx%d cells, %.0f bytes/frame changed cells (%ld worst) against %.0f redrawing all, %.1f KB/s at 60 fps, %.1f us raster, %.1f us diff\n",
+           frames, termColumns, termRows, (double)diffBytes/frames, worst, (double)fullBytes/frames,
+           60.0*diffBytes/frames/1024, 1e6*rasterTime/frames, 1e6*diffTime/frames);
+}
+
+/* The swarm mode with 5000 enemy ships around a ship they can't hit, among the asteroids of
+ * level 4. The ships lost to the asteroids are made up for after every tick, so every tick
+ * has the whole swarm. Times the ticks of the game on the wall clock, which is what counts
+ * for keeping up at 60 Hz, on one thread and on all of them, and the batched ship physics on
+ * its own.
+ */
+void
+benchSwarm(){
+    enum { SHIPS = 5000, TICKS = 300, ROUNDS = 2000 };
+    static Velocity velocity[SHIPS], desire[SHIPS];
+    static Heading heading[SHIPS];
+    double tickTime[2], physicsTime, start;
+    int threads[2] = {1, benchThreads(0)}, lost = 0;
+    
+    gameMode = MODE_SWARM;
+    gameState = 0;
+    
+    // Both runs start from the same asteroids and ships.
+    for(int run = 0; run < 2; run++){
+        srand(1);
+        benchThreads(threads[run]);
+        initShip();
+        for(int i = 0; i < MAX_WORLD_ASTEROIDS; i++){
+            asteroids[i].active = 0;
+        }
+        spawnLevel(4);
+        buildInstances();
+        spawnSwarm(SHIPS);
+        tickTime[run] = 0.0;
+        for(int t = 0; t < TICKS; t++){
+            int left;
+            start = monotonicSeconds();
+            stepGame();
+            tickTime[run] = tickTime[run] + (monotonicSeconds() - start);
+            left = countEntities(ARCH_ENEMY);
+            lost = lost + (SHIPS - left);
+            addEnemies(SHIPS - left);
+        }
+    }
+    benchThreads(0);
+    
+    for(int i = 0; i < SHIPS; i++){
+        double angle = myRandom(0.0, 2.0*M_PI);
+        heading[i].hx = (Scalar)cos(angle), heading[i].hy = (Scalar)sin(angle);
+        desire[i].dx = (Scalar)myRandom(-1, 1), desire[i].dy = (Scalar)myRandom(-1, 1);
+    }
+    start = monotonicSeconds();
+    for(int r = 0; r < ROUNDS; r++){
+        steerShips(velocity, heading, desire, SHIPS, ENEMY_THRUST, ENEMY_VELOCITY_MAX,
+                   cos(DEG2RAD*ENEMY_TURN), sin(DEG2RAD*ENEMY_TURN));
+    }
+    physicsTime = monotonicSeconds() - start;
+    
+    printf("swarm: %d ships (%.1f lost and made up a tick), %.2f ms a game tick on 1 thread (%s), %.2f ms on %d (%s), %.1f ns a ship for the batched physics\n",
+           SHIPS, (double)lost/(2*TICKS), 1e3*tickTime[0]/TICKS, (tickTime[0]/TICKS > 1.0/60) ? "OVER a 60 Hz tick" : "within a 60 Hz tick",
+           1e3*tickTime[1]/TICKS, threads[1], (tickTime[1]/TICKS > 1.0/60) ? "OVER a 60 Hz tick" : "within a 60 Hz tick",
+           1e9*physicsTime/((double)SHIPS*ROUNDS));
+    clearEntities(ARCH_ENEMY);
+    gameMode = MODE_CLASSIC;
+}
+
+/* A photon's test against boss outlines of 16, 256 and 4096 vertices: the even-odd loop and
+ * the edge loop that PhotonCollision comes down to for an outline that isn't star shaped,
+ * against the same two tests over the edge tree. Every step has to come out the same both
+ * ways.
+ */
+void
+benchBossCollision(){
+    enum { SEGMENTS = 4096, SIZES = 3 };
+    static BossShape shape;
+    static double segments[SEGMENTS][4];
+    int sizes[SIZES] = {16, 256, 4096};
+    unsigned int state = 1;
+    volatile double sink;
+    
+    for(int i = 0; i < SEGMENTS; i++){
+        double phi = myRandom(0, 2*M_PI);
+        segments[i][0] = myRandom(-1.2*BOSS_RADIUS, 1.2*BOSS_RADIUS);
+        segments[i][1] = myRandom(-1.2*BOSS_RADIUS, 1.2*BOSS_RADIUS);
+        segments[i][2] = segments[i][0] + 5*cos(phi), segments[i][3] = segments[i][1] + 5*sin(phi);
+    }
+    for(int k = 0; k < SIZES; k++){
+        int n = sizes[k], rounds = 1 + 4096/n, hits = 0, mismatches = 0;
+        double loopTime, treeTime, sum = 0.0;
+        clock_t start;
+        
+        makeBossShape(&shape, n, BOSS_RADIUS, &state);
+        start = clock();
+        for(int r = 0; r < rounds; r++){
+            for(int i = 0; i < SEGMENTS; i++){
+                double *g = segments[i];
+                sum = sum + (pointInPolygon(shape.coords, n, g[0], g[1]) ? 0.0 :
+                             segmentPolygon(shape.coords, n, g[0], g[1], g[2], g[3]));
+            }
+        }
+        loopTime = (double)(clock() - start)/CLOCKS_PER_SEC;
+        
+        start = clock();
+        for(int r = 0; r < rounds; r++){
+            for(int i = 0; i < SEGMENTS; i++){
+                double *g = segments[i];
+                sum = sum + (pointInBoss(&shape, g[0], g[1]) ? 0.0 : segmentBoss(&shape, g[0], g[1], g[2], g[3]));
+            }
+        }
+        treeTime = (double)(clock() - start)/CLOCKS_PER_SEC;
+        sink = sum;
+        
+        for(int i = 0; i < SEGMENTS; i++){
+            double *g = segments[i];
+            double loop = pointInPolygon(shape.coords, n, g[0], g[1]) ? 0.0 :
+                          segmentPolygon(shape.coords, n, g[0], g[1], g[2], g[3]);
+            double tree = pointInBoss(&shape, g[0], g[1]) ? 0.0 : segmentBoss(&shape, g[0], g[1], g[2], g[3]);
+            hits = hits + (loop >= 0);
+            mismatches = mismatches + (loop != tree);
+        }
+        printf("boss: %d vertices, %.0f ns a photon with the edge tree against %.0f ns with the even-odd loop (%d of %d hit, %d mismatches)\n",
+               n, 1e9*treeTime/((double)rounds*SEGMENTS), 1e9*loopTime/((double)rounds*SEGMENTS), hits, SEGMENTS, mismatches);
+    }
+    (void)sink;
+}
+
+/* Records a hundred thousand runs into a score log in a temporary file and opens it again,
+ * which is all a start up has to do, checking the leaderboard that comes back against one
+ * worked out from every run. Then it plays out two crashes, one with a run torn half way
+ * through being written after the last commit and one with the newest header torn, and
+ * checks that the log comes back with everything before the tear and nothing after it.
+ */
+void
+benchScores(){
+    enum { RUNS = 100000, TAIL = 100, TORN = 40 };
+    char path[] = "/tmp/asteroids-scores-XXXXXX";
+    int fd = mkstemp(path), best[SCORE_TOP], nBest = 0, topOk, tornOk, staleOk, headerOk;
+    long kept, torn, commits;
+    double start, recordTime, openTime;
+    RunRecord run;
+    
+    if(fd < 0){
+        fprintf(stderr, "scores: can't make a temporary file for the benchmark\n");
+        return;
+    }
+    close(fd);
+    if(!openScores(path)){
+        unlink(path);
+        return;
+    }
+    memset(&run, 0, sizeof(run));
+    start = monotonicSeconds();
+    for(int i = 0; i < RUNS; i++){
+        int k;
+        run.score = rand()%100000, run.level = 1 + i%8;
+        recordRun(&run);
+        // The leaderboard the log should come back with, worked out on the side.
+        for(k = (nBest < SCORE_TOP) ? nBest++ : SCORE_TOP; k > 0 && best[k - 1] < run.score; k--){
+            if(k < SCORE_TOP){
+                best[k] = best[k - 1];
+            }
+        }
+        if(k < SCORE_TOP){
+            best[k] = run.score;
+        }
+    }
+    recordTime = monotonicSeconds() - start;
+    commits = scoreCommits;
+    closeScores();
+    
+    start = monotonicSeconds();
+    openScores(path);
+    openTime = monotonicSeconds() - start;
+    topOk = scoreCount == RUNS && scoreBoard.nTop == SCORE_TOP;
+    for(int i = 0; i < SCORE_TOP && topOk; i++){
+        topOk = scoreBoard.top[i].score == best[i];
+    }
+    
+    // Runs that beat everything so far, never committed, and one of them only half written.
+    scoreGroupSeconds = 1e9;
+    for(int i = 0; i < TAIL; i++){
+        run.score = 1000000 + i;
+        recordRun(&run);
+    }
+    memset((unsigned char *)scoreRecord(RUNS + TORN) + 20, 0xff, 20);
+    dropScores();
+    openScores(path);
+    torn = scoreCount - RUNS;
+    tornOk = torn == TORN && scoreBoard.top[0].score == 1000000 + TORN - 1;
+    // The runs that were past the torn one mustn't come back behind one written after it.
+    run.score = 5;
+    recordRun(&run);
+    dropScores();
+    openScores(path);
+    staleOk = scoreCount == RUNS + TORN + 1;
+    
+    // The newest header torn, so the one before it has to do and the runs after it are taken back.
+    kept = scoreCount;
+    ((ScoreHeader *)(scoreMap + (scoreBoard.sequence%2)*SCORE_SLOT_BYTES))->checksum ^= 1;
+    dropScores();
+    openScores(path);
+    headerOk = scoreCount == kept && scoreBoard.top[0].score == 1000000 + TORN - 1;
+    
+    closeScores();
+    unlink(path);
+    scoreGroupSeconds = SCORE_GROUP_SECONDS;
+    printf("scores: %d runs recorded at %.0f a second in %ld commits, leaderboard read back in %.1f us (%s), "
+           "torn run: %ld of %d kept (%s, %s after it), torn header: %s\n",
+           RUNS, RUNS/recordTime, commits, 1e6*openTime, topOk ? "right" : "WRONG",
+           torn, TAIL, tornOk ? "right" : "WRONG", staleOk ? "nothing" : "STALE RUNS",
+           headerOk ? "recovered" : "NOT RECOVERED");
+}
+
+// One thread of the telemetry benchmark, recording events all over the screen into its block.
+static void *
+benchTelemetryThread(void *arg){
+    unsigned int state = (unsigned int)(size_t)arg;
+    
+    telemetry = arg;
+    for(int i = 0; i < TELEMETRY_BENCH_EVENTS; i++){
+        state = state*1664525u + 1013904223u;
+        recordEvent(i%TELEMETRY_KINDS, (state >> 16)%166, (state >> 8)%100);
+    }
+    return NULL;
+}
+
+/* Records events from two threads at once, each into a block of its own the way the game's
+ * two threads do, then adds the blocks up and checks that every event is in the heatmaps and
+ * the histograms exactly once.
+ */
+void
+benchTelemetry(){
+    enum { THREADS = 2 };
+    static TelemetryBlock blocks[THREADS], merged;
+    pthread_t threads[THREADS];
+    long total = 0, cells = 0, bins = 0;
+    double start, recordTime, mergeTime;
+    
+    memset(blocks, 0, sizeof(blocks));
+    gameState = 3, levelTicks = 100;
+    start = monotonicSeconds();
+    for(int t = 0; t < THREADS; t++){
+        pthread_create(&threads[t], NULL, benchTelemetryThread, &blocks[t]);
+    }
+    for(int t = 0; t < THREADS; t++){
+        pthread_join(threads[t], NULL);
+    }
+    recordTime = monotonicSeconds() - start;
+    gameState = 0, levelTicks = 0;
+    
+    start = monotonicSeconds();
+    mergeTelemetry(blocks, THREADS, &merged);
+    mergeTime = monotonicSeconds() - start;
+    for(int k = 0; k < TELEMETRY_KINDS; k++){
+        total = total + merged.total[k];
+        for(int r = 0; r < TELEMETRY_ROWS; r++){
+            for(int c = 0; c < TELEMETRY_COLUMNS; c++){
+                cells = cells + merged.heat[k][2][r][c];
+            }
+        }
+        bins = bins + merged.times[k][2][100*TICK_MS/1000];
+    }
+    printf("telemetry: %ld events from %d threads at %.1f ns each, blocks merged in %.2f ms (%s)\n",
+           total, THREADS, 1e9*recordTime/total, 1e3*mergeTime,
+           (total == (long)THREADS*TELEMETRY_BENCH_EVENTS && cells == total && bins == total) ? "all there" : "EVENTS LOST");
+}